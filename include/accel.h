@@ -0,0 +1,517 @@
+#ifndef ACCEL_H
+#define ACCEL_H
+#include "donkey.h"
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace donkey {
+
+	namespace accel {
+
+		/**
+		* Axis aligned box with inline bounds, used by the acceleration structures
+		*/
+		struct aabb_t {
+			point_t lo;
+			point_t hi;
+
+			aabb_t():
+				lo(std::numeric_limits<float>::max()),
+				hi(-std::numeric_limits<float>::max()) {}
+			aabb_t(point_t const& l, point_t const& h): lo(l), hi(h) {}
+
+			inline void grow(point_t const& p) {
+				lo = glm::min(lo, p);
+				hi = glm::max(hi, p);
+			}
+
+			inline void grow(aabb_t const& b) {
+				lo = glm::min(lo, b.lo);
+				hi = glm::max(hi, b.hi);
+			}
+
+			inline bool valid() const { return lo.x <= hi.x && lo.y <= hi.y && lo.z <= hi.z; }
+			inline point_t centroid() const { return 0.5f * (lo + hi); }
+			inline vector_t extent() const { return hi - lo; }
+
+			inline float area() const {
+				if (!valid()) return 0.f;
+				vector_t e = extent();
+				return 2.f * (e.x * e.y + e.y * e.z + e.z * e.x);
+			}
+
+			inline int longestAxis() const {
+				vector_t e = extent();
+				return (e.x > e.y && e.x > e.z) ? 0 : (e.y > e.z ? 1 : 2);
+			}
+		};
+
+		/**
+		* World space bounds of a scene object.
+		* Returns false for unbounded objects (planes) and for types that have no bounds yet.
+		*/
+		bool bounds_of(object::scene_object_t const& object, aabb_t& box);
+
+		/**
+		* Precomputed ray data for the slab tests
+		*/
+		struct ray_data_t {
+			point_t 	origin;
+			vector_t 	invDir;
+
+			explicit ray_data_t(geom::ray_t const& ray):
+				origin(ray.point),
+				invDir(1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z) {}
+			ray_data_t(point_t const& o, vector_t const& inv): origin(o), invDir(inv) {}
+		};
+
+		/**
+		* Ray-box slab test. tMax is slightly widened so that a box is never rejected
+		* by rounding when a primitive inside it lies exactly at tMax.
+		*/
+		inline bool ray_box(aabb_t const& box, ray_data_t const& ray, float tMax, float& tNear) {
+			vector_t t0 = (box.lo - ray.origin) * ray.invDir;
+			vector_t t1 = (box.hi - ray.origin) * ray.invDir;
+			vector_t tmin = glm::min(t0, t1);
+			vector_t tmax = glm::max(t0, t1);
+			tNear = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.f));
+			float tFar = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, tMax)) * 1.0000004f;
+			return tNear <= tFar;
+		}
+
+		/**
+		* Rays of a pixel block that all leave the same point, with inverse
+		* directions as structure of arrays. The intervals of the inverse
+		* directions bound every ray of the block at once.
+		*/
+		struct ray_packet_t {
+			static const uint32_t kMaxRays = 256;		// 16 x 16 pixels
+
+			uint32_t 	count;
+			float 		org[3];
+			alignas(32) float inv[3][kMaxRays];
+			alignas(32) float tMax[kMaxRays];			// per ray, lowered by the leaf visitor
+			float 		invLo[3];
+			float 		invHi[3];
+			bool 		coherent[3];					// direction signs agree along the axis
+
+			ray_packet_t(): count(0) {}
+
+			inline void reset(point_t const& origin) {
+				count = 0;
+				for (int a = 0; a < 3; ++a)
+					org[a] = origin[a];
+			}
+
+			inline void add(vector_t const& direction) {
+				for (int a = 0; a < 3; ++a)
+					inv[a][count] = 1.f / direction[a];
+				tMax[count] = std::numeric_limits<float>::max();
+				++count;
+			}
+
+			/**
+			* Bound the inverse directions, once all rays are added
+			*/
+			void finish() {
+				for (int a = 0; a < 3; ++a) {
+					invLo[a] = std::numeric_limits<float>::infinity();
+					invHi[a] = -std::numeric_limits<float>::infinity();
+					bool neg = false, pos = false;
+					for (uint32_t r = 0; r < count; ++r) {
+						invLo[a] = std::min(invLo[a], inv[a][r]);
+						invHi[a] = std::max(invHi[a], inv[a][r]);
+						(std::signbit(inv[a][r]) ? neg : pos) = true;
+					}
+					coherent[a] = !(neg && pos);
+				}
+			}
+		};
+
+		/**
+		* Interval arithmetic test of a whole packet against a box. False only if
+		* no ray of the packet can hit the box; the ray parameters are ignored.
+		*/
+		inline bool packet_box(float const (&lo)[3], float const (&hi)[3], ray_packet_t const& packet) {
+			float tNear = 0.f, tFar = std::numeric_limits<float>::max();
+			for (int a = 0; a < 3; ++a) {
+				if (!packet.coherent[a]) continue;
+				const bool neg = std::signbit(packet.invLo[a]);
+				const float n = (neg ? hi[a] : lo[a]) - packet.org[a];
+				const float f = (neg ? lo[a] : hi[a]) - packet.org[a];
+				// rounding is monotonic, so the interval ends bound every ray's own slab distances
+				tNear = std::max(tNear, std::min(n * packet.invLo[a], n * packet.invHi[a]));
+				tFar = std::min(tFar, std::max(f * packet.invLo[a], f * packet.invHi[a]));
+			}
+			return tNear <= tFar * 1.0000004f;
+		}
+
+		/**
+		* Slab test of the eight rays from base on, base a multiple of 8.
+		* Returns the mask of the rays that hit the box before their tMax.
+		*/
+		inline int packet_rays_box(float const (&lo)[3], float const (&hi)[3], ray_packet_t const& packet, uint32_t base) {
+#if defined(__AVX__)
+			__m256 tn = _mm256_setzero_ps();
+			__m256 tf = _mm256_load_ps(&packet.tMax[base]);
+			for (int a = 0; a < 3; ++a) {
+				const __m256 inv = _mm256_load_ps(&packet.inv[a][base]);
+				const __m256 t0 = _mm256_mul_ps(_mm256_set1_ps(lo[a] - packet.org[a]), inv);
+				const __m256 t1 = _mm256_mul_ps(_mm256_set1_ps(hi[a] - packet.org[a]), inv);
+				tn = _mm256_max_ps(tn, _mm256_min_ps(t0, t1));
+				tf = _mm256_min_ps(tf, _mm256_max_ps(t0, t1));
+			}
+			int mask = _mm256_movemask_ps(_mm256_cmp_ps(tn, _mm256_mul_ps(tf, _mm256_set1_ps(1.0000004f)), _CMP_LE_OQ));
+#else
+			int mask = 0;
+			for (uint32_t k = 0; k < 8; ++k) {
+				const uint32_t r = base + k;
+				float tn = 0.f, tf = packet.tMax[r];
+				for (int a = 0; a < 3; ++a) {
+					const float t0 = (lo[a] - packet.org[a]) * packet.inv[a][r];
+					const float t1 = (hi[a] - packet.org[a]) * packet.inv[a][r];
+					tn = std::max(tn, std::min(t0, t1));
+					tf = std::min(tf, std::max(t0, t1));
+				}
+				if (tn <= tf * 1.0000004f) mask |= 1 << k;
+			}
+#endif
+			// lanes past the last ray hold stale data
+			if (packet.count - base < 8)
+				mask &= (1 << (packet.count - base)) - 1;
+			return mask;
+		}
+
+		/**
+		* First ray from first on that hits the box, packet.count if there is none
+		*/
+		inline uint32_t packet_first_hit(float const (&lo)[3], float const (&hi)[3], ray_packet_t const& packet, uint32_t first) {
+			for (uint32_t base = first & ~7u; base < packet.count; base += 8) {
+				int mask = packet_rays_box(lo, hi, packet, base);
+				if (base < first)
+					mask &= ~((1 << (first - base)) - 1);
+				if (mask)
+					return base + __builtin_ctz(mask);
+			}
+			return packet.count;
+		}
+
+		/**
+		* Collect the rays from first on that hit the box. Returns their number.
+		*/
+		inline uint32_t packet_hits(float const (&lo)[3], float const (&hi)[3], ray_packet_t const& packet,
+									uint32_t first, uint32_t* rays) {
+			uint32_t hits = 0;
+			for (uint32_t base = first & ~7u; base < packet.count; base += 8) {
+				int mask = packet_rays_box(lo, hi, packet, base);
+				if (base < first)
+					mask &= ~((1 << (first - base)) - 1);
+				for (; mask; mask &= mask - 1)
+					rays[hits++] = base + __builtin_ctz(mask);
+			}
+			return hits;
+		}
+
+		inline uint64_t spread_bits(uint64_t x, int bits) {
+			// interleave the low bits of x with two zero bits each
+			if (bits <= 10) {
+				x &= 0x3ff;
+				x = (x | (x << 16)) & 0x030000ff;
+				x = (x | (x << 8)) & 0x0300f00f;
+				x = (x | (x << 4)) & 0x030c30c3;
+				x = (x | (x << 2)) & 0x09249249;
+				return x;
+			}
+			x &= 0x1fffff;
+			x = (x | (x << 32)) & 0x001f00000000ffffull;
+			x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+			x = (x | (x << 8)) & 0x100f00f00f00f00full;
+			x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+			x = (x | (x << 2)) & 0x1249249249249249ull;
+			return x;
+		}
+
+		/**
+		* Morton code of a point in [0, 1]^3 with bitsPerAxis bits per axis, 10 or 21
+		*/
+		inline uint64_t morton_code(point_t const& p, int bitsPerAxis) {
+			const float scale = float((1u << bitsPerAxis) - 1);
+			uint64_t x = (uint64_t)glm::clamp(p.x * scale, 0.f, scale);
+			uint64_t y = (uint64_t)glm::clamp(p.y * scale, 0.f, scale);
+			uint64_t z = (uint64_t)glm::clamp(p.z * scale, 0.f, scale);
+			return (spread_bits(x, bitsPerAxis) << 2) | (spread_bits(y, bitsPerAxis) << 1) | spread_bits(z, bitsPerAxis);
+		}
+
+		enum accel_type {
+			kBVH,
+			kBVH4,
+			kBVH8,
+			kGrid,
+			kQBVH8,
+			kNumAccelTypes
+		};
+
+		// spatial index used for the objects of a scene
+		enum index_type {
+			kIndexBVH,
+			kIndexGrid,
+			kNumIndexTypes
+		};
+
+		/**
+		* Base of all acceleration structures. Traversal is not virtual: the intersector
+		* switches on the type and calls the templated traversal of the concrete structure.
+		*/
+		struct accelerator_t {
+			accel_type type;
+			explicit accelerator_t(accel_type atype):type(atype) {}
+			virtual ~accelerator_t() {}
+		};
+
+		/**
+		* 32 byte binary BVH node. Interior nodes have count == 0, their first child
+		* directly follows them and offset holds the second child. Leaves reference
+		* [offset, offset + count) in bvh_t::indices.
+		*/
+		struct bvh_node_t {
+			aabb_t 		bounds;
+			uint32_t 	offset;
+			uint32_t 	count;
+
+			inline bool isLeaf() const { return count != 0; }
+		};
+
+		enum build_type {
+			kBuildSAH,			// binned SAH, best trees
+			kBuildLBVH,			// parallel Morton code build, fastest builds
+			kBuildSBVH,			// SAH with spatial splits, triangles only, falls back to SAH on plain bounds
+			kNumBuildTypes
+		};
+
+		struct build_params_t {
+			int 	maxLeafSize;
+			int 	numBins;
+			float 	traversalCost;
+			float 	intersectionCost;
+			int 	mortonBits;			// 30 or 63, 0 picks by primitive count
+			int 	numThreads;			// 0 uses all hardware threads
+			float 	splitBudget;		// SBVH: extra triangle references allowed, as a fraction of the triangle count
+			build_params_t():
+				maxLeafSize(4), numBins(16), traversalCost(1.f), intersectionCost(1.f),
+				mortonBits(0), numThreads(0), splitBudget(0.3f) {}
+		};
+
+		// Morton builds with duplicate codes can go deeper than SAH builds
+		const int kMaxTraversalDepth = 128;
+
+		struct bvh_t: public accelerator_t {
+			std::vector<bvh_node_t> nodes;
+			std::vector<uint32_t> 	indices;		// object indices, in leaf order
+			std::vector<uint32_t> 	unbounded;		// objects that cannot be put in the tree
+
+			bvh_t(): accelerator_t(kBVH) {}
+
+			/**
+			* Visit every object whose leaf is pierced by the ray before tMax, nearest
+			* leaves first. The visitor is called as visit(objectIndex, tMax) and lowers
+			* tMax when it records a closer hit. Setting tMax below zero ends the walk,
+			* which is how any-hit queries stop at their first hit.
+			*/
+			template <typename Visitor>
+			void traverse(geom::ray_t const& ray, float& tMax, Visitor&& visit) const {
+				traverseLeaves(ray, tMax, [&](uint32_t const* objects, uint32_t count, float& tmax) {
+					for (uint32_t i = 0; i < count; ++i)
+						visit(objects[i], tmax);
+				});
+			}
+
+			/**
+			* Same as traverse, but the visitor gets the objects of a whole leaf at
+			* once: visitLeaf(objectIndices, count, tMax). The unbounded objects come
+			* first, as one leaf.
+			*/
+			template <typename LeafVisitor>
+			void traverseLeaves(geom::ray_t const& ray, float& tMax, LeafVisitor&& visitLeaf) const {
+				if (!unbounded.empty())
+					visitLeaf(unbounded.data(), unbounded.size(), tMax);
+
+				if (nodes.empty()) return;
+
+				const ray_data_t rd(ray);
+				float tNear;
+				if (!ray_box(nodes[0].bounds, rd, tMax, tNear)) return;
+
+				struct entry_t { uint32_t node; float tNear; };
+				entry_t stack[kMaxTraversalDepth];
+				int sp = 0;
+				uint32_t idx = 0;
+
+				while (true) {
+					bvh_node_t const& node = nodes[idx];
+					if (node.isLeaf()) {
+						visitLeaf(&indices[node.offset], node.count, tMax);
+					} else {
+						uint32_t c0 = idx + 1, c1 = node.offset;
+						float t0, t1;
+						bool h0 = ray_box(nodes[c0].bounds, rd, tMax, t0);
+						bool h1 = ray_box(nodes[c1].bounds, rd, tMax, t1);
+						if (h0 && h1) {
+							if (t1 < t0) { std::swap(c0, c1); std::swap(t0, t1); }
+							stack[sp++] = { c1, t1 };
+							idx = c0;
+							continue;
+						} else if (h0 || h1) {
+							idx = h0 ? c0 : c1;
+							continue;
+						}
+					}
+
+					// pop the next node that is still in front of the closest hit
+					bool found = false;
+					while (sp > 0) {
+						entry_t const& top = stack[--sp];
+						if (top.tNear <= tMax) {
+							idx = top.node;
+							found = true;
+							break;
+						}
+					}
+					if (!found) break;
+				}
+			}
+
+			/**
+			* Trace a whole packet: a node is opened when the interval test passes and
+			* one of its rays hits it, searching from the first ray that hit its parent.
+			* The visitor is called as visitLeaf(objectIndices, count, rays, numRays)
+			* with the rays that hit the leaf, and lowers their packet.tMax.
+			*/
+			template <typename LeafVisitor>
+			void traversePacket(ray_packet_t& packet, LeafVisitor&& visitLeaf) const {
+				uint32_t rays[ray_packet_t::kMaxRays];
+				if (!unbounded.empty()) {
+					for (uint32_t r = 0; r < packet.count; ++r)
+						rays[r] = r;
+					visitLeaf(unbounded.data(), unbounded.size(), rays, packet.count);
+				}
+
+				if (nodes.empty()) return;
+
+				struct entry_t { uint32_t node; uint32_t first; };
+				entry_t stack[kMaxTraversalDepth + 1];
+				int sp = 0;
+				stack[sp++] = { 0, 0 };
+
+				while (sp > 0) {
+					entry_t const top = stack[--sp];
+					bvh_node_t const& node = nodes[top.node];
+					const float lo[3] = { node.bounds.lo.x, node.bounds.lo.y, node.bounds.lo.z };
+					const float hi[3] = { node.bounds.hi.x, node.bounds.hi.y, node.bounds.hi.z };
+					if (!packet_box(lo, hi, packet)) continue;
+
+					const uint32_t first = packet_first_hit(lo, hi, packet, top.first);
+					if (first == packet.count) continue;
+
+					if (node.isLeaf()) {
+						const uint32_t numRays = packet_hits(lo, hi, packet, first, rays);
+						visitLeaf(&indices[node.offset], node.count, rays, numRays);
+						continue;
+					}
+
+					// the first active ray orders the children
+					const ray_data_t rd(point_t(packet.org[0], packet.org[1], packet.org[2]),
+										vector_t(packet.inv[0][first], packet.inv[1][first], packet.inv[2][first]));
+					uint32_t c0 = top.node + 1, c1 = node.offset;
+					float t0, t1;
+					ray_box(nodes[c0].bounds, rd, packet.tMax[first], t0);
+					ray_box(nodes[c1].bounds, rd, packet.tMax[first], t1);
+					if (t1 < t0) std::swap(c0, c1);
+					stack[sp++] = { c1, first };
+					stack[sp++] = { c0, first };
+				}
+			}
+		};
+
+		/**
+		* Memory held by an acceleration structure
+		*/
+		struct memory_stats_t {
+			size_t 	nodes;
+			size_t 	nodeBytes;
+			size_t 	indexBytes;
+			memory_stats_t(): nodes(0), nodeBytes(0), indexBytes(0) {}
+		};
+
+		inline memory_stats_t memory_stats(bvh_t const& bvh) {
+			memory_stats_t stats;
+			stats.nodes = bvh.nodes.size();
+			stats.nodeBytes = bvh.nodes.size() * sizeof(bvh_node_t);
+			stats.indexBytes = (bvh.indices.size() + bvh.unbounded.size()) * sizeof(uint32_t);
+			return stats;
+		}
+
+		/**
+		* Bounds of every object, in object order. Objects without bounds get an
+		* empty box, which the builders keep out of the tree.
+		*/
+		void object_bounds(scene_object_list const& objects, std::vector<aabb_t>& bounds, int numThreads = 0);
+
+		/**
+		* Remove the planes from the unbounded objects of a tree or grid. The
+		* compiled scene tests them up front, so traversals do not visit them.
+		*/
+		void drop_planes(scene_object_list const& objects, std::vector<uint32_t>& unbounded);
+
+		/**
+		* Top-down binned surface area heuristic build over a list of primitive bounds.
+		* The indices of the resulting tree refer to positions in that list.
+		*/
+		void build_sah(std::vector<aabb_t> const& bounds, bvh_t& bvh,
+					   build_params_t const& params = build_params_t());
+
+		/**
+		* Linear BVH build (Karras 2012): centroids are sorted by Morton code with a
+		* parallel radix sort and the hierarchy is emitted on all threads.
+		* Subtrees of at most maxLeafSize objects are collapsed into leaves.
+		*/
+		void build_lbvh(std::vector<aabb_t> const& bounds, bvh_t& bvh,
+						build_params_t const& params = build_params_t());
+
+		/**
+		* Spatial split BVH (Stich et al. 2009) over triangles given as three
+		* vertices each. Where object split children overlap, triangles are also
+		* split at bin planes and referenced from both sides, so long thin
+		* triangles no longer blow up the boxes they land in. Splitting stops once
+		* splitBudget * triangles extra references are used. The indices are
+		* triangle numbers and may repeat.
+		*/
+		void build_sbvh(std::vector<point_t> const& vertices, bvh_t& bvh,
+						build_params_t const& params = build_params_t());
+
+		void build(build_type type, std::vector<aabb_t> const& bounds, bvh_t& bvh,
+				   build_params_t const& params = build_params_t());
+
+		void build(build_type type, scene_object_list const& objects, bvh_t& bvh,
+				   build_params_t const& params = build_params_t());
+
+		/**
+		* Recompute node bounds bottom-up from new primitive bounds, keeping the
+		* topology. The bounds list must have the layout the tree was built from.
+		*/
+		void refit(bvh_t& bvh, std::vector<aabb_t> const& bounds);
+
+		/**
+		* SAH cost of a tree relative to its root box. Refits grow it as the tree
+		* drifts away from the scene, a rebuild brings it back down.
+		*/
+		float sah_cost(bvh_t const& bvh, build_params_t const& params = build_params_t());
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#ifndef ACCEL_CACHE_H
+#define ACCEL_CACHE_H
+#include "accel.h"
+#include "wide_bvh.h"
+#include "quantized_bvh.h"
+#include "grid.h"
+#include "mesh_accel.h"
+#include <memory>
+#include <string>
+
+namespace donkey {
+
+	namespace accel {
+
+		const uint64_t kHashSeed = 0xcbf29ce484222325ull;
+
+		/**
+		* 64 bit FNV-1a, continued from hash
+		*/
+		uint64_t hash_bytes(void const* data, size_t size, uint64_t hash = kHashSeed);
+
+		/**
+		* Content hash of everything the acceleration structures are built from:
+		* object types and bounds, instance transforms and mesh geometry.
+		* seed folds in the build settings.
+		*/
+		uint64_t scene_hash(scene_object_list const& objects, uint64_t seed = kHashSeed);
+
+		/**
+		* Built structures of a scene, as stored in a cache file
+		*/
+		struct cached_accel_t {
+			std::shared_ptr<accelerator_t> 	accel;
+			std::shared_ptr<instances_t> 	instances;
+			float 							cost;			// SAH cost after the build, for refits
+			size_t 							fullBytes;		// node bytes before compression, 0 if not compressed
+			cached_accel_t(): cost(0.f), fullBytes(0) {}
+		};
+
+		std::string cache_file(std::string const& directory, uint64_t hash);
+
+		/**
+		* Write the structures to file. Every call writes a temporary file of its
+		* own and renames it into place once it is synced, so concurrent runs
+		* never see a partial or mixed cache.
+		*/
+		bool save_cache(std::string const& file, uint64_t hash, cached_accel_t const& cached);
+
+		/**
+		* Read the structures from a cache file. Their arrays are copied out of
+		* the file, not used in place: every index is checked before use anyway,
+		* and trees are refit in place on later frames. Fails if the file is
+		* missing, was written for another hash or format, or does not fit the
+		* objects. Mesh trees are bound to the meshes of the objects.
+		*/
+		bool load_cache(std::string const& file, uint64_t hash, scene_object_list const& objects, cached_accel_t& cached);
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,240 @@
+#ifndef COMPILED_SCENE_H
+#define COMPILED_SCENE_H
+#include "accel.h"
+
+namespace donkey {
+
+	namespace accel {
+
+		/**
+		* A scene frozen into flat arrays for tracing. Every scene object becomes
+		* a handle into the array of its type and into the materials, so that the
+		* tracer never touches the shared pointers, casts or virtual calls of
+		* scene_t. Meshes and instances keep a plain pointer to their object for
+		* the mesh trees.
+		*/
+		struct compiled_scene_t {
+			/**
+			* Object kinds a scene may hold. Kernels are instantiated for a set of
+			* kinds and leave out the code of every other kind.
+			*/
+			enum kind_bits {
+				kKindSphere 	= 1,
+				kKindPlane 		= 2,
+				kKindBox 		= 4,
+				kKindTriangle 	= 8,
+				kKindMesh 		= 16,		// meshes and instances
+				kKindOther 		= 32,		// objects that are never hit
+				kAllKinds 		= 63
+			};
+
+			static constexpr unsigned kind_bit(object::object_type type) {
+				return type == object::kSphere ? kKindSphere :
+					type == object::kPlane ? kKindPlane :
+					type == object::kCube ? kKindBox :
+					type == object::kTriangle ? kKindTriangle :
+					(type == object::kMesh || type == object::kInstance) ? kKindMesh : kKindOther;
+			}
+
+			/**
+			* The one object type of a set of kinds, kNumObjectTypes when objects
+			* of that set can have more than one type
+			*/
+			static constexpr object::object_type single_type(unsigned kinds) {
+				return kinds == kKindSphere ? object::kSphere :
+					kinds == kKindPlane ? object::kPlane :
+					kinds == kKindBox ? object::kCube :
+					kinds == kKindTriangle ? object::kTriangle : object::kNumObjectTypes;
+			}
+
+			struct object_t {
+				object::object_type 	type;
+				uint32_t 				index;		// into the array of its type
+				uint32_t 				material;	// into materials
+			};
+
+			struct sphere_t {
+				point_t 	center;
+				float 		radius;
+			};
+
+			struct plane_t {
+				vector_t 	normal;
+				point_t 	point;
+			};
+
+			struct box_t {
+				point_t 	lo;
+				point_t 	hi;
+			};
+
+			struct triangle_t {
+				geom::triangle_edges_t 	edges;
+				vector_t 				normal;
+			};
+
+			struct light_t {
+				point_t 	position;
+				rgb_t 		color;
+				float 		intensity;
+			};
+
+			std::vector<object_t> 						objects;	// per scene object, in scene order
+			std::vector<sphere_t> 						spheres;
+			std::vector<plane_t> 						planes;
+			std::vector<box_t> 							boxes;
+			std::vector<triangle_t> 					triangles;
+			std::vector<object::scene_object_t const*> 	meshes;		// mesh and instance objects
+			std::vector<color::color_desc_t> 			materials;
+			std::vector<light_t> 						lights;		// point lights
+			unsigned 									kinds;		// kind_bits of the objects
+
+			// Planes have no bounds and sit outside every tree. They are tested up
+			// front, all at once, from a structure of arrays padded to kPlaneLanes
+			// with planes no ray hits, and their nearest hit seeds tMax.
+			static const uint32_t 						kPlaneLanes = 8;
+			std::vector<float> 							planeNx;
+			std::vector<float> 							planeNy;
+			std::vector<float> 							planeNz;
+			std::vector<float> 							planeNd;	// dot of the normal and the plane point
+			std::vector<uint32_t> 						planeObjects;	// scene object index per plane
+
+			compiled_scene_t(): kinds(0) {}
+
+			/**
+			* Fill the arrays from the scene. Objects the tracer cannot draw get a
+			* handle of type kNumObjectTypes that is never hit.
+			*/
+			void build(scene_t const& scene);
+
+			/**
+			* Nearest hit closer than tMax on an object that is not searched through
+			* the mesh trees, see raycast::on_object. Kinds must cover the kinds of
+			* the scene; with a single kind there is no type dispatch at all.
+			*/
+			template <unsigned Kinds = kAllKinds>
+			bool intersect(uint32_t objectIdx, geom::ray_t const& ray, float tMax, geom::hit_t& hit) const;
+
+			/**
+			* Unit normal at a hit on the object. Instances take theirs from the
+			* mesh trees and get a zero vector here.
+			*/
+			template <unsigned Kinds = kAllKinds>
+			vector_t normalAt(uint32_t objectIdx, geom::hit_t const& hit, point_t const& point) const;
+
+			inline color::color_desc_t const& materialOf(uint32_t objectIdx) const {
+				return materials[objects[objectIdx].material];
+			}
+
+			/**
+			* Lanes of planes [first, first + kPlaneLanes) the ray may hit before
+			* tMax, as a bit mask. Slightly conservative, intersect decides.
+			*/
+			uint32_t planeMask(uint32_t first, geom::ray_t const& ray, float tMax) const;
+
+			/**
+			* Call visit(objectIdx) for every plane the ray may hit before tMax
+			*/
+			template <typename Visitor>
+			void candidatePlanes(geom::ray_t const& ray, float tMax, Visitor&& visit) const {
+				for (uint32_t first = 0, e = planeObjects.size(); first < e; first += kPlaneLanes) {
+					for (uint32_t mask = planeMask(first, ray, tMax); mask; mask &= mask - 1)
+						visit(planeObjects[first + __builtin_ctz(mask)]);
+				}
+			}
+		};
+
+		template <unsigned Kinds>
+		inline bool compiled_scene_t::intersect(uint32_t objectIdx, geom::ray_t const& ray, float tMax, geom::hit_t& hit) const {
+			object_t const& object = objects[objectIdx];
+			const object::object_type type = (single_type(Kinds) != object::kNumObjectTypes) ? single_type(Kinds) : object.type;
+			float t = tMax;
+			float u = 0.f, v = 0.f;
+			uint32_t primitive = 0;
+			switch (type) {
+				case object::kSphere: {
+					if (!(Kinds & kKindSphere)) return false;
+					// both roots are ahead of the ray, t1 is the nearer one
+					sphere_t const& sphere = spheres[object.index];
+					float t0;
+					if (!algo::raycast::on_sphere(sphere.center, sphere.radius, ray, t0, t)) return false;
+					break;
+				}
+
+				case object::kPlane: {
+					if (!(Kinds & kKindPlane)) return false;
+					plane_t const& plane = planes[object.index];
+					if (!algo::raycast::on_plane(plane.normal, plane.point, ray, t)) return false;
+					break;
+				}
+
+				case object::kCube: {
+					if (!(Kinds & kKindBox)) return false;
+					box_t const& box = boxes[object.index];
+					float tFar;
+					primitive::cube_t::face_id faceid;
+					if (!algo::raycast::on_box(box.lo, box.hi, ray, t, tFar, faceid)) return false;
+					if (t < 0.f) t = tFar;
+					primitive = faceid;
+					break;
+				}
+
+				case object::kTriangle: {
+					if (!(Kinds & kKindTriangle)) return false;
+					if (!algo::raycast::on_triangle(triangles[object.index].edges, ray, t, u, v)) return false;
+					break;
+				}
+
+				case object::kMesh:
+				case object::kInstance:
+					if (!(Kinds & kKindMesh)) return false;
+					return algo::raycast::on_object(*meshes[object.index], ray, tMax, hit);
+
+				default:
+					return false;
+			}
+
+			if (!(t < tMax)) return false;
+			hit.t = t;
+			hit.primitive = primitive;
+			hit.u = u;
+			hit.v = v;
+			return true;
+		}
+
+		template <unsigned Kinds>
+		inline vector_t compiled_scene_t::normalAt(uint32_t objectIdx, geom::hit_t const& hit, point_t const& point) const {
+			object_t const& object = objects[objectIdx];
+			const object::object_type type = (single_type(Kinds) != object::kNumObjectTypes) ? single_type(Kinds) : object.type;
+			switch (type) {
+				case object::kSphere:
+					return glm::normalize(point - spheres[object.index].center);
+				case object::kPlane:
+					return planes[object.index].normal;
+				case object::kCube:
+					return primitive::cube_t::faceNormal(primitive::cube_t::face_id(hit.primitive));
+				case object::kTriangle:
+					return triangles[object.index].normal;
+				case object::kMesh:
+				case object::kInstance: {
+					// instances take the face normal of their mesh by the inverse transpose
+					primitive::instance_t const* instance = (type == object::kInstance) ?
+						static_cast<primitive::instance_t const*>(meshes[object.index]) : nullptr;
+					object::trimesh_t const& mesh = instance ? *instance->mesh :
+						static_cast<object::trimesh_t const&>(*meshes[object.index]);
+					auto const& vertices = mesh.geometry.vertices;
+					uint32_t const* index = mesh.geometry.faces[hit.primitive].index;
+					vector_t n = glm::cross(vertices[index[1]].position - vertices[index[0]].position,
+											vertices[index[2]].position - vertices[index[0]].position);
+					if (instance)
+						n = glm::transpose(glm::mat3(instance->inverse)) * n;
+					return glm::normalize(n);
+				}
+				default:;
+			}
+			return vector_t(0.f, 0.f, 0.f);
+		}
+	}
+}
+
+#endif
@@ -7,6 +7,8 @@
 #include <string>
 #include <cmath>
 #include <functional>
+#include <memory>
+#include <limits>
 
 namespace donkey {
 
@@ -43,7 +45,8 @@ namespace donkey {
 			rgb_t	specular;
 			rgb_t	ambient;
 			float 	shininess;
-			color_desc_t():shininess(1.0f) {}
+			float 	reflectivity;		// share of the color taken from the mirror direction
+			color_desc_t():shininess(1.0f), reflectivity(0.f) {}
 		};
 
 		struct texture_t {
@@ -80,6 +83,31 @@ namespace donkey {
 			std::vector<face_type>	faces;
 		};
 
+		/**
+		* Triangle as one vertex and the two edges leaving it, what the
+		* ray-triangle test needs without touching the vertex list
+		*/
+		struct triangle_edges_t {
+			point_t 	v0;
+			vector_t 	e1;			// v1 - v0
+			vector_t 	e2;			// v2 - v0
+			triangle_edges_t() {}
+			triangle_edges_t(point_t const& p0, point_t const& p1, point_t const& p2):
+				v0(p0), e1(p1 - p0), e2(p2 - p0) {}
+		};
+
+		/**
+		* Hit of a ray along its parameter t. For meshes primitive is the face,
+		* u and v are the barycentrics of v1 and v2 on triangles.
+		*/
+		struct hit_t {
+			float 		t;
+			uint32_t 	primitive;
+			float 		u;
+			float 		v;
+			hit_t(): t(std::numeric_limits<float>::max()), primitive(0), u(0.f), v(0.f) {}
+		};
+
 		struct ray_t {
 			point_t		point;
 			vector_t	direction;
@@ -115,6 +143,7 @@ namespace donkey {
 
 		enum object_type {
 			kMesh,
+			kInstance,
 			kCube,
 			kSphere,
 			kTriangle,
@@ -205,22 +234,26 @@ namespace donkey {
 			plane_t(vector_t const& planeNormal, vector_t const& planePoint):
 				primitive_t(object::kPlane),
 				normal(planeNormal), point(planePoint) {}
+		protected:
+			explicit plane_t(object::object_type type): primitive_t(type) {}
+		public:
 
 			vector_t getNormalAt(point_t const&) const {
 				return normal;
 			}
 		};
 
-		struct triangle_t: public plane_t, public primitive_t {
+		struct triangle_t: public plane_t {
 			point_t 	v0;
 			point_t 	v1;
 			point_t 	v2;
+			geom::triangle_edges_t 	edges;		// of v0, v1, v2, for the ray test
 
 			triangle_t(point_t p1, point_t p2, point_t p3):
-			primitive_t(object::kTriangle),
-			v0(p1), v1(p2), v2(p3)
+			plane_t(object::kTriangle),
+			v0(p1), v1(p2), v2(p3), edges(p1, p2, p3)
 			{
-				normal = glm::cross(v0 - v1, v0 - v2);
+				normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
 				point = v0;
 			}
 
@@ -229,8 +262,11 @@ namespace donkey {
 			}
 		};
 
+		/**
+		* Axis aligned cube, kept as its two corners so that the ray test is a
+		* slab test on inline data
+		*/
 		struct cube_t : public primitive_t {
-		public:	
 			enum face_id {
 				kFaceTop,
 				kFaceBottom,
@@ -240,30 +276,19 @@ namespace donkey {
 				kFaceBack,
 				kNumFaceIds
 			};
-			
-		private:
-			inline glm::vec2 vecBound(face_id type, point_t const& p) const {
-				switch (type) {
-					case kFaceTop:
-					case kFaceBottom:
-						return glm::vec2(p.x, p.z);
-					case kFaceBack:
-					case kFaceFront: 
-						return glm::vec2(p.x, p.y);
-					case kFaceLeft:
-					case kFaceRight:
-						return glm::vec2(p.y, p.z);
-					default:;
-				}
-				return glm::vec2(0.0f, 0.0f);
-			}
 
-		public:	
 			float halfSize;
-			std::vector<plane_t> planes;
-			geom::bbox_t<2, float> bounds[kNumFaceIds];
+			point_t center;
+			point_t lo;
+			point_t hi;
 			cube_t(float size, point_t origin = point_t(0, 0, 0));
-			bool inFace(face_id id, point_t const& p) const;
+
+			static vector_t faceNormal(face_id id);
+			face_id faceAt(point_t const& p) const;
+
+			vector_t getNormalAt(point_t const& point) const {
+				return faceNormal(faceAt(point));
+			}
 		};
 
 		struct sphere_t: public primitive_t {
@@ -274,6 +299,27 @@ namespace donkey {
 				return glm::normalize(point - center);
 			}
 		};
+
+		/**
+		* A placement of a shared triangle mesh. Every instance only stores its
+		* transform, the geometry is referenced, not copied.
+		*/
+		struct instance_t: public primitive_t {
+			std::shared_ptr<object::trimesh_t> 	mesh;
+			glm::mat4 							transform;		// object to world
+			glm::mat4 							inverse;		// world to object
+
+			explicit instance_t(std::shared_ptr<object::trimesh_t> const& geometry,
+								glm::mat4 const& objectToWorld = glm::mat4(1.0f)):
+				primitive_t(object::kInstance), mesh(geometry) {
+				setTransform(objectToWorld);
+			}
+
+			void setTransform(glm::mat4 const& objectToWorld) {
+				transform = objectToWorld;
+				inverse = glm::inverse(objectToWorld);
+			}
+		};
 	}
 
 	typedef std::shared_ptr<object::scene_object_t> scene_object_ptr;
@@ -298,13 +344,36 @@ namespace donkey {
 		point_t barycentric(primitive::triangle_t const& tri, point_t const& point);
 
 		namespace raycast {
+			bool on_plane(vector_t const& normal, point_t const& point, geom::ray_t const& ray, float& t);
+			bool on_plane(primitive::plane_t const& plane, geom::ray_t const& ray, float& t);
 			bool on_plane(primitive::plane_t const& plane, geom::ray_t const& ray, point_t& point);
 			bool on_triangle(primitive::triangle_t const& tri, geom::ray_t const& ray, point_t& point);
+			bool on_triangle(point_t const& v0, point_t const& v1, point_t const& v2, geom::ray_t const& ray,
+							 float& t, float& u, float& v);
+			bool on_triangle(geom::triangle_edges_t const& tri, geom::ray_t const& ray,
+							 float& t, float& u, float& v);
+			/**
+			* Slab test, the ray parameters where the ray enters and leaves the box
+			* and the face it is hit on: the entry face, or the exit face when the
+			* ray starts inside.
+			*/
+			bool on_box(point_t const& lo, point_t const& hi, geom::ray_t const& ray,
+						float& tNear, float& tFar, primitive::cube_t::face_id& faceid);
+			bool on_cube(primitive::cube_t const& cube, geom::ray_t const& ray,
+						 float& tNear, float& tFar, primitive::cube_t::face_id& faceid);
 			bool on_cube(primitive::cube_t const& cube, geom::ray_t const& ray, 
 						 point_t& point, primitive::cube_t::face_id& faceid);
+			bool on_sphere(point_t const& center, float radius, geom::ray_t const& ray,
+						float& t0, float& t1);
+			bool on_sphere(primitive::sphere_t const& sphere, geom::ray_t const& ray,
+						float& t0, float& t1);
 			bool on_sphere(primitive::sphere_t const& sphere, geom::ray_t const& ray,
 						point_t& p1, point_t& p2);
-			bool on_object(scene_object_ptr object, geom::ray_t const& ray, points_v& points);
+			/**
+			* Nearest hit of the ray on the object closer than tMax, written to hit.
+			* Returns false, leaving hit alone, when there is none.
+			*/
+			bool on_object(object::scene_object_t const& object, geom::ray_t const& ray, float tMax, geom::hit_t& hit);
 		}
 	}
 
@@ -0,0 +1,54 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bray {
+
+	namespace image {
+
+		enum transfer_type {
+			kTransferLinear,		// colors written as they are
+			kTransferGamma,			// raised to 1 / gamma
+			kTransferSRGB 			// the sRGB curve
+		};
+
+		/**
+		* How linear colors become 8 bit values: clamped to [0, 1], put through
+		* the transfer curve and quantized. Curves other than linear are looked
+		* up in a table of kCurveSteps + 1 values over [0, 1].
+		*/
+		struct output_curve_t {
+			static const int32_t 	kCurveSteps = 4095;
+
+			transfer_type 			transfer;
+			float 					gamma;
+			std::vector<int32_t> 	table;
+
+			explicit output_curve_t(transfer_type transferType = kTransferLinear, float gammaValue = 2.2f);
+		};
+
+		/**
+		* Convert count pixels of RGBA floats, times scale, to BGR bytes. Linear
+		* output truncates like a cast of value * 255.
+		*/
+		void convert_pixels(float const* rgba, unsigned char* bgr, size_t count, float scale,
+							output_curve_t const& curve);
+
+		/**
+		* Instruction set of the conversion, picked once from CPUID: "avx2" or "scalar"
+		*/
+		const char* convert_kernel_name();
+
+		/**
+		* Switch the conversion to "avx2" or "scalar". Returns false, changing
+		* nothing, when the CPU lacks the instruction set. Not to be called while
+		* images are converted.
+		*/
+		bool use_convert_kernel(std::string const& name);
+	}
+}
+
+#endif
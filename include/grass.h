@@ -6,6 +6,7 @@
 #include "newbray.h"
 #include <fstream>
 #include <exception>
+#include <map>
 
 namespace grass {
 
@@ -24,8 +25,105 @@ namespace grass {
 					val[2].GetDouble()
 				);
 		}
+
+		inline donkey::point_t toPoint(rapidjson::Value const& val) {
+			return donkey::point_t(
+					val[0].GetDouble(),
+					val[1].GetDouble(),
+					val[2].GetDouble()
+				);
+		}
+
+		inline donkey::color::material_t toMaterial(rapidjson::Value const& val) {
+			donkey::color::material_t mat;
+
+			if (val["color"].IsObject()) {
+				if (val["color"]["diffuse"].IsArray()) 
+					mat.color.diffuse = parse_utils::toColor(val["color"]["diffuse"]);
+				if (val["color"]["specular"].IsArray())
+					mat.color.specular = parse_utils::toColor(val["color"]["specular"]);
+				if (val["color"]["ambient"].IsArray())
+					mat.color.ambient = parse_utils::toColor(val["color"]["ambient"]);
+				if (val["color"]["shininess"].IsNumber())
+					mat.color.shininess = val["color"]["shininess"].GetDouble();
+				if (val["color"].HasMember("reflectivity") && val["color"]["reflectivity"].IsNumber())
+					mat.color.reflectivity = glm::clamp(val["color"]["reflectivity"].GetDouble(), 0.0, 1.0);
+			} else if (val["texture"].IsString()) {
+
+			}
+
+			return mat;
+		}
+
+		/**
+		* Object to world transform: either a row major "transform" of 16 numbers or
+		* "translate" * "rotate" ([degrees, x, y, z]) * "scale" (number or [x, y, z])
+		*/
+		inline glm::mat4 toTransform(rapidjson::Value const& val) {
+			glm::mat4 m(1.0f);
+			if (val.HasMember("transform") && val["transform"].IsArray() && val["transform"].Size() == 16) {
+				const rapidjson::Value& t = val["transform"];
+				for (int row = 0; row < 4; ++row)
+					for (int col = 0; col < 4; ++col)
+						m[col][row] = t[row * 4 + col].GetDouble();
+				return m;
+			}
+			if (val.HasMember("translate") && val["translate"].IsArray())
+				m = glm::translate(m, toPoint(val["translate"]));
+			if (val.HasMember("rotate") && val["rotate"].IsArray()) {
+				const rapidjson::Value& r = val["rotate"];
+				m = glm::rotate(m, glm::radians((float)r[0].GetDouble()),
+								donkey::vector_t(r[1].GetDouble(), r[2].GetDouble(), r[3].GetDouble()));
+			}
+			if (val.HasMember("scale")) {
+				if (val["scale"].IsNumber())
+					m = glm::scale(m, donkey::vector_t((float)val["scale"].GetDouble()));
+				else if (val["scale"].IsArray())
+					m = glm::scale(m, toPoint(val["scale"]));
+			}
+			return m;
+		}
 	}
 
+	typedef std::map<std::string, std::shared_ptr<donkey::object::trimesh_t> > mesh_library_t;
+
+	/**
+	* Named triangle mesh, placed in the scene by "instance" models
+	*/
+	struct mesh_parser_t {
+		std::string 							name;
+		std::shared_ptr<donkey::object::trimesh_t> 	mesh;
+
+		explicit mesh_parser_t(rapidjson::Value const& val):
+		mesh(std::make_shared<donkey::object::trimesh_t>()) {
+			if (val["name"].IsString())
+				name = val["name"].GetString();
+
+			if (val["vertices"].IsArray()) {
+				parse_utils::for_each_arr(val["vertices"], [this](rapidjson::Value const& v) {
+					donkey::object::trimesh_t::geometry_type::vtx_type vtx;
+					vtx.position = parse_utils::toPoint(v);
+					mesh->geometry.vertices.push_back(vtx);
+				});
+			}
+
+			if (val["faces"].IsArray()) {
+				const uint32_t numVertices = mesh->geometry.vertices.size();
+				parse_utils::for_each_arr(val["faces"], [this, numVertices](rapidjson::Value const& f) {
+					donkey::object::trimesh_t::geometry_type::face_type face;
+					face.attrib.materialIdx = 0;
+					for (int i = 0; i < 3; ++i)
+						face.index[i] = f[i].GetUint();
+					if (face.index[0] < numVertices && face.index[1] < numVertices && face.index[2] < numVertices)
+						mesh->geometry.faces.push_back(face);
+				});
+			}
+
+			if (val.HasMember("material") && val["material"].IsObject())
+				mesh->material = parse_utils::toMaterial(val["material"]);
+		}
+	};
+
 	struct model_parser_t {
 
 		donkey::primitive_ptr object;
@@ -45,37 +143,50 @@ namespace grass {
 		}
 
 		void parseCube(rapidjson::Value const& cube) {
-
+			donkey::point_t center(0.f, 0.f, 0.f);
+			float size = cube["size"].IsNumber() ? cube["size"].GetDouble() : 0.f;
+			if (cube["center"].IsArray())
+				center = parse_utils::toPoint(cube["center"]);
+			object = std::make_shared<donkey::primitive::cube_t>(size, center);
 		}
 
 		void parsePlane(rapidjson::Value const& plane) {
-
+			donkey::point_t point(0.f, 0.f, 0.f);
+			if (!plane["normal"].IsArray()) throw std::exception();
+			donkey::vector_t normal = parse_utils::toPoint(plane["normal"]);
+			if (glm::dot(normal, normal) == 0.f) throw std::exception();
+			if (plane["point"].IsArray())
+				point = parse_utils::toPoint(plane["point"]);
+			object = std::make_shared<donkey::primitive::plane_t>(glm::normalize(normal), point);
 		}
 
 		void parseTriangle(rapidjson::Value const& triangle) {
-
+			const rapidjson::Value& v = triangle["vertices"];
+			if (!v.IsArray() || v.Size() != 3) throw std::exception();
+			object = std::make_shared<donkey::primitive::triangle_t>(
+						parse_utils::toPoint(v[0]),
+						parse_utils::toPoint(v[1]),
+						parse_utils::toPoint(v[2])
+					);
 		}
 
-		donkey::color::material_t parseMaterial(rapidjson::Value const& val) {
-			donkey::color::material_t mat;
-
-			if (val["color"].IsObject()) {
-				if (val["color"]["diffuse"].IsArray()) 
-					mat.color.diffuse = parse_utils::toColor(val["color"]["diffuse"]);
-				if (val["color"]["specular"].IsArray())
-					mat.color.specular = parse_utils::toColor(val["color"]["specular"]);
-				if (val["color"]["ambient"].IsArray())
-					mat.color.ambient = parse_utils::toColor(val["color"]["ambient"]);
-				if (val["color"]["shininess"].IsNumber())
-					mat.color.shininess = val["color"]["shininess"].GetDouble();
-			} else if (val["texture"].IsString()) {
-
+		void parseInstance(rapidjson::Value const& instance, mesh_library_t const* meshes) {
+			std::shared_ptr<donkey::object::trimesh_t> mesh;
+			if (meshes && instance["mesh"].IsString()) {
+				auto it = meshes->find(instance["mesh"].GetString());
+				if (it != meshes->end()) mesh = it->second;
 			}
+			if (!mesh) throw std::exception();
 
-			return mat;
+			object = std::make_shared<donkey::primitive::instance_t>(mesh, parse_utils::toTransform(instance));
+			object->material = mesh->material;
 		}
 
-		explicit model_parser_t(rapidjson::Value const& val) {
+		donkey::color::material_t parseMaterial(rapidjson::Value const& val) {
+			return parse_utils::toMaterial(val);
+		}
+
+		explicit model_parser_t(rapidjson::Value const& val, mesh_library_t const* meshes = nullptr) {
 			const std::string type = val["type"].GetString();
 			if (type == "sphere") {
 				parseSphere(val);
@@ -85,6 +196,10 @@ namespace grass {
 				parseTriangle(val);
 			} else if (type == "plane") {
 				parsePlane(val);
+			} else if (type == "instance") {
+				parseInstance(val, meshes);
+				// instances use the material of their mesh unless they have their own
+				if (!val.HasMember("material")) return;
 			}
 			object->material = parseMaterial(val["material"]);
 		}
@@ -129,6 +244,71 @@ namespace grass {
 			if (paramsVal["maxDepth"].IsNumber()) {
 				params->maxDepth = paramsVal["maxDepth"].GetDouble();
 			}
+			if (paramsVal.HasMember("accelerator") && paramsVal["accelerator"].IsString()) {
+				const std::string accelerator = paramsVal["accelerator"].GetString();
+				params->accelerator = (accelerator == "grid") ? donkey::accel::kIndexGrid : donkey::accel::kIndexBVH;
+			}
+			if (paramsVal.HasMember("bvhBuilder") && paramsVal["bvhBuilder"].IsString()) {
+				const std::string builder = paramsVal["bvhBuilder"].GetString();
+				params->bvhBuilder = (builder == "lbvh") ? donkey::accel::kBuildLBVH : donkey::accel::kBuildSAH;
+			}
+			params->meshBuilder = donkey::accel::kBuildSBVH;
+			if (paramsVal.HasMember("meshBuilder") && paramsVal["meshBuilder"].IsString()) {
+				const std::string builder = paramsVal["meshBuilder"].GetString();
+				if (builder == "sah") params->meshBuilder = donkey::accel::kBuildSAH;
+				else if (builder == "lbvh") params->meshBuilder = donkey::accel::kBuildLBVH;
+			}
+			if (paramsVal.HasMember("splitBudget") && paramsVal["splitBudget"].IsNumber()) {
+				params->splitBudget = paramsVal["splitBudget"].GetDouble();
+			}
+			if (paramsVal.HasMember("bvhWidth") && paramsVal["bvhWidth"].IsNumber()) {
+				params->bvhWidth = paramsVal["bvhWidth"].GetInt();
+			}
+			if (paramsVal.HasMember("refitThreshold") && paramsVal["refitThreshold"].IsNumber()) {
+				params->refitThreshold = paramsVal["refitThreshold"].GetDouble();
+			}
+			if (paramsVal.HasMember("compressBVH") && paramsVal["compressBVH"].IsBool()) {
+				params->compressBVH = paramsVal["compressBVH"].GetBool();
+			}
+			if (paramsVal.HasMember("stats") && paramsVal["stats"].IsBool()) {
+				params->stats = paramsVal["stats"].GetBool();
+			}
+			if (paramsVal.HasMember("accelCache") && paramsVal["accelCache"].IsString()) {
+				params->accelCache = paramsVal["accelCache"].GetString();
+			}
+			if (paramsVal.HasMember("packetSize") && paramsVal["packetSize"].IsNumber()) {
+				const int size = paramsVal["packetSize"].GetInt();
+				params->packetSize = (size == 8 || size == 16) ? size : 0;
+			}
+			if (paramsVal.HasMember("rayStream") && paramsVal["rayStream"].IsNumber()) {
+				params->rayStream = std::max(paramsVal["rayStream"].GetInt(), 0);
+			}
+			if (paramsVal.HasMember("numThreads") && paramsVal["numThreads"].IsNumber()) {
+				params->numThreads = std::max(paramsVal["numThreads"].GetInt(), 0);
+			}
+			if (paramsVal.HasMember("timeBudget") && paramsVal["timeBudget"].IsNumber()) {
+				params->timeBudget = std::max(paramsVal["timeBudget"].GetDouble(), 0.0);
+			}
+			if (paramsVal.HasMember("maxSamples") && paramsVal["maxSamples"].IsNumber()) {
+				params->maxSamples = std::max(paramsVal["maxSamples"].GetInt(), 0);
+			}
+			if (paramsVal.HasMember("outputTransfer") && paramsVal["outputTransfer"].IsString()) {
+				const std::string transfer = paramsVal["outputTransfer"].GetString();
+				params->outputTransfer = (transfer == "srgb") ? bray::image::kTransferSRGB :
+										 (transfer == "gamma") ? bray::image::kTransferGamma : bray::image::kTransferLinear;
+			}
+			if (paramsVal.HasMember("outputGamma") && paramsVal["outputGamma"].IsNumber()) {
+				params->outputGamma = paramsVal["outputGamma"].GetDouble();
+			}
+			if (paramsVal.HasMember("numa") && paramsVal["numa"].IsBool()) {
+				params->numa = paramsVal["numa"].GetBool();
+			}
+			if (paramsVal.HasMember("replicateScene") && paramsVal["replicateScene"].IsBool()) {
+				params->replicateScene = paramsVal["replicateScene"].GetBool();
+			}
+			if (paramsVal.HasMember("numaBenchmark") && paramsVal["numaBenchmark"].IsBool()) {
+				params->numaBenchmark = paramsVal["numaBenchmark"].GetBool();
+			}
 		}
 
 		std::shared_ptr<bray::newbray_params_t> getParams() {
@@ -186,13 +366,22 @@ namespace grass {
 
 		void getScene(donkey::scene_t& scene, bray::newbray_params_t& params) {
 
+			// meshes first, models refer to them by name
+			mesh_library_t meshes;
+			if (doc.HasMember("meshes") && doc["meshes"].IsArray()) {
+				parse_utils::for_each_arr(doc["meshes"], [&meshes](rapidjson::Value const& val) {
+					mesh_parser_t parser(val);
+					meshes[parser.name] = parser.mesh;
+				});
+			}
+
 			for (rapidjson::Value::ConstMemberIterator i = doc.MemberBegin(),
 				e = doc.MemberEnd(); i != e; ++i) {
 
 				std::string name = i->name.GetString();
 				if (name == "models") {
-					parse_utils::for_each_arr(i->value, [&scene](rapidjson::Value const& val) {
-						model_parser_t parser(val);
+					parse_utils::for_each_arr(i->value, [&scene, &meshes](rapidjson::Value const& val) {
+						model_parser_t parser(val, &meshes);
 						donkey::primitive_ptr obj = parser.getModel();
 						scene.add(obj);
 					});
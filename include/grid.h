@@ -0,0 +1,182 @@
+#ifndef GRID_H
+#define GRID_H
+#include "accel.h"
+#include <cmath>
+
+namespace donkey {
+
+	namespace accel {
+
+		/**
+		* One uniform grid: cell c holds refs[cellStart[c], cellStart[c + 1]).
+		* Cells are stored x fastest, then y, then z.
+		*/
+		struct grid_level_t {
+			aabb_t 					bounds;
+			glm::ivec3 				res;
+			vector_t 				cellSize;
+			vector_t 				invCellSize;
+			std::vector<uint32_t> 	cellStart;
+			std::vector<uint32_t> 	refs;
+
+			inline uint32_t cellIndex(glm::ivec3 const& c) const {
+				return (c.z * res.y + c.y) * res.x + c.x;
+			}
+
+			inline glm::ivec3 cellOf(point_t const& p) const {
+				glm::ivec3 c = glm::ivec3(glm::floor((p - bounds.lo) * invCellSize));
+				return glm::clamp(c, glm::ivec3(0), res - glm::ivec3(1));
+			}
+		};
+
+		/**
+		* Small per-ray cache of recently tested objects, so that objects spanning
+		* several cells are not tested again in every cell. Lives on the stack of
+		* the traversal, so concurrent rays never share it.
+		*/
+		struct mailbox_t {
+			static const int kSlots = 16;
+			uint32_t ids[kSlots];
+
+			mailbox_t() {
+				for (int i = 0; i < kSlots; ++i) ids[i] = ~0u;
+			}
+
+			// true if the object still has to be tested
+			inline bool check(uint32_t id) {
+				uint32_t& slot = ids[id & (kSlots - 1)];
+				if (slot == id) return false;
+				slot = id;
+				return true;
+			}
+		};
+
+		struct grid_params_t {
+			float 	topDensity;			// top level cells per object
+			float 	subDensity;			// second level cells per reference of a dense cell
+			int 	subdivideCount;		// cells with more references get a second level
+			int 	maxResolution;		// per axis
+			grid_params_t(): topDensity(1.f), subDensity(2.f), subdivideCount(16), maxResolution(512) {}
+		};
+
+		/**
+		* Two-level uniform grid, traversed with a 3D-DDA. Top cells holding many
+		* references point at a second level grid spanning just that cell.
+		*/
+		struct grid_t: public accelerator_t {
+			grid_level_t 				top;
+			std::vector<int32_t> 		subgridOf;		// per top cell, -1 without a second level
+			std::vector<grid_level_t> 	subgrids;
+			std::vector<uint32_t> 		unbounded;
+
+			grid_t(): accelerator_t(kGrid) {}
+
+			/**
+			* Same contract as bvh_t::traverse. Cells are visited front to back and the
+			* walk stops once the closest hit lies before the next cell.
+			*/
+			template <typename Visitor>
+			void traverse(geom::ray_t const& ray, float& tMax, Visitor&& visit) const {
+				for (auto idx: unbounded)
+					visit(idx, tMax);
+
+				if (top.cellStart.empty()) return;
+
+				const ray_data_t rd(ray);
+				mailbox_t mailbox;
+				walk(top, ray, rd, 0.f, tMax, tMax, [&](grid_level_t const& level, uint32_t cell, float tEnter, float tExit) {
+					const int32_t sub = (&level == &top) ? subgridOf[cell] : -1;
+					if (sub >= 0) {
+						walk(subgrids[sub], ray, rd, tEnter, tExit, tMax, [&](grid_level_t const& subLevel, uint32_t subCell, float, float) {
+							visitCell(subLevel, subCell, tMax, mailbox, visit);
+						});
+					} else {
+						visitCell(level, cell, tMax, mailbox, visit);
+					}
+				});
+			}
+
+		private:
+			template <typename Visitor>
+			static inline void visitCell(grid_level_t const& level, uint32_t cell, float& tMax,
+										 mailbox_t& mailbox, Visitor& visit) {
+				for (uint32_t i = level.cellStart[cell], e = level.cellStart[cell + 1]; i < e; ++i) {
+					uint32_t idx = level.refs[i];
+					if (mailbox.check(idx))
+						visit(idx, tMax);
+				}
+			}
+
+			/**
+			* 3D-DDA over the cells of one level pierced between tEnter and tExit.
+			* Calls cellFn(level, cell, cellEnter, cellExit) in ray order.
+			*/
+			template <typename CellFn>
+			static void walk(grid_level_t const& level, geom::ray_t const& ray, ray_data_t const& rd,
+							 float tEnter, float tExit, float const& tMax, CellFn&& cellFn) {
+				float t0;
+				if (!ray_box(level.bounds, rd, std::min(tExit, tMax), t0)) return;
+				t0 = std::max(t0, tEnter);
+
+				glm::ivec3 cell = level.cellOf(ray.point + t0 * ray.direction);
+				glm::ivec3 step, stop;
+				vector_t tNext, tDelta;
+				for (int a = 0; a < 3; ++a) {
+					const float d = ray.direction[a];
+					if (d > 0.f) {
+						step[a] = 1;
+						stop[a] = level.res[a];
+						tNext[a] = (level.bounds.lo[a] + (cell[a] + 1) * level.cellSize[a] - ray.point[a]) * rd.invDir[a];
+						tDelta[a] = level.cellSize[a] * rd.invDir[a];
+					} else if (d < 0.f) {
+						step[a] = -1;
+						stop[a] = -1;
+						tNext[a] = (level.bounds.lo[a] + cell[a] * level.cellSize[a] - ray.point[a]) * rd.invDir[a];
+						tDelta[a] = -level.cellSize[a] * rd.invDir[a];
+					} else {
+						step[a] = 0;
+						stop[a] = -1;
+						tNext[a] = std::numeric_limits<float>::max();
+						tDelta[a] = 0.f;
+					}
+				}
+
+				float tCell = t0;
+				while (true) {
+					const int a = (tNext.x < tNext.y) ? (tNext.x < tNext.z ? 0 : 2) : (tNext.y < tNext.z ? 1 : 2);
+					const float tCellExit = tNext[a];
+
+					cellFn(level, level.cellIndex(cell), tCell, tCellExit);
+
+					// everything further along starts behind the closest hit or the range
+					if (tMax < tCellExit || tCellExit >= tExit) break;
+
+					cell[a] += step[a];
+					if (cell[a] == stop[a]) break;
+					tCell = tCellExit;
+					tNext[a] += tDelta[a];
+				}
+			}
+		};
+
+		void build_grid(std::vector<aabb_t> const& bounds, grid_t& grid,
+						grid_params_t const& params = grid_params_t());
+
+		// nodes are cells of both levels
+		inline memory_stats_t memory_stats(grid_t const& grid) {
+			memory_stats_t stats;
+			stats.nodes = grid.top.cellStart.size();
+			stats.nodeBytes = (grid.top.cellStart.size() + grid.subgridOf.size()) * sizeof(uint32_t)
+				+ grid.subgrids.size() * sizeof(grid_level_t);
+			stats.indexBytes = (grid.top.refs.size() + grid.unbounded.size()) * sizeof(uint32_t);
+			for (auto const& sub: grid.subgrids) {
+				stats.nodes += sub.cellStart.size();
+				stats.nodeBytes += sub.cellStart.size() * sizeof(uint32_t);
+				stats.indexBytes += sub.refs.size() * sizeof(uint32_t);
+			}
+			return stats;
+		}
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+#ifndef MESH_ACCEL_H
+#define MESH_ACCEL_H
+#include "accel.h"
+
+namespace donkey {
+
+	namespace accel {
+
+		/**
+		* Bottom level structure: a BVH over the faces of one mesh, in object space.
+		* The indices of the tree are face indices. The faces are also kept as
+		* precomputed triangles, so a leaf test reads one record per face
+		* instead of gathering three vertices through the index list.
+		*/
+		struct blas_t {
+			object::trimesh_t const* 				mesh;
+			bvh_t 									bvh;
+			std::vector<geom::triangle_edges_t> 	triangles;		// per face
+		};
+
+		/**
+		* Fill the precomputed triangles of a tree from its mesh
+		*/
+		void prepare_triangles(blas_t& blas);
+
+		struct mesh_hit_t {
+			float 		t;
+			uint32_t 	face;
+			float 		u;
+			float 		v;
+			vector_t 	normal;			// world space, facing the ray
+		};
+
+		/**
+		* Bottom level structures of all meshes of a scene. Instances of the same
+		* mesh share its blas_t. The top level is the regular scene BVH, in which
+		* an instance is a single object with world space bounds.
+		*/
+		struct instances_t {
+			std::vector<blas_t> 	blases;
+			std::vector<int32_t> 	blasOf;		// per scene object, -1 for objects without a mesh
+
+			inline blas_t const* blasFor(uint32_t objectIdx) const {
+				return (objectIdx < blasOf.size() && blasOf[objectIdx] >= 0) ? &blases[blasOf[objectIdx]] : nullptr;
+			}
+
+			/**
+			* True if the objects still reference the meshes the trees were built for,
+			* so that the structure can be refit instead of rebuilt
+			*/
+			bool matches(scene_object_list const& objects) const;
+
+			/**
+			* World space bounds of a mesh or instance object
+			*/
+			bool bounds(object::scene_object_t const& object, uint32_t objectIdx, aabb_t& box) const;
+
+			/**
+			* Closest hit before tMax on the mesh of a mesh or instance object.
+			* The ray is moved into object space, t stays the world ray parameter.
+			*/
+			bool intersect(object::scene_object_t const& object, uint32_t objectIdx,
+						   geom::ray_t const& ray, float tMax, mesh_hit_t& hit) const;
+
+			/**
+			* True if any face of the mesh is hit before tMax. Stops at the first
+			* hit found, in no particular order.
+			*/
+			bool occluded(object::scene_object_t const& object, uint32_t objectIdx,
+						  geom::ray_t const& ray, float tMax) const;
+		};
+
+		/**
+		* Mesh drawn by a mesh or instance object, nullptr for other objects
+		*/
+		object::trimesh_t const* mesh_of(object::scene_object_t const& object);
+
+		/**
+		* Build one bottom level tree per distinct mesh referenced by the objects
+		*/
+		void build_instances(scene_object_list const& objects, instances_t& instances,
+							 build_type type, build_params_t const& params = build_params_t());
+
+		/**
+		* object_bounds that also bounds meshes and instances
+		*/
+		void object_bounds(scene_object_list const& objects, instances_t const& instances,
+						   std::vector<aabb_t>& bounds, int numThreads = 0);
+	}
+}
+
+#endif
\ No newline at end of file
@@ -1,8 +1,25 @@
 #ifndef NEWBRAY_H
 #define NEWBRAY_H
 #include "donkey.h"
+#include "accel.h"
+#include "wide_bvh.h"
+#include "mesh_accel.h"
+#include "grid.h"
+#include "quantized_bvh.h"
+#include "accel_cache.h"
+#include "sphere_store.h"
+#include "ray_stream.h"
+#include "compiled_scene.h"
+#include "parallel.h"
+#include "framebuffer.h"
 #include "opencv/cv.h"
 #include "opencv/highgui.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
 #include <string>
 #include <limits>
 
@@ -12,11 +29,25 @@ namespace bray  {
 			unsigned long width;
 			unsigned long height;
 			cv::Mat 	im;
+			// linear RGBA floats per pixel, row by row, that trace() renders into and
+			// then converts to im. Allocated without being written, see color_buffer_t.
+			std::shared_ptr<float> 	linear;
+
 			image_t(unsigned long w, unsigned long h):
 			width(w), height(h),
-			im(height, width, CV_8UC3) {}
+			im(height, width, CV_8UC3),
+			linear(static_cast<float*>(::operator new(w * h * 4 * sizeof(float))), [](float* p) { ::operator delete(p); }) {}
 
 			inline cv::Mat& get() { return im; }
+			inline float* framebuffer() { return linear.get(); }
+
+			/**
+			* Convert rows [begin, end) of the framebuffer, times scale, to im
+			*/
+			inline void convertRows(unsigned long begin, unsigned long end, float scale, output_curve_t const& curve) {
+				for (unsigned long row = begin; row < end; ++row)
+					convert_pixels(linear.get() + row * width * 4, im.ptr<unsigned char>(row), width, scale, curve);
+			}
 		};
 	}
 
@@ -40,21 +71,106 @@ namespace bray  {
 		donkey::point_t cameraUp;
 		donkey::point_t cameraTarget;
 		short maxDepth;
+		donkey::accel::index_type accelerator;
+		donkey::accel::build_type bvhBuilder;
+		donkey::accel::build_type meshBuilder;	// bottom level trees of the meshes
+		float splitBudget;			// extra SBVH references per triangle, 0 uses the default, < 0 disables spatial splits
+		short bvhWidth;				// 2, 4 or 8 children per node, 0 picks the widest SIMD path
+		float refitThreshold;		// SAH cost growth that forces a rebuild, 0 uses the default, < 0 always rebuilds
+		bool compressBVH;			// 8 bit quantized child bounds, always in 8 wide nodes
+		bool stats;					// print acceleration structure build time and memory
+		std::string accelCache;		// directory for built structures, empty disables the cache
+		short packetSize;			// primary rays traced in 8x8 or 16x16 pixel packets, 0 traces each ray alone
+		int rayStream;				// secondary rays sorted and traced per batch of this size, 0 traces them per pixel
+		short numThreads;			// render threads, 0 uses all hardware threads
+		float timeBudget;			// seconds for progressive rendering, counted from the start of trace(), 0 for no limit
+		short maxSamples;			// samples per pixel for progressive rendering, 0 for no limit
+		bool numa;					// pin render threads and keep each band of image rows on one NUMA node
+		bool replicateScene;		// with numa, a copy of the flat scene arrays on every node
+		bool numaBenchmark;			// with numa and stats, time reads of local and remote memory before rendering
+		image::transfer_type outputTransfer;	// curve from the linear framebuffer to the 8 bit image
+		float outputGamma;			// for kTransferGamma, 0 uses 2.2
 	};
 
 
 	struct intersector_t {
 		struct result_type {
 			float 						distance;
+			donkey::geom::hit_t 		hit;
 			donkey::point_t 			point;
-			donkey::scene_object_ptr 	object;
+			donkey::vector_t 			normal;
+			uint32_t 					object;		// scene object index
 			bool						noHit;
-			result_type():distance(std::numeric_limits<float>::max()), noHit(true){}
+			result_type():distance(std::numeric_limits<float>::max()), object(0), noHit(true){}
 		};
 
-		donkey::scene_t const& sceneRef;
-		explicit intersector_t(donkey::scene_t const& scene):sceneRef(scene) {}
-		result_type findClosest(donkey::geom::ray_t const& ray) const;
+		/**
+		* Searches instantiated for one set of object kinds, see kernelsFor
+		*/
+		struct kernels_t {
+			const char* name;
+			result_type (*closest)(intersector_t const& isect, donkey::geom::ray_t const& ray);
+			void (*closestPacket)(intersector_t const& isect, donkey::accel::ray_packet_t& packet,
+								  donkey::geom::ray_t const* rays, result_type* results);
+			bool (*occluded)(intersector_t const& isect, donkey::geom::ray_t const& ray, float tMax);
+			donkey::color::color_desc_t const& (*material)(intersector_t const& isect, uint32_t objectIdx);
+			donkey::rgb_t (*shade)(intersector_t const& isect, result_type const& result, donkey::geom::ray_t const& ray);
+		};
+
+		donkey::accel::compiled_scene_t const& scene;
+		donkey::accel::accelerator_t const* accel;
+		donkey::accel::instances_t const* instances;
+		donkey::accel::sphere_store_t const* spheres;
+		kernels_t const* kernels;
+
+		explicit intersector_t(donkey::accel::compiled_scene_t const& compiled,
+							   donkey::accel::accelerator_t const* accelerator = nullptr,
+							   donkey::accel::instances_t const* meshes = nullptr,
+							   donkey::accel::sphere_store_t const* sphereStore = nullptr):
+			scene(compiled), accel(accelerator), instances(meshes), spheres(sphereStore),
+			kernels(kernelsFor(compiled.kinds)) {}
+
+		/**
+		* Kernels for the kinds of objects of a scene: spheres only, spheres and
+		* planes, triangles only, meshes only, or any mix
+		*/
+		static kernels_t const* kernelsFor(unsigned kinds);
+
+		inline result_type findClosest(donkey::geom::ray_t const& ray) const {
+			return kernels->closest(*this, ray);
+		}
+
+		/**
+		* Closest hits of rays that all leave packet.org, one result per ray.
+		* Trees traverse the whole packet at once, other structures ray by ray.
+		*/
+		inline void findClosest(donkey::accel::ray_packet_t& packet, donkey::geom::ray_t const* rays,
+								result_type* results) const {
+			kernels->closestPacket(*this, packet, rays, results);
+		}
+
+		/**
+		* True if anything is hit before tMax. Returns at the first hit found
+		* without looking for the closest one, for shadow rays.
+		*/
+		inline bool occluded(donkey::geom::ray_t const& ray, float tMax) const {
+			return kernels->occluded(*this, ray, tMax);
+		}
+
+		/**
+		* Material of a hit object. Sphere hits read it from the sphere store,
+		* next to the geometry the kernel has just read.
+		*/
+		inline donkey::color::color_desc_t const& materialOf(uint32_t objectIdx) const {
+			return kernels->material(*this, objectIdx);
+		}
+
+		/**
+		* Color of a hit seen along ray, without its reflections
+		*/
+		inline donkey::rgb_t shade(result_type const& result, donkey::geom::ray_t const& ray) const {
+			return kernels->shade(*this, result, ray);
+		}
 	};
 
 	struct camera_t {
@@ -94,32 +210,186 @@ namespace bray  {
 		}
 	};
 
+	/**
+	* Ray on its way to a pixel, carrying the share of the pixel color it adds
+	*/
+	struct stream_ray_t {
+		donkey::geom::ray_t 	ray;
+		donkey::rgb_t 			weight;
+		uint32_t 				pixel;
+		short 					depth;			// bounces before this ray, 0 for primary rays
+
+		stream_ray_t(donkey::geom::ray_t const& r, uint32_t p):
+			ray(r), weight(1.f, 1.f, 1.f), pixel(p), depth(0) {}
+	};
+
+	/**
+	* State of one render thread in a trace() call: the image and, in stream
+	* mode, the colors gathered so far and the secondary rays of this thread
+	* waiting to be traced. Image and colors are shared by all threads, every
+	* pixel belongs to one tile and so to one thread.
+	*/
+	struct frame_t {
+		float* 							linear;			// the RGBA framebuffer of the image
+		donkey::rgb_t* 					colors;			// written instead of linear when set
+		std::vector<stream_ray_t> 		stream;
+		bool 							streaming;
+		float 							offsetX;		// where in the pixel the camera rays pass, in pixels
+		float 							offsetY;
+		int 							pass;			// progressive pass, 0 for the first
+		frame_t(): linear(nullptr), colors(nullptr), streaming(false), offsetX(0.f), offsetY(0.f), pass(0) {}
+	};
+
+	/**
+	* Pixels [row0, row1) x [col0, col1) of the image, rendered by one thread
+	*/
+	struct tile_t {
+		unsigned long 	row0;
+		unsigned long 	col0;
+		unsigned long 	row1;
+		unsigned long 	col1;
+		float 			cost;		// estimated render time in seconds, 0 if unknown
+		int 			node;		// NUMA node whose threads render the tile, and whose memory holds its pixels
+	};
+
+	/**
+	* Pixel colors allocated without being written, so that every page lands
+	* on the NUMA node of the thread that writes it first
+	*/
+	struct color_buffer_t {
+		donkey::rgb_t* 	data;
+
+		explicit color_buffer_t(size_t size):
+			data(size ? static_cast<donkey::rgb_t*>(::operator new(size * sizeof(donkey::rgb_t))) : nullptr) {}
+		~color_buffer_t() { ::operator delete(data); }
+
+		color_buffer_t(color_buffer_t const&) = delete;
+		color_buffer_t& operator=(color_buffer_t const&) = delete;
+	};
+
+	/**
+	* Shared by a render and the code that started it. Setting cancelled stops
+	* the render threads before their next tile. progress is called by the
+	* render threads after every tile with the share of the pass done so far.
+	*/
+	struct render_control_t {
+		std::atomic<bool> 	cancelled;
+		std::function<void(tile_t const& tile, int pass, float passDone)> 	progress;
+		render_control_t(): cancelled(false) {}
+	};
+
+	/**
+	* A render started by newbray_t::traceAsync. done becomes ready with true
+	* once the image is complete, or with false if the render was cancelled.
+	*/
+	struct render_handle_t {
+		std::shared_future<bool> 			done;
+		std::shared_ptr<render_control_t> 	control;
+
+		inline void cancel() { control->cancelled = true; }
+		inline bool wait() const { return done.get(); }
+	};
+
+	/**
+	* Tiles of the image, one queue per render thread, and where the threads
+	* run. Each NUMA node renders a band of image rows.
+	*/
+	struct schedule_t {
+		std::vector< std::deque<tile_t> > 	queues;
+		int 								numThreads;
+		size_t 								numPixels;
+		float 								splitCost;	// tiles that cost more are halved first
+		donkey::parallel::placement_t 		placement;
+		std::vector<unsigned long> 			bandRows;	// first row of the band of each node, then the height
+
+		// with replicateScene, the copies of the scene on each node and the
+		// raycaster of each thread over the copy on its node
+		std::vector< std::shared_ptr<donkey::accel::compiled_scene_t> > 	sceneCopies;
+		std::vector< std::shared_ptr<donkey::accel::sphere_store_t> > 	sphereCopies;
+		std::vector<intersector_t> 											raycasters;
+
+		std::atomic<size_t> 				localTiles;	// rendered by a thread of their node
+		std::atomic<size_t> 				remoteTiles;
+
+		schedule_t(): numThreads(1), numPixels(0), splitCost(0.f), localTiles(0), remoteTiles(0) {}
+
+		/**
+		* The rows [begin, end) of thread t: its share of the band of its node
+		*/
+		void threadRows(int t, unsigned long& begin, unsigned long& end) const;
+	};
 	
 	struct newbray_t {
 	private:
 		newbray_params_t 	params;
 		camera_t 			camera;
 
+		// acceleration structure built for the scene last passed to trace()
+		std::shared_ptr<donkey::accel::accelerator_t> 	accel;
+		std::shared_ptr<donkey::accel::instances_t> 	instances;
+		std::shared_ptr<donkey::accel::sphere_store_t> 	spheres;
+		std::shared_ptr<donkey::accel::compiled_scene_t> compiled;		// scene last passed to trace(), as flat arrays
+		donkey::scene_t const* 							accelScene;
+		float 											accelCost;		// SAH cost right after the last full build
+		size_t 											accelFullBytes;	// node bytes before compression, 0 if not compressed
+
 	public:
 		explicit newbray_t(newbray_params_t const& rayTraceParams):
 			params(rayTraceParams),
-			camera(rayTraceParams) {}
+			camera(rayTraceParams),
+			accelScene(nullptr),
+			accelCost(0.f),
+			accelFullBytes(0) {}
+
+		/**
+		* Render the scene into the image. Returns false if control was
+		* cancelled; the image then only holds the tiles or passes done.
+		*/
+		bool trace(donkey::scene_t const& scene, image::image_t& toImage, render_control_t* control = nullptr);
 
-		bool trace(donkey::scene_t const& scene, image::image_t& toImage);
+		/**
+		* Start trace() on its own thread and return at once. The tracer, the
+		* scene and the image must outlive the render, and a tracer runs one
+		* render at a time: cancel the last one and wait for it before the next.
+		*/
+		render_handle_t traceAsync(donkey::scene_t const& scene, image::image_t& toImage,
+								   std::function<void(tile_t const&, int, float)> progress = nullptr);
 
 		inline camera_t const& getCamera() const { return camera; };
 
 		donkey::rgb_t getColorForRay(donkey::geom::ray_t const& ray,
 									 donkey::scene_t const& scene) const;
+		donkey::rgb_t getColorForHit(intersector_t::result_type const& result,
+									 donkey::geom::ray_t const& ray,
+									 intersector_t const& raycaster) const;
 
 	private:
+		const char* updateAccelerator(donkey::scene_t const& scene);
+		void planTiles(intersector_t const& raycaster, unsigned long width, unsigned long height, schedule_t& schedule) const;
+		void copySceneToNodes(schedule_t& schedule) const;
+		bool renderPass(intersector_t const& raycaster, schedule_t& schedule, frame_t const& frame,
+						unsigned long width, std::chrono::steady_clock::time_point deadline, render_control_t* control) const;
+		void estimateTileCosts(intersector_t const& raycaster, std::vector<tile_t>& tiles,
+							   donkey::parallel::placement_t const& placement) const;
+		void renderTile(intersector_t const& raycaster, frame_t& frame, tile_t const& tile, unsigned long width) const;
+		bool tracePackets(intersector_t const& raycaster, frame_t& frame, tile_t const& tile, unsigned long width) const;
+		void shadePixel(intersector_t const& raycaster, frame_t& frame, intersector_t::result_type const& result,
+						donkey::geom::ray_t const& ray, uint32_t pixel) const;
+		bool addHit(intersector_t::result_type const& result, stream_ray_t const& in, intersector_t const& raycaster,
+					donkey::rgb_t& color, stream_ray_t& out) const;
+		void traceBounces(intersector_t const& raycaster, stream_ray_t bounce, donkey::rgb_t& color) const;
+		void traceStream(intersector_t const& raycaster, frame_t& frame) const;
+		void buildAccelerator(donkey::scene_t const& scene);
+		bool refitAccelerator(donkey::scene_t const& scene);
+		uint64_t acceleratorHash(donkey::scene_t const& scene) const;
+		void printStats(double buildMs, const char* update) const;
+		void printNumaStats(schedule_t const& schedule) const;
 		void transformObjects(donkey::scene_t& scene);
 
 		donkey::geom::ray_t getRayForPixel(unsigned short x, unsigned short y) const;
 		donkey::geom::ray_t getReflectedRay(donkey::geom::ray_t const& ray,
 											donkey::point_t const& point,
 											donkey::vector_t const&  normal) const;
-		donkey::geom::ray_t getShadowRay(donkey::point_t const& point, donkey::point_t const& lightSrcPos) const;
 	};
 
 	
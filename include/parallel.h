@@ -0,0 +1,198 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace donkey {
+
+	namespace parallel {
+
+		inline int hardware_threads() {
+			return std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		/**
+		* CPUs of every NUMA node, read from /sys on Linux. Elsewhere, or if it
+		* cannot be read, one node without CPUs.
+		*/
+		struct numa_topology_t {
+			std::vector< std::vector<int> > 	nodes;
+		};
+
+		numa_topology_t const& numa_topology();
+
+		/**
+		* Pin the calling thread to a CPU. False where that is not supported.
+		*/
+		bool pin_thread(int cpu);
+
+		/**
+		* CPU and NUMA node of each thread of a run. Without cpus the threads are
+		* left to the system and all count as node 0.
+		*/
+		struct placement_t {
+			std::vector<int> 	cpus;		// per thread
+			std::vector<int> 	nodes;		// per thread
+			int 				numNodes;
+			placement_t(): numNodes(1) {}
+		};
+
+		/**
+		* Spread numThreads over the NUMA nodes in proportion to their CPUs, the
+		* threads of a node numbered in a row
+		*/
+		placement_t place_threads(int numThreads);
+
+		/**
+		* Read speed in bytes per second of a thread on cpu over memory first
+		* written by a thread on memoryCpu
+		*/
+		double read_bandwidth(int cpu, int memoryCpu, size_t bytes);
+
+		/**
+		* Run fn(thread) on numThreads threads, the calling thread being thread 0
+		*/
+		template <typename Func>
+		void run(int numThreads, Func fn) {
+			std::vector<std::thread> threads;
+			for (int t = 1; t < numThreads; ++t)
+				threads.push_back(std::thread(fn, t));
+			fn(0);
+			for (auto& t: threads) t.join();
+		}
+
+		/**
+		* Run fn(thread) on one thread per entry of placement.nodes, each pinned
+		* to its CPU if placement has them. Pinned runs leave the calling thread
+		* alone and start all threads anew.
+		*/
+		template <typename Func>
+		void run(placement_t const& placement, Func fn) {
+			const int numThreads = placement.nodes.size();
+			if (placement.cpus.empty()) {
+				run(numThreads, fn);
+				return;
+			}
+			std::vector<std::thread> threads;
+			for (int t = 0; t < numThreads; ++t) {
+				threads.push_back(std::thread([&fn, &placement, t]() {
+					pin_thread(placement.cpus[t]);
+					fn(t);
+				}));
+			}
+			for (auto& t: threads) t.join();
+		}
+
+		/**
+		* Run fn(begin, end, thread) over [0, count) split into one contiguous chunk
+		* per thread. The split only depends on count and numThreads.
+		*/
+		template <typename Func>
+		void chunks(size_t count, int numThreads, Func fn) {
+			if (numThreads <= 1 || count < 4096) {
+				fn(0, count, 0);
+				return;
+			}
+			const size_t chunk = (count + numThreads - 1) / numThreads;
+			run(numThreads, [&](int t) {
+				size_t b = std::min(count, t * chunk), e = std::min(count, b + chunk);
+				fn(b, e, t);
+			});
+		}
+
+		/**
+		* Work stealing run over one thread per queue, placed as placement says.
+		* Thread t takes tasks from the front of queues[t] and, once it is empty,
+		* steals from the front of the others, those on its own NUMA node first.
+		* Queues sorted by falling cost thus hand thieves their costliest task.
+		* fn(task, thread, push) runs a task; push, a std::function<void(Task
+		* const&)>, adds a new one to the front of the thread's queue, so that
+		* its own thread runs it next. Threads without a task to take wait for
+		* one to be pushed. Returns when every task, pushed ones included, has run.
+		*/
+		template <typename Task, typename Func>
+		void steal(std::vector< std::deque<Task> > const& queues, placement_t const& placement, Func fn) {
+			struct worker_t {
+				std::mutex 			lock;
+				std::deque<Task> 	tasks;
+			};
+			const int numThreads = queues.size();
+			std::vector<worker_t> workers(numThreads);
+			size_t total = 0;
+			for (int t = 0; t < numThreads; ++t) {
+				workers[t].tasks = queues[t];
+				total += queues[t].size();
+			}
+			// tasks not yet finished and tasks waiting in a queue. Idle threads
+			// sleep on idle until a task is queued or none is left
+			std::atomic<size_t> pending(total), queued(total);
+			std::mutex idleLock;
+			std::condition_variable idle;
+
+			// victims of each thread: itself, then its own node, then the others
+			std::vector< std::vector<int> > victims(numThreads);
+			for (int t = 0; t < numThreads; ++t) {
+				const int node = placement.nodes.empty() ? 0 : placement.nodes[t];
+				for (int pass = 0; pass < 2; ++pass) {
+					for (int k = 0; k < numThreads; ++k) {
+						const int v = (t + k) % numThreads;
+						const bool local = placement.nodes.empty() || placement.nodes[v] == node;
+						if (local == (pass == 0))
+							victims[t].push_back(v);
+					}
+				}
+			}
+
+			placement_t place = placement;
+			if (place.nodes.empty())
+				place.nodes.assign(numThreads, 0);
+			run(place, [&](int t) {
+				const std::function<void(Task const&)> push = [&](Task const& task) {
+					++pending;
+					{
+						std::lock_guard<std::mutex> guard(workers[t].lock);
+						workers[t].tasks.push_front(task);
+						++queued;
+					}
+					std::lock_guard<std::mutex> guard(idleLock);
+					idle.notify_one();
+				};
+				auto take = [&](Task& task) {
+					for (int k = 0; k < numThreads; ++k) {
+						worker_t& from = workers[victims[t][k]];
+						std::lock_guard<std::mutex> guard(from.lock);
+						if (from.tasks.empty()) continue;
+						task = from.tasks.front();
+						from.tasks.pop_front();
+						--queued;
+						return true;
+					}
+					return false;
+				};
+
+				Task task;
+				while (pending > 0) {
+					if (!take(task)) {
+						// the last tasks are still running and may push more
+						std::unique_lock<std::mutex> guard(idleLock);
+						idle.wait(guard, [&]() { return queued > 0 || pending == 0; });
+						continue;
+					}
+					fn(task, t, push);
+					if (--pending == 0) {
+						std::lock_guard<std::mutex> guard(idleLock);
+						idle.notify_all();
+					}
+				}
+			});
+		}
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,208 @@
+#ifndef QUANTIZED_BVH_H
+#define QUANTIZED_BVH_H
+#include "wide_bvh.h"
+#include <cstring>
+
+namespace donkey {
+
+	namespace accel {
+
+		/**
+		* Wide BVH node with 8 bit child bounds on a grid over the node box:
+		* lane bounds are origin + q * 2^exponent per axis, rounded outwards so the
+		* decoded boxes always contain the exact ones. Child nodes of a node are
+		* stored together from childBase and the objects of its leaf lanes together
+		* from leafBase, both in lane order, so lanes need no pointers of their own.
+		* 80 bytes for 8 lanes against 256 for wide_node_t<8>.
+		*/
+		template <int Width>
+		struct quantized_node_t {
+			// the 20 byte header would leave 4 lanes at 52 bytes, only 2.5x smaller
+			static_assert(Width == 8, "quantized nodes are 8 wide");
+
+			float 		origin[3];
+			int8_t 		exponent[3];
+			uint8_t 	innerMask;			// lanes holding a child node
+			uint32_t 	childBase;
+			uint32_t 	leafBase;
+			uint8_t 	count[Width];		// objects in a leaf lane, 0 for node and unused lanes
+			uint8_t 	qlo[3][Width];
+			uint8_t 	qhi[3][Width];
+
+			inline float scale(int axis) const {
+				// 2^exponent, built from the bits
+				uint32_t bits = uint32_t(exponent[axis] + 127) << 23;
+				float s;
+				std::memcpy(&s, &bits, sizeof(s));
+				return s;
+			}
+
+			inline int leafMask() const {
+				int mask = 0;
+				for (int i = 0; i < Width; ++i)
+					if (count[i]) mask |= 1 << i;
+				return mask;
+			}
+		};
+
+		/**
+		* Decode the lane bounds of a node to floats for intersect_boxes
+		*/
+		template <int Width>
+		inline void decode_bounds_scalar(quantized_node_t<Width> const& node, float (&lo)[3][Width], float (&hi)[3][Width]) {
+			for (int a = 0; a < 3; ++a) {
+				const float origin = node.origin[a], scale = node.scale(a);
+				for (int i = 0; i < Width; ++i) {
+					lo[a][i] = origin + float(node.qlo[a][i]) * scale;
+					hi[a][i] = origin + float(node.qhi[a][i]) * scale;
+				}
+			}
+		}
+
+		template <int Width>
+		inline void decode_bounds(quantized_node_t<Width> const& node, float (&lo)[3][Width], float (&hi)[3][Width]) {
+			decode_bounds_scalar<Width>(node, lo, hi);
+		}
+
+#if defined(__AVX2__)
+		template <>
+		inline void decode_bounds<8>(quantized_node_t<8> const& node, float (&lo)[3][8], float (&hi)[3][8]) {
+			for (int a = 0; a < 3; ++a) {
+				const __m256 origin = _mm256_set1_ps(node.origin[a]);
+				const __m256 scale = _mm256_set1_ps(node.scale(a));
+				const __m256 ql = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const*)node.qlo[a])));
+				const __m256 qh = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const*)node.qhi[a])));
+				_mm256_storeu_ps(lo[a], _mm256_add_ps(origin, _mm256_mul_ps(ql, scale)));
+				_mm256_storeu_ps(hi[a], _mm256_add_ps(origin, _mm256_mul_ps(qh, scale)));
+			}
+		}
+#endif
+
+		template <int Width>
+		struct quantized_bvh_t: public accelerator_t {
+			std::vector< quantized_node_t<Width> > 	nodes;
+			std::vector<uint32_t> 					indices;
+			std::vector<uint32_t> 					unbounded;
+
+			quantized_bvh_t(): accelerator_t(kQBVH8) {}
+
+			template <typename Visitor>
+			void traverse(geom::ray_t const& ray, float& tMax, Visitor&& visit) const {
+				traverseLeaves(ray, tMax, [&](uint32_t const* objects, uint32_t count, float& tmax) {
+					for (uint32_t i = 0; i < count; ++i)
+						visit(objects[i], tmax);
+				});
+			}
+
+			/**
+			* Same contract as bvh_t::traverseLeaves. Lane bounds are decoded per node and
+			* tested with the same slab kernel as the full precision wide tree.
+			*/
+			template <typename LeafVisitor>
+			void traverseLeaves(geom::ray_t const& ray, float& tMax, LeafVisitor&& visitLeaf) const {
+				if (!unbounded.empty())
+					visitLeaf(unbounded.data(), unbounded.size(), tMax);
+
+				if (nodes.empty()) return;
+
+				const wide_ray_t wr(ray);
+				struct entry_t { uint32_t child; uint32_t count; float tNear; };
+				entry_t stack[kMaxTraversalDepth * Width];
+				int sp = 0;
+				stack[sp++] = { 0, 0, 0.f };
+
+				while (sp > 0) {
+					entry_t const top = stack[--sp];
+					if (top.tNear > tMax) continue;
+
+					if (top.count) {
+						visitLeaf(&indices[top.child], top.count, tMax);
+						continue;
+					}
+
+					quantized_node_t<Width> const& node = nodes[top.child];
+					alignas(32) float lo[3][Width], hi[3][Width];
+					decode_bounds<Width>(node, lo, hi);
+
+					alignas(32) float tNear[Width];
+					int mask = intersect_boxes<Width>(lo, hi, wr, tMax, tNear) & (node.innerMask | node.leafMask());
+					if (!mask) continue;
+
+					// child and leaf positions follow from the lanes before
+					uint32_t child[Width], count[Width];
+					uint32_t nextChild = node.childBase, nextLeaf = node.leafBase;
+					for (int i = 0; i < Width; ++i) {
+						if (node.innerMask & (1 << i)) {
+							child[i] = nextChild++;
+							count[i] = 0;
+						} else {
+							child[i] = nextLeaf;
+							count[i] = node.count[i];
+							nextLeaf += node.count[i];
+						}
+					}
+
+					// sort the hit lanes far to near so that the nearest is popped first
+					int lanes[Width], hits = 0;
+					for (; mask; mask &= mask - 1) {
+						int lane = __builtin_ctz(mask);
+						int k = hits++;
+						while (k > 0 && tNear[lanes[k - 1]] < tNear[lane]) {
+							lanes[k] = lanes[k - 1];
+							--k;
+						}
+						lanes[k] = lane;
+					}
+					for (int k = 0; k < hits; ++k) {
+						int lane = lanes[k];
+						stack[sp++] = { child[lane], count[lane], tNear[lane] };
+					}
+				}
+			}
+
+			/**
+			* Same contract as bvh_t::traversePacket
+			*/
+			template <typename LeafVisitor>
+			void traversePacket(ray_packet_t& packet, LeafVisitor&& visitLeaf) const {
+				traverse_wide_packet<Width>(packet, indices, unbounded, nodes.empty(),
+					[&](uint32_t idx, float (&lo)[3][Width], float (&hi)[3][Width], uint32_t* child, uint32_t* count) {
+						quantized_node_t<Width> const& node = nodes[idx];
+						decode_bounds<Width>(node, lo, hi);
+						uint32_t nextChild = node.childBase, nextLeaf = node.leafBase;
+						for (int i = 0; i < Width; ++i) {
+							if (node.innerMask & (1 << i)) {
+								child[i] = nextChild++;
+								count[i] = 0;
+							} else {
+								child[i] = nextLeaf;
+								count[i] = node.count[i];
+								nextLeaf += node.count[i];
+							}
+						}
+						return node.innerMask | node.leafMask();
+					}, visitLeaf);
+			}
+		};
+
+		typedef quantized_bvh_t<8> qbvh8_t;
+
+		/**
+		* Quantize a wide tree. Leaves of more than 255 objects are spread over
+		* extra nodes. The quantized tree cannot be refit, only rebuilt.
+		*/
+		template <int Width>
+		void compress(wide_bvh_t<Width> const& wide, quantized_bvh_t<Width>& quantized);
+
+		template <int Width>
+		memory_stats_t memory_stats(quantized_bvh_t<Width> const& quantized) {
+			memory_stats_t stats;
+			stats.nodes = quantized.nodes.size();
+			stats.nodeBytes = quantized.nodes.size() * sizeof(quantized_node_t<Width>);
+			stats.indexBytes = (quantized.indices.size() + quantized.unbounded.size()) * sizeof(uint32_t);
+			return stats;
+		}
+	}
+}
+
+#endif
\ No newline at end of file
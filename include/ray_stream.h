@@ -0,0 +1,19 @@
+#ifndef RAY_STREAM_H
+#define RAY_STREAM_H
+#include "accel.h"
+
+namespace donkey {
+
+	namespace accel {
+
+		/**
+		* Order in which to trace a batch of incoherent rays: by direction octant,
+		* then by the Morton code of the origin on a 1024^3 grid over the bounds
+		* of all origins. Rays next to each other in this order start close
+		* together and head the same way, so they mostly walk the same nodes.
+		*/
+		void sort_rays(std::vector<geom::ray_t> const& rays, std::vector<uint32_t>& order);
+	}
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef SPHERE_STORE_H
+#define SPHERE_STORE_H
+#include "accel.h"
+#include "compiled_scene.h"
+#include <string>
+
+namespace donkey {
+
+	namespace accel {
+
+		/**
+		* Spheres of a scene as structure of arrays, indexed like the scene objects
+		* so that leaves of any tree can be tested with a gather. Other objects and
+		* the padding at the end hold a sphere no ray can hit.
+		*/
+		struct sphere_store_t {
+			std::vector<float> 	cx;
+			std::vector<float> 	cy;
+			std::vector<float> 	cz;
+			std::vector<float> 	radius2;
+			std::vector<uint8_t> isSphere;		// per object
+			std::vector<uint32_t> material;		// per object, into compiled_scene_t::materials
+			uint32_t 			numObjects;
+
+			sphere_store_t(): numObjects(0) {}
+
+			void build(compiled_scene_t const& scene);
+
+			inline bool has(uint32_t objectIdx) const {
+				return objectIdx < numObjects && isSphere[objectIdx];
+			}
+
+			/**
+			* Nearest sphere among the listed objects that a ray enters in front of
+			* its origin no later than tMax. The test is slightly conservative: a
+			* grazing ray may report a sphere on_sphere misses, never the reverse.
+			* Returns the object index, or -1 with t unchanged.
+			*/
+			int32_t nearest(geom::ray_t const& ray, uint32_t const* objectIdx, uint32_t count,
+							float tMax, float& t) const;
+
+			/**
+			* Same for every object in [begin, end)
+			*/
+			int32_t nearestInRange(geom::ray_t const& ray, uint32_t begin, uint32_t end,
+								   float tMax, float& t) const;
+		};
+
+		/**
+		* Instruction set used by the sphere kernels, picked once from CPUID:
+		* "avx512", "avx2" or "scalar"
+		*/
+		const char* sphere_kernel_name();
+
+		/**
+		* Switch the sphere kernels to "avx512", "avx2" or "scalar", for checking
+		* them against each other. Returns false, changing nothing, when the CPU
+		* lacks the instruction set. Not to be called while rays are traced.
+		*/
+		bool use_sphere_kernel(std::string const& name);
+	}
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,340 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+#include "accel.h"
+#include <algorithm>
+
+#if defined(__SSE__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace donkey {
+
+	namespace accel {
+
+		/**
+		* Node of a collapsed BVH with Width children. Child bounds are stored as
+		* structure of arrays so that one slab test checks every child at once.
+		* Unused lanes have inverted bounds and never report a hit.
+		*/
+		template <int Width>
+		struct wide_node_t {
+			float 		lo[3][Width];
+			float 		hi[3][Width];
+			uint32_t 	child[Width];		// node index, or leaf offset in indices
+			uint32_t 	count[Width];		// objects in a leaf lane, 0 for node lanes
+
+			wide_node_t() {
+				for (int i = 0; i < Width; ++i) {
+					for (int a = 0; a < 3; ++a) {
+						lo[a][i] = std::numeric_limits<float>::max();
+						hi[a][i] = -std::numeric_limits<float>::max();
+					}
+					child[i] = 0;
+					count[i] = 0;
+				}
+			}
+
+			inline void setBounds(int lane, aabb_t const& box) {
+				for (int a = 0; a < 3; ++a) {
+					lo[a][lane] = box.lo[a];
+					hi[a][lane] = box.hi[a];
+				}
+			}
+		};
+
+		/**
+		* Ray data for the wide slab test: the near and far planes of every axis
+		* are picked once per ray from the direction signs.
+		*/
+		struct wide_ray_t {
+			float 	org[3];
+			float 	inv[3];
+			bool 	neg[3];
+
+			explicit wide_ray_t(geom::ray_t const& ray) {
+				ray_data_t rd(ray);
+				for (int a = 0; a < 3; ++a) {
+					org[a] = rd.origin[a];
+					inv[a] = rd.invDir[a];
+					neg[a] = rd.invDir[a] < 0.f;
+				}
+			}
+
+			wide_ray_t(ray_packet_t const& packet, uint32_t r) {
+				for (int a = 0; a < 3; ++a) {
+					org[a] = packet.org[a];
+					inv[a] = packet.inv[a][r];
+					neg[a] = inv[a] < 0.f;
+				}
+			}
+		};
+
+		/**
+		* Slab test of a ray against Width boxes stored as structure of arrays.
+		* Returns the mask of lanes hit before tMax and their entry distances.
+		* The SIMD widths below must give the same results, see check.cpp.
+		*/
+		template <int Width>
+		inline int intersect_boxes_scalar(float const (&lo)[3][Width], float const (&hi)[3][Width],
+										  wide_ray_t const& ray, float tMax, float* tNear) {
+			int mask = 0;
+			for (int i = 0; i < Width; ++i) {
+				float tn = 0.f, tf = tMax;
+				for (int a = 0; a < 3; ++a) {
+					float n = ray.neg[a] ? hi[a][i] : lo[a][i];
+					float f = ray.neg[a] ? lo[a][i] : hi[a][i];
+					tn = std::max(tn, (n - ray.org[a]) * ray.inv[a]);
+					tf = std::min(tf, (f - ray.org[a]) * ray.inv[a]);
+				}
+				tNear[i] = tn;
+				if (tn <= tf * 1.0000004f) mask |= 1 << i;
+			}
+			return mask;
+		}
+
+		template <int Width>
+		inline int intersect_boxes(float const (&lo)[3][Width], float const (&hi)[3][Width],
+								   wide_ray_t const& ray, float tMax, float* tNear) {
+			return intersect_boxes_scalar<Width>(lo, hi, ray, tMax, tNear);
+		}
+
+#if defined(__SSE__)
+		template <>
+		inline int intersect_boxes<4>(float const (&lo)[3][4], float const (&hi)[3][4],
+									   wide_ray_t const& ray, float tMax, float* tNear) {
+			__m128 tn = _mm_setzero_ps();
+			__m128 tf = _mm_set1_ps(tMax);
+			for (int a = 0; a < 3; ++a) {
+				const __m128 org = _mm_set1_ps(ray.org[a]);
+				const __m128 inv = _mm_set1_ps(ray.inv[a]);
+				const __m128 n = _mm_loadu_ps(ray.neg[a] ? hi[a] : lo[a]);
+				const __m128 f = _mm_loadu_ps(ray.neg[a] ? lo[a] : hi[a]);
+				tn = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(n, org), inv));
+				tf = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(f, org), inv));
+			}
+			_mm_storeu_ps(tNear, tn);
+			return _mm_movemask_ps(_mm_cmple_ps(tn, _mm_mul_ps(tf, _mm_set1_ps(1.0000004f))));
+		}
+#endif
+
+#if defined(__AVX__)
+		template <>
+		inline int intersect_boxes<8>(float const (&lo)[3][8], float const (&hi)[3][8],
+									   wide_ray_t const& ray, float tMax, float* tNear) {
+			__m256 tn = _mm256_setzero_ps();
+			__m256 tf = _mm256_set1_ps(tMax);
+			for (int a = 0; a < 3; ++a) {
+				const __m256 org = _mm256_set1_ps(ray.org[a]);
+				const __m256 inv = _mm256_set1_ps(ray.inv[a]);
+				const __m256 n = _mm256_loadu_ps(ray.neg[a] ? hi[a] : lo[a]);
+				const __m256 f = _mm256_loadu_ps(ray.neg[a] ? lo[a] : hi[a]);
+				tn = _mm256_max_ps(tn, _mm256_mul_ps(_mm256_sub_ps(n, org), inv));
+				tf = _mm256_min_ps(tf, _mm256_mul_ps(_mm256_sub_ps(f, org), inv));
+			}
+			_mm256_storeu_ps(tNear, tn);
+			return _mm256_movemask_ps(_mm256_cmp_ps(tn, _mm256_mul_ps(tf, _mm256_set1_ps(1.0000004f)), _CMP_LE_OQ));
+		}
+#endif
+
+		template <int Width>
+		inline int intersect_children(wide_node_t<Width> const& node, wide_ray_t const& ray, float tMax, float* tNear) {
+			return intersect_boxes<Width>(node.lo, node.hi, ray, tMax, tNear);
+		}
+
+		/**
+		* Packet traversal of a wide tree, see bvh_t::traversePacket. The tree is
+		* read through expand(node, lo, hi, child, count), which fills the lanes
+		* of a node and returns the mask of the used ones.
+		*/
+		template <int Width, typename Expand, typename LeafVisitor>
+		void traverse_wide_packet(ray_packet_t& packet, std::vector<uint32_t> const& indices,
+								  std::vector<uint32_t> const& unbounded, bool empty,
+								  Expand&& expand, LeafVisitor&& visitLeaf) {
+			uint32_t rays[ray_packet_t::kMaxRays];
+			if (!unbounded.empty()) {
+				for (uint32_t r = 0; r < packet.count; ++r)
+					rays[r] = r;
+				visitLeaf(unbounded.data(), unbounded.size(), rays, packet.count);
+			}
+
+			if (empty) return;
+
+			// lanes carry their bounds, the root has none
+			struct entry_t { uint32_t child; uint32_t count; uint32_t first; float lo[3]; float hi[3]; };
+			entry_t stack[kMaxTraversalDepth * Width];
+			int sp = 0;
+			entry_t& root = stack[sp++];
+			root.child = 0;
+			root.count = 0;
+			root.first = 0;
+			for (int a = 0; a < 3; ++a) {
+				root.lo[a] = -std::numeric_limits<float>::infinity();
+				root.hi[a] = std::numeric_limits<float>::infinity();
+			}
+
+			while (sp > 0) {
+				entry_t const top = stack[--sp];
+				const uint32_t first = packet_first_hit(top.lo, top.hi, packet, top.first);
+				if (first == packet.count) continue;
+
+				if (top.count) {
+					const uint32_t numRays = packet_hits(top.lo, top.hi, packet, first, rays);
+					visitLeaf(&indices[top.child], top.count, rays, numRays);
+					continue;
+				}
+
+				alignas(32) float lo[3][Width], hi[3][Width];
+				uint32_t child[Width], count[Width];
+				int mask = expand(top.child, lo, hi, child, count);
+
+				// the first active ray orders the lanes, the interval test culls them
+				alignas(32) float tNear[Width];
+				intersect_boxes<Width>(lo, hi, wide_ray_t(packet, first), packet.tMax[first], tNear);
+
+				int lanes[Width], hits = 0;
+				for (; mask; mask &= mask - 1) {
+					int lane = __builtin_ctz(mask);
+					float laneLo[3] = { lo[0][lane], lo[1][lane], lo[2][lane] };
+					float laneHi[3] = { hi[0][lane], hi[1][lane], hi[2][lane] };
+					if (!packet_box(laneLo, laneHi, packet)) continue;
+					int k = hits++;
+					while (k > 0 && tNear[lanes[k - 1]] < tNear[lane]) {
+						lanes[k] = lanes[k - 1];
+						--k;
+					}
+					lanes[k] = lane;
+				}
+				for (int k = 0; k < hits; ++k) {
+					int lane = lanes[k];
+					entry_t& entry = stack[sp++];
+					entry.child = child[lane];
+					entry.count = count[lane];
+					entry.first = first;
+					for (int a = 0; a < 3; ++a) {
+						entry.lo[a] = lo[a][lane];
+						entry.hi[a] = hi[a][lane];
+					}
+				}
+			}
+		}
+
+		template <int Width>
+		struct wide_bvh_t: public accelerator_t {
+			std::vector< wide_node_t<Width> > 	nodes;
+			std::vector<uint32_t> 				indices;
+			std::vector<uint32_t> 				unbounded;
+
+			wide_bvh_t(): accelerator_t(Width == 4 ? kBVH4 : kBVH8) {}
+
+			template <typename Visitor>
+			void traverse(geom::ray_t const& ray, float& tMax, Visitor&& visit) const {
+				traverseLeaves(ray, tMax, [&](uint32_t const* objects, uint32_t count, float& tmax) {
+					for (uint32_t i = 0; i < count; ++i)
+						visit(objects[i], tmax);
+				});
+			}
+
+			/**
+			* Same contract as bvh_t::traverseLeaves. Children hit by the ray are visited
+			* nearest first.
+			*/
+			template <typename LeafVisitor>
+			void traverseLeaves(geom::ray_t const& ray, float& tMax, LeafVisitor&& visitLeaf) const {
+				if (!unbounded.empty())
+					visitLeaf(unbounded.data(), unbounded.size(), tMax);
+
+				if (nodes.empty()) return;
+
+				const wide_ray_t wr(ray);
+				struct entry_t { uint32_t child; uint32_t count; float tNear; };
+				entry_t stack[kMaxTraversalDepth * Width];
+				int sp = 0;
+				stack[sp++] = { 0, 0, 0.f };
+
+				while (sp > 0) {
+					entry_t const top = stack[--sp];
+					if (top.tNear > tMax) continue;
+
+					if (top.count) {
+						visitLeaf(&indices[top.child], top.count, tMax);
+						continue;
+					}
+
+					wide_node_t<Width> const& node = nodes[top.child];
+					alignas(32) float tNear[Width];
+					int mask = intersect_children<Width>(node, wr, tMax, tNear);
+					if (!mask) continue;
+
+					// sort the hit lanes far to near so that the nearest is popped first
+					int lanes[Width], hits = 0;
+					for (; mask; mask &= mask - 1) {
+						int lane = __builtin_ctz(mask);
+						int k = hits++;
+						while (k > 0 && tNear[lanes[k - 1]] < tNear[lane]) {
+							lanes[k] = lanes[k - 1];
+							--k;
+						}
+						lanes[k] = lane;
+					}
+					for (int k = 0; k < hits; ++k) {
+						int lane = lanes[k];
+						stack[sp++] = { node.child[lane], node.count[lane], tNear[lane] };
+					}
+				}
+			}
+
+			/**
+			* Same contract as bvh_t::traversePacket
+			*/
+			template <typename LeafVisitor>
+			void traversePacket(ray_packet_t& packet, LeafVisitor&& visitLeaf) const {
+				traverse_wide_packet<Width>(packet, indices, unbounded, nodes.empty(),
+					[&](uint32_t idx, float (&lo)[3][Width], float (&hi)[3][Width], uint32_t* child, uint32_t* count) {
+						wide_node_t<Width> const& node = nodes[idx];
+						int mask = 0;
+						for (int i = 0; i < Width; ++i) {
+							for (int a = 0; a < 3; ++a) {
+								lo[a][i] = node.lo[a][i];
+								hi[a][i] = node.hi[a][i];
+							}
+							child[i] = node.child[i];
+							count[i] = node.count[i];
+							// unused lanes have inverted bounds
+							if (node.lo[0][i] <= node.hi[0][i]) mask |= 1 << i;
+						}
+						return mask;
+					}, visitLeaf);
+			}
+		};
+
+		typedef wide_bvh_t<4> bvh4_t;
+		typedef wide_bvh_t<8> bvh8_t;
+
+		/**
+		* Collapse a binary BVH into a Width-wide one by repeatedly opening the
+		* interior child with the largest surface area.
+		*/
+		template <int Width>
+		void collapse(bvh_t const& bvh, wide_bvh_t<Width>& wide);
+
+		/**
+		* Refit the lanes of a wide tree bottom-up, see refit(bvh_t&, ...)
+		*/
+		template <int Width>
+		void refit(wide_bvh_t<Width>& wide, std::vector<aabb_t> const& bounds);
+
+		template <int Width>
+		float sah_cost(wide_bvh_t<Width> const& wide, build_params_t const& params = build_params_t());
+
+		template <int Width>
+		memory_stats_t memory_stats(wide_bvh_t<Width> const& wide) {
+			memory_stats_t stats;
+			stats.nodes = wide.nodes.size();
+			stats.nodeBytes = wide.nodes.size() * sizeof(wide_node_t<Width>);
+			stats.indexBytes = (wide.indices.size() + wide.unbounded.size()) * sizeof(uint32_t);
+			return stats;
+		}
+	}
+}
+
+#endif
\ No newline at end of file
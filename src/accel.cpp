@@ -0,0 +1,252 @@
+#include "accel.h"
+#include "parallel.h"
+#include <algorithm>
+
+namespace donkey {
+
+	namespace accel {
+
+		bool bounds_of(object::scene_object_t const& object, aabb_t& box) {
+			switch (object.type) {
+				case object::kSphere: {
+					primitive::sphere_t const& sphere = static_cast<primitive::sphere_t const&>(object);
+					vector_t r(std::fabs(sphere.radius));
+					box = aabb_t(sphere.center - r, sphere.center + r);
+					return true;
+				}
+
+				case object::kCube: {
+					primitive::cube_t const& cube = static_cast<primitive::cube_t const&>(object);
+					box = aabb_t(cube.lo, cube.hi);
+					return true;
+				}
+
+				case object::kTriangle: {
+					primitive::triangle_t const& tri = static_cast<primitive::triangle_t const&>(object);
+					box = aabb_t();
+					box.grow(tri.v0);
+					box.grow(tri.v1);
+					box.grow(tri.v2);
+					return true;
+				}
+
+				default:;
+			}
+			return false;
+		}
+
+		namespace {
+
+			struct prim_ref_t {
+				aabb_t 		bounds;
+				point_t 	centroid;
+				uint32_t 	index;
+			};
+
+			struct bin_t {
+				aabb_t 	bounds;
+				int 	count;
+				bin_t(): count(0) {}
+			};
+
+			const int kMaxBuildDepth = 60;
+
+			struct sah_builder_t {
+				build_params_t const& params;
+				std::vector<prim_ref_t>& refs;
+				std::vector<bvh_node_t>& nodes;
+
+				sah_builder_t(build_params_t const& buildParams,
+							  std::vector<prim_ref_t>& primRefs,
+							  std::vector<bvh_node_t>& bvhNodes):
+					params(buildParams), refs(primRefs), nodes(bvhNodes) {}
+
+				uint32_t makeLeaf(uint32_t nodeIdx, uint32_t begin, uint32_t end) {
+					nodes[nodeIdx].offset = begin;
+					nodes[nodeIdx].count = end - begin;
+					return nodeIdx;
+				}
+
+				uint32_t build(uint32_t begin, uint32_t end, int depth) {
+					const uint32_t nodeIdx = nodes.size();
+					nodes.push_back(bvh_node_t());
+
+					aabb_t bounds, centroids;
+					for (uint32_t i = begin; i < end; ++i) {
+						bounds.grow(refs[i].bounds);
+						centroids.grow(refs[i].centroid);
+					}
+					nodes[nodeIdx].bounds = bounds;
+
+					const uint32_t count = end - begin;
+					if (count <= 1 || depth >= kMaxBuildDepth)
+						return makeLeaf(nodeIdx, begin, end);
+
+					uint32_t mid = begin;
+					const int axis = centroids.longestAxis();
+					const float lo = centroids.lo[axis], hi = centroids.hi[axis];
+
+					if (hi <= lo) {
+						// all centroids coincide, binning cannot separate them
+						if (count <= (uint32_t)params.maxLeafSize)
+							return makeLeaf(nodeIdx, begin, end);
+						mid = begin + count / 2;
+					} else {
+						int bestAxis = -1, bestBin = 0;
+						float bestCost = std::numeric_limits<float>::max();
+						const int nb = params.numBins;
+						std::vector<bin_t> bins(nb);
+						std::vector<float> rightCost(nb);
+
+						for (int a = 0; a < 3; ++a) {
+							const float alo = centroids.lo[a], ahi = centroids.hi[a];
+							if (ahi <= alo) continue;
+							const float scale = nb / (ahi - alo);
+
+							std::fill(bins.begin(), bins.end(), bin_t());
+							for (uint32_t i = begin; i < end; ++i) {
+								int b = std::min(nb - 1, (int)((refs[i].centroid[a] - alo) * scale));
+								bins[b].count++;
+								bins[b].bounds.grow(refs[i].bounds);
+							}
+
+							// sweep from the right to get area * count of every right side
+							aabb_t rb;
+							int rc = 0;
+							for (int b = nb - 1; b > 0; --b) {
+								rb.grow(bins[b].bounds);
+								rc += bins[b].count;
+								rightCost[b] = rb.area() * rc;
+							}
+
+							aabb_t lb;
+							int lc = 0;
+							for (int b = 0; b < nb - 1; ++b) {
+								lb.grow(bins[b].bounds);
+								lc += bins[b].count;
+								float cost = lb.area() * lc + rightCost[b + 1];
+								if (lc > 0 && lc < (int)count && cost < bestCost) {
+									bestCost = cost;
+									bestAxis = a;
+									bestBin = b;
+								}
+							}
+						}
+
+						const float leafCost = params.intersectionCost * count;
+						const float splitCost = bestAxis < 0 ? std::numeric_limits<float>::max() :
+							params.traversalCost + params.intersectionCost * bestCost / bounds.area();
+
+						// split anyway when the leaf would be too large
+						if (bestAxis < 0 || (splitCost >= leafCost && count <= (uint32_t)params.maxLeafSize))
+							return makeLeaf(nodeIdx, begin, end);
+
+						const float alo = centroids.lo[bestAxis];
+						const float scale = nb / (centroids.hi[bestAxis] - alo);
+						prim_ref_t* split = std::partition(&refs[begin], &refs[0] + end, [&](prim_ref_t const& r) {
+							return std::min(nb - 1, (int)((r.centroid[bestAxis] - alo) * scale)) <= bestBin;
+						});
+						mid = split - &refs[0];
+					}
+
+					build(begin, mid, depth + 1);
+					nodes[nodeIdx].offset = build(mid, end, depth + 1);
+					nodes[nodeIdx].count = 0;
+					return nodeIdx;
+				}
+			};
+		}
+
+		void object_bounds(scene_object_list const& objects, std::vector<aabb_t>& bounds, int numThreads) {
+			bounds.assign(objects.size(), aabb_t());
+			parallel::chunks(objects.size(), numThreads > 0 ? numThreads : parallel::hardware_threads(),
+				[&](size_t b, size_t e, int) {
+					for (size_t i = b; i < e; ++i) {
+						if (objects[i] && !bounds_of(*objects[i], bounds[i]))
+							bounds[i] = aabb_t();
+					}
+				});
+		}
+
+		void drop_planes(scene_object_list const& objects, std::vector<uint32_t>& unbounded) {
+			unbounded.erase(std::remove_if(unbounded.begin(), unbounded.end(), [&](uint32_t idx) {
+				return objects[idx] && objects[idx]->type == object::kPlane;
+			}), unbounded.end());
+		}
+
+		void build_sah(std::vector<aabb_t> const& bounds, bvh_t& bvh, build_params_t const& params) {
+			bvh.nodes.clear();
+			bvh.indices.clear();
+			bvh.unbounded.clear();
+
+			std::vector<prim_ref_t> refs;
+			refs.reserve(bounds.size());
+			for (uint32_t i = 0; i < bounds.size(); ++i) {
+				if (bounds[i].valid()) {
+					prim_ref_t ref;
+					ref.bounds = bounds[i];
+					ref.centroid = ref.bounds.centroid();
+					ref.index = i;
+					refs.push_back(ref);
+				} else {
+					bvh.unbounded.push_back(i);
+				}
+			}
+
+			if (refs.empty()) return;
+
+			bvh.nodes.reserve(2 * refs.size());
+			sah_builder_t builder(params, refs, bvh.nodes);
+			builder.build(0, refs.size(), 0);
+
+			bvh.indices.resize(refs.size());
+			for (size_t i = 0; i < refs.size(); ++i)
+				bvh.indices[i] = refs[i].index;
+		}
+
+		void build(build_type type, std::vector<aabb_t> const& bounds, bvh_t& bvh, build_params_t const& params) {
+			switch (type) {
+				case kBuildLBVH:
+					build_lbvh(bounds, bvh, params);
+					break;
+				case kBuildSAH:
+				default:
+					build_sah(bounds, bvh, params);
+			}
+		}
+
+		void build(build_type type, scene_object_list const& objects, bvh_t& bvh, build_params_t const& params) {
+			std::vector<aabb_t> bounds;
+			object_bounds(objects, bounds, params.numThreads);
+			build(type, bounds, bvh, params);
+		}
+
+		void refit(bvh_t& bvh, std::vector<aabb_t> const& bounds) {
+			// children are always stored after their parent, so a reverse sweep is bottom-up
+			for (size_t i = bvh.nodes.size(); i-- > 0; ) {
+				bvh_node_t& node = bvh.nodes[i];
+				node.bounds = aabb_t();
+				if (node.isLeaf()) {
+					for (uint32_t k = node.offset, e = node.offset + node.count; k < e; ++k)
+						node.bounds.grow(bounds[bvh.indices[k]]);
+				} else {
+					node.bounds.grow(bvh.nodes[i + 1].bounds);
+					node.bounds.grow(bvh.nodes[node.offset].bounds);
+				}
+			}
+		}
+
+		float sah_cost(bvh_t const& bvh, build_params_t const& params) {
+			if (bvh.nodes.empty()) return 0.f;
+			const float rootArea = bvh.nodes[0].bounds.area();
+			if (rootArea <= 0.f) return 0.f;
+
+			float cost = 0.f;
+			for (auto const& node: bvh.nodes) {
+				float weight = node.isLeaf() ? params.intersectionCost * node.count : params.traversalCost;
+				cost += weight * node.bounds.area();
+			}
+			return cost / rootArea;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,436 @@
+#include "accel_cache.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace donkey {
+
+	namespace accel {
+
+		namespace {
+
+			const char kMagic[4] = { 'N', 'B', 'A', 'C' };
+			const uint32_t kVersion = 3;
+
+			struct header_t {
+				char 		magic[4];
+				uint32_t 	version;
+				uint64_t 	hash;
+				uint32_t 	type;
+				float 		cost;
+				uint64_t 	fullBytes;
+				uint64_t 	numObjects;
+			};
+
+			struct writer_t {
+				FILE* file;
+				bool ok;
+
+				explicit writer_t(FILE* f): file(f), ok(f != nullptr) {}
+
+				template <typename T>
+				void pod(T const& value) {
+					ok = ok && fwrite(&value, sizeof(T), 1, file) == 1;
+				}
+
+				template <typename T>
+				void array(std::vector<T> const& values) {
+					pod<uint64_t>(values.size());
+					if (!values.empty())
+						ok = ok && fwrite(values.data(), sizeof(T), values.size(), file) == values.size();
+				}
+			};
+
+			struct reader_t {
+				char const* pos;
+				char const* end;
+
+				reader_t(char const* begin, size_t size): pos(begin), end(begin + size) {}
+
+				template <typename T>
+				bool pod(T& value) {
+					if (size_t(end - pos) < sizeof(T)) return false;
+					std::memcpy(&value, pos, sizeof(T));
+					pos += sizeof(T);
+					return true;
+				}
+
+				template <typename T>
+				bool array(std::vector<T>& values) {
+					uint64_t count;
+					if (!pod(count) || count > size_t(end - pos) / sizeof(T)) return false;
+					values.resize(count);
+					if (count)
+						std::memcpy(values.data(), pos, count * sizeof(T));
+					pos += count * sizeof(T);
+					return true;
+				}
+			};
+
+			template <typename Tree>
+			void write_tree(writer_t& out, Tree const& tree) {
+				out.array(tree.nodes);
+				out.array(tree.indices);
+				out.array(tree.unbounded);
+			}
+
+			template <typename Tree>
+			bool read_tree(reader_t& in, Tree& tree) {
+				return in.array(tree.nodes) && in.array(tree.indices) && in.array(tree.unbounded);
+			}
+
+			void write_level(writer_t& out, grid_level_t const& level) {
+				out.pod(level.bounds);
+				out.pod(level.res);
+				out.pod(level.cellSize);
+				out.pod(level.invCellSize);
+				out.array(level.cellStart);
+				out.array(level.refs);
+			}
+
+			bool read_level(reader_t& in, grid_level_t& level) {
+				return in.pod(level.bounds) && in.pod(level.res) && in.pod(level.cellSize) &&
+					in.pod(level.invCellSize) && in.array(level.cellStart) && in.array(level.refs);
+			}
+
+			template <typename Tree>
+			std::shared_ptr<accelerator_t> read_tree(reader_t& in) {
+				auto tree = std::make_shared<Tree>();
+				return read_tree(in, *tree) ? tree : nullptr;
+			}
+
+			std::shared_ptr<accelerator_t> read_grid(reader_t& in) {
+				auto grid = std::make_shared<grid_t>();
+				uint64_t numSubgrids;
+				if (!read_level(in, grid->top) || !in.array(grid->subgridOf) ||
+					!in.array(grid->unbounded) || !in.pod(numSubgrids))
+					return nullptr;
+				if (numSubgrids > size_t(in.end - in.pos)) return nullptr;
+				grid->subgrids.resize(numSubgrids);
+				for (auto& sub: grid->subgrids)
+					if (!read_level(in, sub)) return nullptr;
+				return grid;
+			}
+
+			// leaf range [offset, offset + count) within size
+			inline bool valid_range(uint64_t offset, uint64_t count, size_t size) {
+				return offset <= size && count <= size - offset;
+			}
+
+			inline bool valid_objects(std::vector<uint32_t> const& indices, size_t numObjects) {
+				for (auto idx: indices)
+					if (idx >= numObjects) return false;
+				return true;
+			}
+
+			/**
+			* Walk a tree from its root with children(node, out), which lists the
+			* child nodes of node and checks its leaves. Fails on a child past the
+			* nodes, on a walk visiting more nodes than there are (a cycle) and on
+			* paths deeper than the traversal stacks hold.
+			*/
+			template <typename Children>
+			bool valid_walk(size_t numNodes, Children children) {
+				if (!numNodes) return true;
+				std::vector< std::pair<uint32_t, int> > stack(1, std::make_pair(0u, 0));
+				std::vector<uint32_t> out;
+				size_t visited = 0;
+				while (!stack.empty()) {
+					const std::pair<uint32_t, int> top = stack.back();
+					stack.pop_back();
+					if (++visited > numNodes || top.second >= kMaxTraversalDepth) return false;
+					out.clear();
+					if (!children(top.first, out)) return false;
+					for (auto child: out) {
+						if (child >= numNodes) return false;
+						stack.push_back(std::make_pair(child, top.second + 1));
+					}
+				}
+				return true;
+			}
+
+			bool valid_tree(bvh_t const& tree, size_t numObjects) {
+				return valid_objects(tree.indices, numObjects) && valid_objects(tree.unbounded, numObjects) &&
+					valid_walk(tree.nodes.size(), [&](uint32_t idx, std::vector<uint32_t>& out) {
+						bvh_node_t const& node = tree.nodes[idx];
+						if (node.isLeaf())
+							return valid_range(node.offset, node.count, tree.indices.size());
+						out.push_back(idx + 1);
+						out.push_back(node.offset);
+						return true;
+					});
+			}
+
+			template <int Width>
+			bool valid_tree(wide_bvh_t<Width> const& tree, size_t numObjects) {
+				return valid_objects(tree.indices, numObjects) && valid_objects(tree.unbounded, numObjects) &&
+					valid_walk(tree.nodes.size(), [&](uint32_t idx, std::vector<uint32_t>& out) {
+						wide_node_t<Width> const& node = tree.nodes[idx];
+						for (int i = 0; i < Width; ++i) {
+							if (node.count[i] && !valid_range(node.child[i], node.count[i], tree.indices.size()))
+								return false;
+							// unused lanes have empty bounds and are never entered
+							if (!node.count[i] && node.lo[0][i] <= node.hi[0][i])
+								out.push_back(node.child[i]);
+						}
+						return true;
+					});
+			}
+
+			template <int Width>
+			bool valid_tree(quantized_bvh_t<Width> const& tree, size_t numObjects) {
+				return valid_objects(tree.indices, numObjects) && valid_objects(tree.unbounded, numObjects) &&
+					valid_walk(tree.nodes.size(), [&](uint32_t idx, std::vector<uint32_t>& out) {
+						quantized_node_t<Width> const& node = tree.nodes[idx];
+						uint32_t nextChild = node.childBase;
+						uint64_t nextLeaf = node.leafBase;
+						for (int i = 0; i < Width; ++i) {
+							if (node.innerMask & (1 << i)) {
+								out.push_back(nextChild++);
+							} else {
+								nextLeaf += node.count[i];
+							}
+						}
+						return valid_range(node.leafBase, nextLeaf - node.leafBase, tree.indices.size());
+					});
+			}
+
+			bool valid_level(grid_level_t const& level, size_t numObjects) {
+				if (level.cellStart.empty() && level.refs.empty()) return true;
+				if (level.res.x < 1 || level.res.y < 1 || level.res.z < 1) return false;
+				const uint64_t numCells = uint64_t(level.res.x) * level.res.y * level.res.z;
+				if (level.cellStart.size() != numCells + 1 || level.cellStart.back() != level.refs.size())
+					return false;
+				for (size_t c = 0; c + 1 < level.cellStart.size(); ++c)
+					if (level.cellStart[c] > level.cellStart[c + 1]) return false;
+				return valid_objects(level.refs, numObjects);
+			}
+
+			bool valid_grid(grid_t const& grid, size_t numObjects) {
+				if (!valid_level(grid.top, numObjects) || !valid_objects(grid.unbounded, numObjects))
+					return false;
+				if (!grid.top.cellStart.empty() && grid.subgridOf.size() != grid.top.cellStart.size() - 1)
+					return false;
+				for (auto sub: grid.subgridOf)
+					if (sub < -1 || sub >= (int64_t)grid.subgrids.size()) return false;
+				for (auto const& sub: grid.subgrids)
+					if (!valid_level(sub, numObjects)) return false;
+				return true;
+			}
+
+			/**
+			* Every index of the structure within its own arrays and the objects.
+			* A corrupt file with a valid header then makes a rebuild, not a crash.
+			*/
+			bool valid_accel(accelerator_t const& accel, size_t numObjects) {
+				switch (accel.type) {
+					case kBVH: return valid_tree(static_cast<bvh_t const&>(accel), numObjects);
+					case kBVH4: return valid_tree(static_cast<bvh4_t const&>(accel), numObjects);
+					case kBVH8: return valid_tree(static_cast<bvh8_t const&>(accel), numObjects);
+					case kQBVH8: return valid_tree(static_cast<qbvh8_t const&>(accel), numObjects);
+					case kGrid: return valid_grid(static_cast<grid_t const&>(accel), numObjects);
+					default:;
+				}
+				return false;
+			}
+
+			template <typename T>
+			inline uint64_t hash_value(T const& value, uint64_t hash) {
+				return hash_bytes(&value, sizeof(T), hash);
+			}
+		}
+
+		uint64_t hash_bytes(void const* data, size_t size, uint64_t hash) {
+			unsigned char const* bytes = static_cast<unsigned char const*>(data);
+			for (size_t i = 0; i < size; ++i) {
+				hash ^= bytes[i];
+				hash *= 0x100000001b3ull;
+			}
+			return hash;
+		}
+
+		uint64_t scene_hash(scene_object_list const& objects, uint64_t seed) {
+			uint64_t hash = hash_value(kVersion, seed);
+			hash = hash_value<uint64_t>(objects.size(), hash);
+
+			// meshes are hashed once, later references use their number
+			std::map<object::trimesh_t const*, uint32_t> meshes;
+			for (auto const& object: objects) {
+				if (!object) {
+					hash = hash_value<int>(-1, hash);
+					continue;
+				}
+				hash = hash_value<int>(object->type, hash);
+
+				object::trimesh_t const* mesh = mesh_of(*object);
+				if (mesh) {
+					auto it = meshes.find(mesh);
+					if (it == meshes.end()) {
+						it = meshes.insert(std::make_pair(mesh, (uint32_t)meshes.size())).first;
+						hash = hash_value<uint64_t>(mesh->geometry.vertices.size(), hash);
+						for (auto const& vertex: mesh->geometry.vertices)
+							hash = hash_value(vertex.position, hash);
+						hash = hash_value<uint64_t>(mesh->geometry.faces.size(), hash);
+						for (auto const& face: mesh->geometry.faces)
+							hash = hash_value(face.index, hash);
+					}
+					hash = hash_value(it->second, hash);
+					if (object->type == object::kInstance)
+						hash = hash_value(static_cast<primitive::instance_t const&>(*object).transform, hash);
+					continue;
+				}
+
+				aabb_t box;
+				const bool bounded = bounds_of(*object, box);
+				hash = hash_value(bounded, hash);
+				if (bounded)
+					hash = hash_value(box, hash);
+			}
+			return hash;
+		}
+
+		std::string cache_file(std::string const& directory, uint64_t hash) {
+			char name[32];
+			snprintf(name, sizeof(name), "%016llx.nbac", (unsigned long long)hash);
+			return directory.empty() ? std::string(name) : directory + "/" + name;
+		}
+
+		bool save_cache(std::string const& file, uint64_t hash, cached_accel_t const& cached) {
+			if (!cached.accel || !cached.instances) return false;
+
+			// a file of our own next to the target, so concurrent runs never write into each other's
+			std::string tmp = file + ".XXXXXX";
+			const int fd = mkstemp(&tmp[0]);
+			FILE* f = fd < 0 ? nullptr : fdopen(fd, "wb");
+			if (fd >= 0 && !f) close(fd);
+			writer_t out(f);
+
+			header_t header;
+			std::memcpy(header.magic, kMagic, sizeof(kMagic));
+			header.version = kVersion;
+			header.hash = hash;
+			header.type = cached.accel->type;
+			header.cost = cached.cost;
+			header.fullBytes = cached.fullBytes;
+			header.numObjects = cached.instances->blasOf.size();
+			out.pod(header);
+
+			switch (cached.accel->type) {
+				case kBVH: write_tree(out, static_cast<bvh_t const&>(*cached.accel)); break;
+				case kBVH4: write_tree(out, static_cast<bvh4_t const&>(*cached.accel)); break;
+				case kBVH8: write_tree(out, static_cast<bvh8_t const&>(*cached.accel)); break;
+				case kQBVH8: write_tree(out, static_cast<qbvh8_t const&>(*cached.accel)); break;
+				case kGrid: {
+					grid_t const& grid = static_cast<grid_t const&>(*cached.accel);
+					write_level(out, grid.top);
+					out.array(grid.subgridOf);
+					out.array(grid.unbounded);
+					out.pod<uint64_t>(grid.subgrids.size());
+					for (auto const& sub: grid.subgrids)
+						write_level(out, sub);
+					break;
+				}
+				default:
+					out.ok = false;
+			}
+
+			out.array(cached.instances->blasOf);
+			out.pod<uint64_t>(cached.instances->blases.size());
+			for (auto const& blas: cached.instances->blases)
+				write_tree(out, blas.bvh);
+
+			// on disk before it is renamed into place, or a crash can leave an empty file behind
+			bool ok = out.ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+			if (f) ok = (fclose(f) == 0) && ok;
+			if (ok) ok = rename(tmp.c_str(), file.c_str()) == 0;
+			if (!ok && fd >= 0) remove(tmp.c_str());
+			return ok;
+		}
+
+		bool load_cache(std::string const& file, uint64_t hash, scene_object_list const& objects, cached_accel_t& cached) {
+			int fd = open(file.c_str(), O_RDONLY);
+			if (fd < 0) return false;
+
+			struct stat st;
+			if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header_t)) {
+				close(fd);
+				return false;
+			}
+			const size_t size = st.st_size;
+			void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (mapped == MAP_FAILED) return false;
+			madvise(mapped, size, MADV_SEQUENTIAL);
+
+			reader_t in(static_cast<char const*>(mapped), size);
+			header_t header;
+			bool ok = in.pod(header) &&
+				std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+				header.version == kVersion &&
+				header.hash == hash &&
+				header.numObjects == objects.size();
+
+			cached_accel_t loaded;
+			if (ok) {
+				switch (header.type) {
+					case kBVH: loaded.accel = read_tree<bvh_t>(in); break;
+					case kBVH4: loaded.accel = read_tree<bvh4_t>(in); break;
+					case kBVH8: loaded.accel = read_tree<bvh8_t>(in); break;
+					case kQBVH8: loaded.accel = read_tree<qbvh8_t>(in); break;
+					case kGrid: loaded.accel = read_grid(in); break;
+					default:;
+				}
+				ok = loaded.accel != nullptr && valid_accel(*loaded.accel, objects.size());
+			}
+
+			if (ok) {
+				loaded.instances = std::make_shared<instances_t>();
+				uint64_t numBlases;
+				ok = in.array(loaded.instances->blasOf) && in.pod(numBlases) &&
+					loaded.instances->blasOf.size() == objects.size() &&
+					numBlases <= size_t(in.end - in.pos);
+				if (ok) {
+					loaded.instances->blases.resize(numBlases);
+					for (auto& blas: loaded.instances->blases) {
+						blas.mesh = nullptr;
+						ok = ok && read_tree(in, blas.bvh);
+					}
+				}
+			}
+
+			// the structures own copies of their arrays, refits write to them
+			munmap(mapped, size);
+
+			// point the mesh trees at the meshes of this run
+			for (size_t i = 0; ok && i < objects.size(); ++i) {
+				const int32_t b = loaded.instances->blasOf[i];
+				if (b < 0) continue;
+				object::trimesh_t const* mesh = objects[i] ? mesh_of(*objects[i]) : nullptr;
+				if (!mesh || b >= (int32_t)loaded.instances->blases.size()) {
+					ok = false;
+					break;
+				}
+				loaded.instances->blases[b].mesh = mesh;
+			}
+			for (size_t b = 0; ok && b < loaded.instances->blases.size(); ++b) {
+				blas_t const& blas = loaded.instances->blases[b];
+				ok = !blas.mesh || valid_tree(blas.bvh, blas.mesh->geometry.faces.size());
+			}
+			if (!ok) return false;
+			for (auto& blas: loaded.instances->blases) {
+				if (blas.mesh)
+					prepare_triangles(blas);
+			}
+
+			loaded.cost = header.cost;
+			loaded.fullBytes = header.fullBytes;
+			cached = loaded;
+			return true;
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,372 @@
+#include "donkey.h"
+#include "accel.h"
+#include "wide_bvh.h"
+#include "quantized_bvh.h"
+#include "grid.h"
+#include "sphere_store.h"
+#include "compiled_scene.h"
+#include "framebuffer.h"
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+* Traces random rays through the acceleration structures and compares the
+* closest hits they find with a linear scan of the objects. The SIMD kernels
+* are compared with the scalar code they replace.
+* Prints the failed checks and exits with 1 if there are any.
+*/
+
+namespace {
+
+	using namespace donkey;
+
+	const int kRays = 20000;
+	const float kNoLimit = std::numeric_limits<float>::max();
+
+	struct check_t {
+		std::string 	name;
+		unsigned long 	runs;
+		unsigned long 	failures;
+
+		explicit check_t(std::string const& checkName): name(checkName), runs(0), failures(0) {}
+
+		// record one comparison, the first few failures are printed
+		void expect(bool ok, int ray) {
+			++runs;
+			if (ok) return;
+			if (++failures <= 5)
+				printf("  %s: mismatch at ray %d\n", name.c_str(), ray);
+		}
+
+		bool report() const {
+			printf("%-24s %8lu runs %8lu failed\n", name.c_str(), runs, failures);
+			return failures == 0;
+		}
+	};
+
+	struct random_t {
+		std::mt19937 	rng;
+
+		random_t(): rng(1234) {}
+
+		inline float uniform(float lo, float hi) {
+			return std::uniform_real_distribution<float>(lo, hi)(rng);
+		}
+
+		inline uint32_t below(uint32_t n) {
+			return std::uniform_int_distribution<uint32_t>(0, n - 1)(rng);
+		}
+
+		inline point_t point(float extent) {
+			return point_t(uniform(-extent, extent), uniform(-extent, extent), uniform(-extent, extent));
+		}
+
+		// random origin and direction, half of them towards the middle of the scene
+		geom::ray_t ray() {
+			const point_t origin = point(15.f);
+			const point_t towards = (below(2) ? point(6.f) : origin + point(1.f));
+			return geom::ray_t(origin, towards);
+		}
+
+		// unlimited for half the rays
+		inline float tMax() {
+			return below(2) ? kNoLimit : uniform(0.f, 4.f);
+		}
+	};
+
+	template <int Width>
+	bool check_boxes(random_t& random) {
+		check_t check("intersect_boxes<" + std::to_string(Width) + ">");
+		float lo[3][Width], hi[3][Width];
+		for (int r = 0; r < kRays; ++r) {
+			for (int i = 0; i < Width; ++i) {
+				// some unused lanes, as in partly filled nodes
+				accel::aabb_t box;
+				if (random.below(8)) {
+					box.grow(random.point(8.f));
+					box.grow(random.point(8.f));
+				}
+				for (int a = 0; a < 3; ++a) {
+					lo[a][i] = box.lo[a];
+					hi[a][i] = box.hi[a];
+				}
+			}
+			const accel::wide_ray_t ray(random.ray());
+			const float tMax = random.tMax();
+			float tSimd[Width], tScalar[Width];
+			const int mask = accel::intersect_boxes<Width>(lo, hi, ray, tMax, tSimd);
+			bool same = mask == accel::intersect_boxes_scalar<Width>(lo, hi, ray, tMax, tScalar);
+			for (int i = 0; i < Width; ++i)
+				if (mask & (1 << i)) same = same && tSimd[i] == tScalar[i];
+			check.expect(same, r);
+		}
+		return check.report();
+	}
+
+	template <int Width>
+	bool check_decode(random_t& random) {
+		check_t check("decode_bounds<" + std::to_string(Width) + ">");
+		accel::quantized_node_t<Width> node;
+		for (int r = 0; r < kRays; ++r) {
+			for (int a = 0; a < 3; ++a) {
+				node.origin[a] = random.uniform(-100.f, 100.f);
+				node.exponent[a] = int8_t(random.below(24)) - 16;
+				for (int i = 0; i < Width; ++i) {
+					node.qlo[a][i] = uint8_t(random.below(256));
+					node.qhi[a][i] = uint8_t(random.below(256));
+				}
+			}
+			float lo[3][Width], hi[3][Width], loRef[3][Width], hiRef[3][Width];
+			accel::decode_bounds<Width>(node, lo, hi);
+			accel::decode_bounds_scalar<Width>(node, loRef, hiRef);
+			bool same = true;
+			for (int a = 0; a < 3; ++a)
+				for (int i = 0; i < Width; ++i)
+					same = same && lo[a][i] == loRef[a][i] && hi[a][i] == hiRef[a][i];
+			check.expect(same, r);
+		}
+		return check.report();
+	}
+
+	/**
+	* Lower tMax to where the ray enters the box, the way a leaf visitor
+	* records a closer hit
+	*/
+	inline void enter_box(accel::aabb_t const& box, accel::ray_data_t const& rd, float& tMax) {
+		float tNear;
+		if (accel::ray_box(box, rd, tMax, tNear) && tNear < tMax)
+			tMax = tNear;
+	}
+
+	template <typename Accel>
+	bool check_tree(std::string const& name, Accel const& accel, std::vector<accel::aabb_t> const& boxes,
+					std::vector<geom::ray_t> const& rays, std::vector<float> const& linear) {
+		check_t check(name);
+		for (size_t r = 0; r < rays.size(); ++r) {
+			const accel::ray_data_t rd(rays[r]);
+			float tMax = kNoLimit;
+			accel.traverse(rays[r], tMax, [&](uint32_t objectIdx, float& tmax) {
+				enter_box(boxes[objectIdx], rd, tmax);
+			});
+			check.expect(tMax == linear[r], r);
+		}
+		return check.report();
+	}
+
+	/**
+	* The object boxes stand in for the objects: every structure must find
+	* the same nearest box as a scan over all of them
+	*/
+	bool check_trees(random_t& random) {
+		scene_object_list objects;
+		std::vector<accel::aabb_t> boxes;
+		for (int i = 0; i < 3000; ++i) {
+			// mostly small spheres and a few large ones, as in particle dumps
+			const float radius = random.below(50) ? random.uniform(0.02f, 0.3f) : random.uniform(1.f, 3.f);
+			objects.push_back(std::make_shared<primitive::sphere_t>(radius, random.point(8.f)));
+			boxes.push_back(accel::aabb_t());
+			accel::bounds_of(*objects.back(), boxes.back());
+		}
+
+		std::vector<geom::ray_t> rays;
+		std::vector<float> linear;
+		for (int r = 0; r < kRays; ++r) {
+			rays.push_back(random.ray());
+			const accel::ray_data_t rd(rays.back());
+			float tMax = kNoLimit;
+			for (auto const& box: boxes)
+				enter_box(box, rd, tMax);
+			linear.push_back(tMax);
+		}
+
+		bool ok = true;
+		accel::bvh_t bvh, lbvh;
+		accel::build(accel::kBuildSAH, objects, bvh);
+		accel::build(accel::kBuildLBVH, objects, lbvh);
+		ok = check_tree("bvh2", bvh, boxes, rays, linear) && ok;
+		ok = check_tree("lbvh", lbvh, boxes, rays, linear) && ok;
+
+		accel::bvh4_t bvh4;
+		accel::bvh8_t bvh8;
+		accel::collapse(bvh, bvh4);
+		accel::collapse(bvh, bvh8);
+		ok = check_tree("bvh4", bvh4, boxes, rays, linear) && ok;
+		ok = check_tree("bvh8", bvh8, boxes, rays, linear) && ok;
+
+		accel::qbvh8_t qbvh8;
+		accel::compress(bvh8, qbvh8);
+		ok = check_tree("qbvh8", qbvh8, boxes, rays, linear) && ok;
+
+		accel::grid_t grid;
+		accel::build_grid(boxes, grid);
+		ok = check_tree("grid", grid, boxes, rays, linear) && ok;
+		return ok;
+	}
+
+	/**
+	* Distance at which the ray enters the sphere, in double precision.
+	* Negative when it misses, starts inside or only meets it behind its origin.
+	*/
+	double enter_sphere(primitive::sphere_t const& sphere, geom::ray_t const& ray) {
+		double p[3], d[3];
+		for (int a = 0; a < 3; ++a) {
+			p[a] = double(ray.point[a]) - sphere.center[a];
+			d[a] = ray.direction[a];
+		}
+		const double dd = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+		const double pd = p[0] * d[0] + p[1] * d[1] + p[2] * d[2];
+		const double c = p[0] * p[0] + p[1] * p[1] + p[2] * p[2] - double(sphere.radius) * sphere.radius;
+		const double disc = pd * pd - dd * c;
+		if (c <= 0 || disc < 0) return -1;
+		return (-pd - std::sqrt(disc)) / dd;
+	}
+
+	/**
+	* Every sphere kernel against the scalar one, and against an exact scan:
+	* the kernels may report a grazed sphere the ray misses, never miss one.
+	*/
+	bool check_spheres(random_t& random) {
+		scene_t scene;
+		for (int i = 0; i < 1500; ++i) {
+			// cubes in between are never hit by the kernels
+			if (random.below(10))
+				scene.add(std::make_shared<primitive::sphere_t>(random.uniform(0.05f, 0.8f), random.point(8.f)));
+			else
+				scene.add(std::make_shared<primitive::cube_t>(random.uniform(0.2f, 1.5f), random.point(8.f)));
+		}
+		scene_object_list const& objects = scene.objects;
+		accel::compiled_scene_t compiled;
+		compiled.build(scene);
+		accel::sphere_store_t store;
+		store.build(compiled);
+
+		bool ok = true;
+		const char* kernels[] = { "avx512", "avx2" };
+		for (const char* kernel: kernels) {
+			const std::string name = std::string("spheres ") + kernel;
+			if (!accel::use_sphere_kernel(kernel)) {
+				printf("%-24s not supported by this CPU\n", name.c_str());
+				continue;
+			}
+			check_t check(name);
+			std::vector<uint32_t> listed;
+			for (int r = 0; r < kRays; ++r) {
+				const geom::ray_t ray = random.ray();
+				const float tMax = random.tMax();
+				// a leaf of up to 40 objects, or a range of them
+				const bool range = random.below(2);
+				const uint32_t count = 1 + random.below(40);
+				const uint32_t begin = random.below(objects.size() - count + 1);
+				listed.clear();
+				for (uint32_t k = 0; k < count; ++k)
+					listed.push_back(range ? begin + k : random.below(objects.size()));
+
+				float t = -1.f, tScalar = -1.f;
+				const int32_t hit = range ? store.nearestInRange(ray, begin, begin + count, tMax, t)
+										  : store.nearest(ray, listed.data(), count, tMax, t);
+				accel::use_sphere_kernel("scalar");
+				const int32_t hitScalar = range ? store.nearestInRange(ray, begin, begin + count, tMax, tScalar)
+												: store.nearest(ray, listed.data(), count, tMax, tScalar);
+				accel::use_sphere_kernel(kernel);
+				// the kernels round grazing rays differently, the tracer confirms t
+				const bool same = hit == hitScalar && std::abs(t - tScalar) <= 1e-4f * (1.f + tScalar);
+
+				double nearest = -1;
+				for (uint32_t idx: listed) {
+					if (objects[idx]->type != object::kSphere) continue;
+					const double te = enter_sphere(static_cast<primitive::sphere_t const&>(*objects[idx]), ray);
+					if (te >= 0 && te < tMax * (1 - 1e-4) && (nearest < 0 || te < nearest))
+						nearest = te;
+				}
+				const bool covers = nearest < 0 || (hit >= 0 && t <= nearest * (1 + 1e-4) + 1e-4);
+				check.expect(same && covers, r);
+			}
+			ok = check.report() && ok;
+		}
+		accel::use_sphere_kernel("avx512") || accel::use_sphere_kernel("avx2");
+		return ok;
+	}
+
+	/**
+	* The plane kernel may pass planes the ray misses, never one it hits
+	*/
+	bool check_planes(random_t& random) {
+		scene_t scene;
+		for (int i = 0; i < 40; ++i) {
+			// lanes of planes and spheres between them, one lane only partly used
+			if (i % 3)
+				scene.add(std::make_shared<primitive::plane_t>(glm::normalize(random.point(1.f)), random.point(12.f)));
+			else
+				scene.add(std::make_shared<primitive::sphere_t>(1.f, random.point(8.f)));
+		}
+		accel::compiled_scene_t compiled;
+		compiled.build(scene);
+
+		check_t check("planes");
+		std::vector<uint8_t> passed(scene.objects.size());
+		for (int r = 0; r < kRays; ++r) {
+			const geom::ray_t ray = random.ray();
+			const float tMax = random.tMax();
+			passed.assign(passed.size(), 0);
+			compiled.candidatePlanes(ray, tMax, [&](uint32_t objectIdx) { passed[objectIdx] = 1; });
+			bool covers = true;
+			for (uint32_t i = 0; i < scene.objects.size(); ++i) {
+				geom::hit_t hit;
+				if (scene.objects[i]->type == object::kPlane && compiled.intersect(i, ray, tMax, hit))
+					covers = covers && passed[i];
+			}
+			check.expect(covers, r);
+		}
+		return check.report();
+	}
+
+	bool check_convert(random_t& random) {
+		using namespace bray::image;
+		if (!use_convert_kernel("avx2")) {
+			printf("%-24s not supported by this CPU\n", "convert avx2");
+			return true;
+		}
+		check_t check("convert avx2");
+		const output_curve_t curves[] = { output_curve_t(kTransferLinear), output_curve_t(kTransferSRGB),
+										  output_curve_t(kTransferGamma, 1.8f) };
+		std::vector<float> rgba;
+		std::vector<unsigned char> bgr, bgrScalar;
+		for (int r = 0; r < kRays / 10; ++r) {
+			// row lengths around the 8 pixel steps and their scalar tail
+			const size_t count = 1 + random.below(67);
+			rgba.resize(count * 4);
+			for (float& v: rgba)
+				v = random.below(50) ? random.uniform(-0.2f, 1.2f) : std::numeric_limits<float>::quiet_NaN();
+			const float scale = random.below(2) ? 1.f : random.uniform(0.f, 2.f);
+			output_curve_t const& curve = curves[random.below(3)];
+			bgr.assign(count * 3, 0);
+			bgrScalar.assign(count * 3, 0);
+			convert_pixels(rgba.data(), bgr.data(), count, scale, curve);
+			use_convert_kernel("scalar");
+			convert_pixels(rgba.data(), bgrScalar.data(), count, scale, curve);
+			use_convert_kernel("avx2");
+			check.expect(bgr == bgrScalar, r);
+		}
+		return check.report();
+	}
+}
+
+int main() {
+	random_t random;
+	bool ok = true;
+
+	ok = check_boxes<4>(random) && ok;
+	ok = check_boxes<8>(random) && ok;
+	ok = check_decode<8>(random) && ok;
+	ok = check_trees(random) && ok;
+	ok = check_spheres(random) && ok;
+	ok = check_planes(random) && ok;
+	ok = check_convert(random) && ok;
+
+	printf(ok ? "all checks passed\n" : "CHECK FAILED\n");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+#include "compiled_scene.h"
+#include "mesh_accel.h"
+#include <cmath>
+
+namespace donkey {
+
+	namespace accel {
+
+		namespace {
+
+			color::color_desc_t const* color_of(object::scene_object_t const& object) {
+				switch (object.type) {
+					case object::kMesh:
+						return &static_cast<object::trimesh_t const&>(object).material.color;
+					case object::kInstance:
+					case object::kCube:
+					case object::kSphere:
+					case object::kTriangle:
+					case object::kPlane:
+						return &static_cast<primitive::primitive_t const&>(object).material.color;
+					default:;
+				}
+				return nullptr;
+			}
+		}
+
+		void compiled_scene_t::build(scene_t const& scene) {
+			objects.clear();
+			spheres.clear();
+			planes.clear();
+			boxes.clear();
+			triangles.clear();
+			meshes.clear();
+			materials.clear();
+			lights.clear();
+			planeObjects.clear();
+			kinds = 0;
+
+			objects.reserve(scene.objects.size());
+			materials.reserve(scene.objects.size());
+			for (auto const& ptr: scene.objects) {
+				object_t handle = { object::kNumObjectTypes, 0, 0 };
+				color::color_desc_t const* color = ptr ? color_of(*ptr) : nullptr;
+				if (color) {
+					handle.type = ptr->type;
+					handle.material = materials.size();
+					materials.push_back(*color);
+				}
+
+				switch (handle.type) {
+					case object::kSphere: {
+						primitive::sphere_t const& sphere = static_cast<primitive::sphere_t const&>(*ptr);
+						handle.index = spheres.size();
+						spheres.push_back({ sphere.center, sphere.radius });
+						break;
+					}
+
+					case object::kPlane: {
+						primitive::plane_t const& plane = static_cast<primitive::plane_t const&>(*ptr);
+						handle.index = planes.size();
+						planes.push_back({ plane.normal, plane.point });
+						planeObjects.push_back(objects.size());
+						break;
+					}
+
+					case object::kCube: {
+						primitive::cube_t const& cube = static_cast<primitive::cube_t const&>(*ptr);
+						handle.index = boxes.size();
+						boxes.push_back({ cube.lo, cube.hi });
+						break;
+					}
+
+					case object::kTriangle: {
+						primitive::triangle_t const& tri = static_cast<primitive::triangle_t const&>(*ptr);
+						handle.index = triangles.size();
+						triangles.push_back({ tri.edges, tri.normal });
+						break;
+					}
+
+					case object::kMesh:
+					case object::kInstance:
+						handle.index = meshes.size();
+						meshes.push_back(ptr.get());
+						break;
+
+					default:;
+				}
+				kinds |= kind_bit(handle.type);
+				objects.push_back(handle);
+			}
+
+			const size_t padded = (planes.size() + kPlaneLanes - 1) / kPlaneLanes * kPlaneLanes;
+			planeNx.assign(padded, 0.f);
+			planeNy.assign(padded, 0.f);
+			planeNz.assign(padded, 0.f);
+			planeNd.assign(padded, 0.f);
+			for (size_t i = 0; i < planes.size(); ++i) {
+				planeNx[i] = planes[i].normal.x;
+				planeNy[i] = planes[i].normal.y;
+				planeNz[i] = planes[i].normal.z;
+				planeNd[i] = glm::dot(planes[i].normal, planes[i].point);
+			}
+			// padding lanes only see the planes' objects through planeObjects
+			planeObjects.resize(padded, planeObjects.empty() ? 0 : planeObjects.back());
+
+			for (auto const& ptr: scene.lights) {
+				auto light = promote<object::point_light_t<float> >(ptr);
+				if (light)
+					lights.push_back({ light->position, light->color.diffuse, light->intensity });
+			}
+		}
+
+		uint32_t compiled_scene_t::planeMask(uint32_t first, geom::ray_t const& ray, float tMax) const {
+			// on_plane drops rays closer than 1e-5 to parallel, the kernel keeps a margin on
+			// both sides: t is computed from the precomputed n.p, not as on_plane does
+			const float kMinDenom = 0.5e-5f;
+			const float kSlack = 1e-4f;
+			const float limit = tMax * (1.f + kSlack) + kSlack;
+#if defined(__AVX__)
+			const __m256 nx = _mm256_loadu_ps(&planeNx[first]);
+			const __m256 ny = _mm256_loadu_ps(&planeNy[first]);
+			const __m256 nz = _mm256_loadu_ps(&planeNz[first]);
+			const __m256 nd = _mm256_loadu_ps(&planeNd[first]);
+			const __m256 den = _mm256_add_ps(_mm256_add_ps(
+									_mm256_mul_ps(nx, _mm256_set1_ps(ray.direction.x)),
+									_mm256_mul_ps(ny, _mm256_set1_ps(ray.direction.y))),
+									_mm256_mul_ps(nz, _mm256_set1_ps(ray.direction.z)));
+			const __m256 no = _mm256_add_ps(_mm256_add_ps(
+									_mm256_mul_ps(nx, _mm256_set1_ps(ray.point.x)),
+									_mm256_mul_ps(ny, _mm256_set1_ps(ray.point.y))),
+									_mm256_mul_ps(nz, _mm256_set1_ps(ray.point.z)));
+			const __m256 t = _mm256_div_ps(_mm256_sub_ps(nd, no), den);
+			const __m256 absDen = _mm256_andnot_ps(_mm256_set1_ps(-0.f), den);
+			// the slack below zero scales with the distance of the ray origin from the plane
+			const __m256 floor = _mm256_mul_ps(_mm256_set1_ps(-kSlack),
+									_mm256_add_ps(_mm256_set1_ps(1.f), _mm256_andnot_ps(_mm256_set1_ps(-0.f), t)));
+			const __m256 ok = _mm256_and_ps(_mm256_cmp_ps(absDen, _mm256_set1_ps(kMinDenom), _CMP_GE_OQ),
+								_mm256_and_ps(_mm256_cmp_ps(t, floor, _CMP_GE_OQ),
+											  _mm256_cmp_ps(t, _mm256_set1_ps(limit), _CMP_LE_OQ)));
+			return _mm256_movemask_ps(ok);
+#else
+			uint32_t mask = 0;
+			for (uint32_t lane = 0; lane < kPlaneLanes; ++lane) {
+				const uint32_t i = first + lane;
+				const float den = planeNx[i] * ray.direction.x + planeNy[i] * ray.direction.y + planeNz[i] * ray.direction.z;
+				const float no = planeNx[i] * ray.point.x + planeNy[i] * ray.point.y + planeNz[i] * ray.point.z;
+				const float t = (planeNd[i] - no) / den;
+				if (std::fabs(den) >= kMinDenom && t >= -kSlack * (1.f + std::fabs(t)) && t <= limit)
+					mask |= 1u << lane;
+			}
+			return mask;
+#endif
+		}
+	}
+}
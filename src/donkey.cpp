@@ -1,4 +1,5 @@
 #include "donkey.h"
+#include <limits>
 
 namespace donkey {
 
@@ -8,30 +9,26 @@ namespace donkey {
 		cube_t::cube_t(float size, point_t origin): 
 			primitive_t(object::kCube),
 			halfSize(size/2.0f),
-			planes({
-				plane_t {vector_t(0, 1, 0), origin + vector_t(0, 1, 0) * halfSize},
-				plane_t {vector_t(0, -1, 0), origin + vector_t(0, -1, 0) * halfSize},
-				plane_t {vector_t(-1, 0, 0), origin + vector_t(-1, 0, 0) * halfSize},
-				plane_t {vector_t(1, 0, 0), origin + vector_t(1, 0, 0) * halfSize},
-				plane_t {vector_t(0, 0, 1), origin + vector_t(0, 0, 1) * halfSize},
-				plane_t {vector_t(0, 0, -1), origin + vector_t(0, 0, -1) * halfSize}
-			}) {
-
-			// compute bounds
-			const std::vector< std::vector<int> > diffs = { {-1, -1}, {-1, 1}, {1, -1}, {1, 1} };
-			for (int i = 0; i < kNumFaceIds; ++i) {
-				const glm::vec2 tpt = vecBound(face_id(i), planes[i].point);
-				for (auto sc: diffs) {
-					glm::vec2 bound = tpt + glm::vec2(sc[0] * halfSize, sc[1] * halfSize);
-					bounds[i].update({ bound.x, bound.y });
-				}
-			}
+			center(origin),
+			lo(origin - vector_t(std::fabs(halfSize))),
+			hi(origin + vector_t(std::fabs(halfSize))) {}
+
+		vector_t cube_t::faceNormal(face_id id) {
+			static const vector_t normals[kNumFaceIds] = {
+				vector_t(0, 1, 0), vector_t(0, -1, 0),
+				vector_t(-1, 0, 0), vector_t(1, 0, 0),
+				vector_t(0, 0, 1), vector_t(0, 0, -1)
+			};
+			return normals[id];
 		}
 
-		bool cube_t::inFace(face_id id, point_t const& pt) const {
-			glm::vec2 coords = vecBound(id, pt);
-			return (bounds[id].mins[0] <= coords.x && coords.x <= bounds[id].maxs[0])
-				 && (bounds[id].mins[1] <= coords.y && coords.y <= bounds[id].maxs[1]);
+		// the face whose plane is closest to the point, relative to the cube size
+		cube_t::face_id cube_t::faceAt(point_t const& p) const {
+			const vector_t d = p - center;
+			const vector_t a = glm::abs(d);
+			if (a.x >= a.y && a.x >= a.z) return d.x < 0 ? kFaceLeft : kFaceRight;
+			if (a.y >= a.z) return d.y < 0 ? kFaceBottom : kFaceTop;
+			return d.z < 0 ? kFaceBack : kFaceFront;
 		}
 	}
 
@@ -63,62 +60,121 @@ namespace donkey {
 		*/
 		namespace raycast {
 
-			bool on_plane(primitive::plane_t const& plane, geom::ray_t const& ray, point_t& point) {
+			bool on_plane(vector_t const& normal, point_t const& point, geom::ray_t const& ray, float& t) {
 
-				float d = glm::dot(plane.normal, ray.direction);
+				float d = glm::dot(normal, ray.direction);
 
 				// no intersection if the normal and the ray direction are perpendicular
 				if (utils::equal(d, 0.0f))
 					return false;
 
-				float n = glm::dot(plane.normal, plane.point - ray.point);
-				float t = n / d;
+				float n = glm::dot(normal, point - ray.point);
+				t = n / d;
 
-				if (t < 0) return false;
+				return t >= 0;
+			}
 
-				point = ray.point + t * ray.direction;
+			bool on_plane(primitive::plane_t const& plane, geom::ray_t const& ray, float& t) {
+				return on_plane(plane.normal, plane.point, ray, t);
+			}
 
+			bool on_plane(primitive::plane_t const& plane, geom::ray_t const& ray, point_t& point) {
+				float t;
+				if (!on_plane(plane, ray, t)) return false;
+				point = ray.point + t * ray.direction;
 				return true;
 			}
 
 
 			bool on_triangle(primitive::triangle_t const& tri, geom::ray_t const& ray, point_t& point) {
-				
-				bool b = on_plane(tri, ray, point);
+				float t, u, v;
+				if (!on_triangle(tri.edges, ray, t, u, v)) return false;
+				point = ray.point + t * ray.direction;
+				return true;
+			}
 
-				if (b) {
-					point_t bcent = donkey::algo::barycentric(tri, point);
-					if (bcent.x < 0 || bcent.y < 0 || bcent.z < 0) return false;
-				}
+			bool on_triangle(point_t const& v0, point_t const& v1, point_t const& v2, geom::ray_t const& ray,
+							 float& t, float& u, float& v) {
+				return on_triangle(geom::triangle_edges_t(v0, v1, v2), ray, t, u, v);
+			}
+
+			/**
+			* Moller-Trumbore test against a triangle with precomputed edges.
+			* Returns the ray parameter and the barycentrics of v1 and v2.
+			*/
+			bool on_triangle(geom::triangle_edges_t const& tri, geom::ray_t const& ray,
+							 float& t, float& u, float& v) {
+				vector_t p = glm::cross(ray.direction, tri.e2);
+				float det = glm::dot(tri.e1, p);
+
+				// ray parallel to the triangle plane. No epsilon here: det scales
+				// with the triangle area and small triangles are common in meshes
+				if (det == 0.0f) return false;
+
+				float invDet = 1.0f / det;
+				vector_t s = ray.point - tri.v0;
+				u = glm::dot(s, p) * invDet;
+				if (u < 0.0f || u > 1.0f) return false;
+
+				vector_t q = glm::cross(s, tri.e1);
+				v = glm::dot(ray.direction, q) * invDet;
+				if (v < 0.0f || u + v > 1.0f) return false;
+
+				t = glm::dot(tri.e2, q) * invDet;
+				return t > 0.0f;
+			}
 
+			bool on_box(point_t const& lo, point_t const& hi, geom::ray_t const& ray,
+						float& tNear, float& tFar, primitive::cube_t::face_id& faceid) {
+				// faces on the low and the high side of each axis
+				static const primitive::cube_t::face_id faces[3][2] = {
+					{ primitive::cube_t::kFaceLeft, primitive::cube_t::kFaceRight },
+					{ primitive::cube_t::kFaceBottom, primitive::cube_t::kFaceTop },
+					{ primitive::cube_t::kFaceBack, primitive::cube_t::kFaceFront }
+				};
+
+				const vector_t inv = 1.0f / ray.direction;
+				const vector_t t0 = (lo - ray.point) * inv;
+				const vector_t t1 = (hi - ray.point) * inv;
+				const vector_t tmin = glm::min(t0, t1);
+				const vector_t tmax = glm::max(t0, t1);
+				tNear = std::max(std::max(tmin.x, tmin.y), tmin.z);
+				tFar = std::min(std::min(tmax.x, tmax.y), tmax.z);
+				if (!(tNear <= tFar) || tFar < 0.f) return false;
+
+				// the slab entered last holds the entry face, the one left first the exit face
+				if (tNear >= 0.f) {
+					const int a = (tmin.x == tNear) ? 0 : ((tmin.y == tNear) ? 1 : 2);
+					faceid = faces[a][ray.direction[a] < 0.f];
+				} else {
+					const int a = (tmax.x == tFar) ? 0 : ((tmax.y == tFar) ? 1 : 2);
+					faceid = faces[a][ray.direction[a] >= 0.f];
+				}
 				return true;
 			}
 
+			bool on_cube(primitive::cube_t const& cube, geom::ray_t const& ray,
+						 float& tNear, float& tFar, primitive::cube_t::face_id& faceid) {
+				return on_box(cube.lo, cube.hi, ray, tNear, tFar, faceid);
+			}
+
 			bool on_cube(
 						primitive::cube_t const& cube, 
 						geom::ray_t const& ray, 
 						point_t& point, 
 						primitive::cube_t::face_id& faceid
 			) {
-				bool b = false;
-				for (int i = 0; i < primitive::cube_t::kNumFaceIds; ++i) {
-					primitive::cube_t::face_id fid = primitive::cube_t::face_id(i);
-					point_t p;
-					if (on_plane(cube.planes[i], ray, p) && cube.inFace(fid, p)) {
-						point = p;
-						faceid = fid;
-						b = true;
-						break;
-					}
-				}
-				return b;
+				float tNear, tFar;
+				if (!on_cube(cube, ray, tNear, tFar, faceid)) return false;
+				point = ray.point + (tNear >= 0.f ? tNear : tFar) * ray.direction;
+				return true;
 			}
 
-			bool on_sphere(primitive::sphere_t const& sphere, geom::ray_t const& ray, point_t& p1, point_t& p2) {
+			bool on_sphere(point_t const& center, float radius, geom::ray_t const& ray, float& t0, float& t1) {
 				float dd = glm::dot(ray.direction, ray.direction);
-				donkey::vector_t po = (ray.point - sphere.center);
+				donkey::vector_t po = (ray.point - center);
 				float ec = 2.0f * glm::dot(ray.direction, po);
-				float r2 = sphere.radius  * sphere.radius;
+				float r2 = radius  * radius;
 				float pod = glm::dot(po, po);
 				float dt = ec*ec - 4*dd*(pod - r2);
 
@@ -127,10 +183,19 @@ namespace donkey {
 
 				dt = std::sqrt(dt);
 				dd = 1/(2 * dd);
-				float t0 = dd * (-ec + dt);
-				float t1 = dd * (-ec - dt);
+				t0 = dd * (-ec + dt);
+				t1 = dd * (-ec - dt);
+
+				return t0 >= 0 && t1 >= 0;
+			}
 
-				if (t0 < 0 || t1 < 0) return false;
+			bool on_sphere(primitive::sphere_t const& sphere, geom::ray_t const& ray, float& t0, float& t1) {
+				return on_sphere(sphere.center, sphere.radius, ray, t0, t1);
+			}
+
+			bool on_sphere(primitive::sphere_t const& sphere, geom::ray_t const& ray, point_t& p1, point_t& p2) {
+				float t0, t1;
+				if (!on_sphere(sphere, ray, t0, t1)) return false;
 
 				p1 = ray.point + t0 * ray.direction;
 				p2 = ray.point + t1 * ray.direction;
@@ -138,42 +203,81 @@ namespace donkey {
 				return true; 
 			}
 
-			bool on_object(scene_object_ptr object, geom::ray_t const& ray, points_v& points) {
-				if (!(object)) return false;
-
-				bool b = false;
-				switch (object->type) {
+			bool on_object(object::scene_object_t const& object, geom::ray_t const& ray, float tMax, geom::hit_t& hit) {
+				float t = tMax;
+				float u = 0.f, v = 0.f;
+				uint32_t primitive = 0;
+				switch (object.type) {
 					case object::kPlane: {
-						point_t pt;
-						if (true == 
-							(b = on_plane(
-									*(std::dynamic_pointer_cast<primitive::plane_t>(object)), 
-									ray, 
-									pt))
-							) {
-							points.push_back(pt);
-						}
+						if (!on_plane(static_cast<primitive::plane_t const&>(object), ray, t)) return false;
 						break;
 					}
 
 					case object::kSphere: {
-						point_t p1, p2;
-						if (true == 
-							(b = on_sphere(
-								*(std::dynamic_pointer_cast<primitive::sphere_t>(object)), 
-								ray, 
-								p1, 
-								p2))
-							) {
-							points.push_back(p1);
-							points.push_back(p2);
-						} 
+						// both roots are ahead of the ray, t1 is the nearer one
+						float t0;
+						if (!on_sphere(static_cast<primitive::sphere_t const&>(object), ray, t0, t)) return false;
+						break;
+					}
+
+					case object::kTriangle: {
+						primitive::triangle_t const& tri = static_cast<primitive::triangle_t const&>(object);
+						if (!on_triangle(tri.edges, ray, t, u, v)) return false;
 						break;
 					}
 
-					default:;
+					case object::kCube: {
+						float tFar;
+						primitive::cube_t::face_id faceid;
+						if (!on_cube(static_cast<primitive::cube_t const&>(object), ray, t, tFar, faceid)) return false;
+						if (t < 0.f) t = tFar;
+						primitive = faceid;
+						break;
+					}
+
+					case object::kMesh: {
+						// every face against the running nearest hit. Scenes with
+						// meshes are searched through the mesh trees instead
+						object::trimesh_t const& mesh = static_cast<object::trimesh_t const&>(object);
+						auto const& vertices = mesh.geometry.vertices;
+						auto const& faces = mesh.geometry.faces;
+						bool found = false;
+						for (uint32_t f = 0; f < faces.size(); ++f) {
+							float tf, uf, vf;
+							if (on_triangle(vertices[faces[f].index[0]].position, vertices[faces[f].index[1]].position,
+											vertices[faces[f].index[2]].position, ray, tf, uf, vf) && tf < t) {
+								t = tf;
+								u = uf;
+								v = vf;
+								primitive = f;
+								found = true;
+							}
+						}
+						if (!found) return false;
+						break;
+					}
+
+					case object::kInstance: {
+						// the shared mesh against the ray in object space, the direction
+						// is not normalized so that t stays the same as in world space
+						primitive::instance_t const& instance = static_cast<primitive::instance_t const&>(object);
+						if (!instance.mesh) return false;
+						geom::ray_t local = ray;
+						local.point = point_t(instance.inverse * glm::vec4(ray.point, 1.0f));
+						local.direction = vector_t(instance.inverse * glm::vec4(ray.direction, 0.0f));
+						return on_object(*instance.mesh, local, tMax, hit);
+					}
+
+					default:
+						return false;
 				}
-				return b;
+
+				if (!(t < tMax)) return false;
+				hit.t = t;
+				hit.primitive = primitive;
+				hit.u = u;
+				hit.v = v;
+				return true;
 			}
 
 		}
@@ -0,0 +1,142 @@
+#include "framebuffer.h"
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NEWBRAY_X86 1
+#endif
+
+namespace bray {
+
+	namespace image {
+
+		namespace {
+
+			typedef void (*convert_kernel_t)(float const* rgba, unsigned char* bgr, size_t count, float scale,
+											 output_curve_t const& curve);
+
+			inline int32_t quantize(float value, float scale, output_curve_t const& curve) {
+				const float v = std::min(std::max(0.f, value * scale), 1.f);
+				if (curve.transfer == kTransferLinear)
+					return static_cast<int32_t>(v * 255);
+				return curve.table[static_cast<int32_t>(v * output_curve_t::kCurveSteps + 0.5f)];
+			}
+
+			void convert_scalar(float const* rgba, unsigned char* bgr, size_t count, float scale,
+								output_curve_t const& curve) {
+				for (size_t i = 0; i < count; ++i, rgba += 4, bgr += 3) {
+					bgr[0] = static_cast<unsigned char>(quantize(rgba[2], scale, curve));
+					bgr[1] = static_cast<unsigned char>(quantize(rgba[1], scale, curve));
+					bgr[2] = static_cast<unsigned char>(quantize(rgba[0], scale, curve));
+				}
+			}
+
+#if defined(NEWBRAY_X86)
+			/**
+			* Two RGBA pixels to 8 bit values in 32 bit lanes
+			*/
+			__attribute__((target("avx2")))
+			inline __m256i quantize_avx2(float const* rgba, __m256 scale, output_curve_t const& curve) {
+				__m256 v = _mm256_mul_ps(_mm256_loadu_ps(rgba), scale);
+				// max first so that NaN becomes 0
+				v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(1.f));
+				if (curve.transfer == kTransferLinear)
+					return _mm256_cvttps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(255.f)));
+				const __m256i step = _mm256_cvttps_epi32(_mm256_add_ps(
+					_mm256_mul_ps(v, _mm256_set1_ps(float(output_curve_t::kCurveSteps))), _mm256_set1_ps(0.5f)));
+				return _mm256_i32gather_epi32(curve.table.data(), step, 4);
+			}
+
+			/**
+			* Eight pixels per step: pack their RGBA values to bytes, put the pixels
+			* back in order and shuffle each lane of four to BGR. The two 16 byte
+			* stores write 4 bytes past the 24 of the step, so the loop stops 2
+			* pixels early and leaves the tail to the scalar code.
+			*/
+			__attribute__((target("avx2")))
+			void convert_avx2(float const* rgba, unsigned char* bgr, size_t count, float scale,
+							  output_curve_t const& curve) {
+				const __m256 scaleV = _mm256_set1_ps(scale);
+				const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+				const __m256i toBGR = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+													   2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+				size_t i = 0;
+				for (; i + 10 <= count; i += 8, rgba += 32, bgr += 24) {
+					const __m256i p01 = quantize_avx2(rgba, scaleV, curve);
+					const __m256i p23 = quantize_avx2(rgba + 8, scaleV, curve);
+					const __m256i p45 = quantize_avx2(rgba + 16, scaleV, curve);
+					const __m256i p67 = quantize_avx2(rgba + 24, scaleV, curve);
+					// per lane: pixels 0 2 4 6 in the low one, 1 3 5 7 in the high one
+					const __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(p01, p23), _mm256_packs_epi32(p45, p67));
+					const __m256i pixels = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(bytes, order), toBGR);
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(bgr), _mm256_castsi256_si128(pixels));
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(bgr + 12), _mm256_extracti128_si256(pixels, 1));
+				}
+				convert_scalar(rgba, bgr, count - i, scale, curve);
+			}
+#endif
+
+			struct kernels_t {
+				convert_kernel_t 	convert;
+				const char* 		name;
+
+				kernels_t(): convert(convert_scalar), name("scalar") {
+					pick("avx2");
+				}
+
+				bool pick(std::string const& kernel) {
+					if (kernel == "scalar") {
+						convert = convert_scalar;
+						name = "scalar";
+						return true;
+					}
+#if defined(NEWBRAY_X86)
+					__builtin_cpu_init();
+					if (kernel == "avx2" && __builtin_cpu_supports("avx2")) {
+						convert = convert_avx2;
+						name = "avx2";
+						return true;
+					}
+#endif
+					return false;
+				}
+			};
+
+			kernels_t& kernels() {
+				static kernels_t picked;
+				return picked;
+			}
+
+			float srgb(float v) {
+				return v <= 0.0031308f ? 12.92f * v : 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+			}
+		}
+
+		output_curve_t::output_curve_t(transfer_type transferType, float gammaValue):
+			transfer(transferType), gamma(gammaValue > 0.f ? gammaValue : 2.2f) {
+			if (transfer == kTransferLinear)
+				return;
+			table.resize(kCurveSteps + 1);
+			for (int32_t step = 0; step <= kCurveSteps; ++step) {
+				const float v = float(step) / kCurveSteps;
+				const float out = (transfer == kTransferSRGB) ? srgb(v) : std::pow(v, 1.f / gamma);
+				table[step] = std::min(255, static_cast<int32_t>(out * 255 + 0.5f));
+			}
+		}
+
+		void convert_pixels(float const* rgba, unsigned char* bgr, size_t count, float scale,
+							output_curve_t const& curve) {
+			kernels().convert(rgba, bgr, count, scale, curve);
+		}
+
+		const char* convert_kernel_name() {
+			return kernels().name;
+		}
+
+		bool use_convert_kernel(std::string const& name) {
+			return kernels().pick(name);
+		}
+	}
+}
@@ -0,0 +1,121 @@
+#include "grid.h"
+#include <algorithm>
+
+namespace donkey {
+
+	namespace accel {
+
+		namespace {
+
+			glm::ivec3 resolution(aabb_t const& box, float cells, int maxResolution) {
+				vector_t extent = box.extent();
+				const float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+				if (maxExtent <= 0.f) return glm::ivec3(1);
+
+				// flat boxes still get one layer of cells along their thin axes
+				extent = glm::max(extent, vector_t(maxExtent * 1e-3f));
+				const float perUnit = std::cbrt(cells / (extent.x * extent.y * extent.z));
+
+				glm::ivec3 res;
+				for (int a = 0; a < 3; ++a)
+					res[a] = std::max(1, std::min(maxResolution, (int)(extent[a] * perUnit)));
+				return res;
+			}
+
+			void init_level(grid_level_t& level, aabb_t const& box, glm::ivec3 const& res) {
+				level.bounds = box;
+				level.res = res;
+				level.cellSize = box.extent() / vector_t(res);
+				for (int a = 0; a < 3; ++a)
+					level.invCellSize[a] = level.cellSize[a] > 0.f ? 1.f / level.cellSize[a] : 0.f;
+			}
+
+			template <typename Func>
+			inline void for_cells(grid_level_t const& level, aabb_t const& box, Func fn) {
+				glm::ivec3 lo = level.cellOf(box.lo), hi = level.cellOf(box.hi);
+				for (int z = lo.z; z <= hi.z; ++z)
+					for (int y = lo.y; y <= hi.y; ++y)
+						for (int x = lo.x; x <= hi.x; ++x)
+							fn(level.cellIndex(glm::ivec3(x, y, z)));
+			}
+
+			/**
+			* Counting sort of the objects into the cells they overlap: one pass to
+			* count, a prefix sum, and one pass to fill
+			*/
+			void fill_level(grid_level_t& level, std::vector<uint32_t> const& objects,
+							std::vector<aabb_t> const& bounds) {
+				const size_t numCells = (size_t)level.res.x * level.res.y * level.res.z;
+				level.cellStart.assign(numCells + 1, 0);
+
+				for (auto idx: objects)
+					for_cells(level, bounds[idx], [&](uint32_t cell) { level.cellStart[cell + 1]++; });
+
+				for (size_t c = 0; c < numCells; ++c)
+					level.cellStart[c + 1] += level.cellStart[c];
+
+				std::vector<uint32_t> cursor(level.cellStart.begin(), level.cellStart.end() - 1);
+				level.refs.resize(level.cellStart[numCells]);
+				for (auto idx: objects)
+					for_cells(level, bounds[idx], [&](uint32_t cell) { level.refs[cursor[cell]++] = idx; });
+			}
+		}
+
+		void build_grid(std::vector<aabb_t> const& bounds, grid_t& grid, grid_params_t const& params) {
+			grid.top = grid_level_t();
+			grid.subgridOf.clear();
+			grid.subgrids.clear();
+			grid.unbounded.clear();
+
+			std::vector<uint32_t> objects;
+			aabb_t sceneBox;
+			for (uint32_t i = 0; i < bounds.size(); ++i) {
+				if (bounds[i].valid()) {
+					objects.push_back(i);
+					sceneBox.grow(bounds[i]);
+				} else {
+					grid.unbounded.push_back(i);
+				}
+			}
+			if (objects.empty()) return;
+
+			init_level(grid.top, sceneBox, resolution(sceneBox, params.topDensity * objects.size(), params.maxResolution));
+			fill_level(grid.top, objects, bounds);
+
+			// second level for the dense cells
+			const size_t numCells = grid.top.cellStart.size() - 1;
+			grid.subgridOf.assign(numCells, -1);
+			std::vector<uint32_t> cellObjects;
+			for (size_t c = 0; c < numCells; ++c) {
+				const uint32_t count = grid.top.cellStart[c + 1] - grid.top.cellStart[c];
+				if (count <= (uint32_t)params.subdivideCount) continue;
+
+				glm::ivec3 cell(c % grid.top.res.x, (c / grid.top.res.x) % grid.top.res.y, c / (grid.top.res.x * grid.top.res.y));
+				point_t lo = grid.top.bounds.lo + vector_t(cell) * grid.top.cellSize;
+				aabb_t cellBox(lo, lo + grid.top.cellSize);
+
+				cellObjects.assign(grid.top.refs.begin() + grid.top.cellStart[c], grid.top.refs.begin() + grid.top.cellStart[c + 1]);
+				grid_level_t sub;
+				init_level(sub, cellBox, resolution(cellBox, params.subDensity * count, params.maxResolution));
+				fill_level(sub, cellObjects, bounds);
+
+				grid.subgridOf[c] = grid.subgrids.size();
+				grid.subgrids.push_back(sub);
+			}
+
+			// subdivided cells keep no references of their own
+			if (!grid.subgrids.empty()) {
+				std::vector<uint32_t> refs;
+				refs.reserve(grid.top.refs.size());
+				std::vector<uint32_t> starts(numCells + 1, 0);
+				for (size_t c = 0; c < numCells; ++c) {
+					if (grid.subgridOf[c] < 0)
+						refs.insert(refs.end(), grid.top.refs.begin() + grid.top.cellStart[c], grid.top.refs.begin() + grid.top.cellStart[c + 1]);
+					starts[c + 1] = refs.size();
+				}
+				grid.top.refs.swap(refs);
+				grid.top.cellStart.swap(starts);
+			}
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,286 @@
+#include "accel.h"
+#include "parallel.h"
+#include <algorithm>
+#include <atomic>
+
+namespace donkey {
+
+	namespace accel {
+
+		namespace {
+
+			const uint32_t kLeafFlag = 0x80000000u;
+
+			inline int clz64(uint64_t x) { return x ? __builtin_clzll(x) : 64; }
+			inline int clz32(uint32_t x) { return x ? __builtin_clz(x) : 32; }
+
+			/**
+			* Stable LSD radix sort of (key, value) pairs, 8 bits per pass.
+			* Every pass histograms and scatters its own chunk on each thread.
+			*/
+			void radix_sort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int keyBits, int numThreads) {
+				const size_t n = keys.size();
+				std::vector<uint64_t> keysTmp(n);
+				std::vector<uint32_t> valuesTmp(n);
+				std::vector< std::vector<size_t> > histograms(numThreads, std::vector<size_t>(256));
+
+				for (int shift = 0; shift < keyBits; shift += 8) {
+					for (auto& hist: histograms)
+						std::fill(hist.begin(), hist.end(), 0);
+
+					parallel::chunks(n, numThreads, [&](size_t b, size_t e, int t) {
+						std::vector<size_t>& hist = histograms[t];
+						for (size_t i = b; i < e; ++i)
+							hist[(keys[i] >> shift) & 0xff]++;
+					});
+
+					// exclusive scan in digit-major, thread-minor order keeps the sort stable
+					size_t sum = 0;
+					for (int d = 0; d < 256; ++d) {
+						for (int t = 0; t < numThreads; ++t) {
+							size_t c = histograms[t][d];
+							histograms[t][d] = sum;
+							sum += c;
+						}
+					}
+
+					parallel::chunks(n, numThreads, [&](size_t b, size_t e, int t) {
+						std::vector<size_t>& offsets = histograms[t];
+						for (size_t i = b; i < e; ++i) {
+							size_t dst = offsets[(keys[i] >> shift) & 0xff]++;
+							keysTmp[dst] = keys[i];
+							valuesTmp[dst] = values[i];
+						}
+					});
+
+					keys.swap(keysTmp);
+					values.swap(valuesTmp);
+				}
+			}
+
+			struct lbvh_node_t {
+				uint32_t 	left;			// child index, kLeafFlag marks a leaf
+				uint32_t 	right;
+				uint32_t 	first;			// range of sorted leaves under the node
+				uint32_t 	last;
+				uint32_t 	emitted;		// nodes written for this subtree in bvh_t
+				aabb_t 		bounds;
+			};
+
+			struct lbvh_builder_t {
+				std::vector<uint64_t> const& 	codes;
+				std::vector<aabb_t> const& 		leafBounds;
+				std::vector<lbvh_node_t> 		internal;
+				std::vector<uint32_t> 			parents;	// internal first, then leaves
+				std::vector< std::atomic<int> > visits;
+				uint32_t 						maxLeafSize;
+				const int 						n;
+
+				lbvh_builder_t(std::vector<uint64_t> const& sortedCodes,
+							   std::vector<aabb_t> const& sortedBounds,
+							   uint32_t leafSize):
+					codes(sortedCodes), leafBounds(sortedBounds),
+					internal(sortedCodes.size() - 1),
+					parents(2 * sortedCodes.size() - 1),
+					visits(sortedCodes.size() - 1),
+					maxLeafSize(leafSize),
+					n(sortedCodes.size()) {}
+
+				// length of the common prefix of two codes, ties broken by index
+				inline int delta(int i, int j) const {
+					if (j < 0 || j >= n) return -1;
+					if (codes[i] == codes[j]) return 64 + clz32(uint32_t(i ^ j));
+					return clz64(codes[i] ^ codes[j]);
+				}
+
+				void buildInternal(int i) {
+					const int d = (delta(i, i + 1) - delta(i, i - 1)) >= 0 ? 1 : -1;
+					const int dmin = delta(i, i - d);
+
+					int lmax = 2;
+					while (delta(i, i + lmax * d) > dmin) lmax *= 2;
+
+					int l = 0;
+					for (int t = lmax / 2; t >= 1; t /= 2) {
+						if (delta(i, i + (l + t) * d) > dmin) l += t;
+					}
+					const int j = i + l * d;
+					const int dnode = delta(i, j);
+
+					int s = 0, t = l;
+					do {
+						t = (t + 1) / 2;
+						if (delta(i, i + (s + t) * d) > dnode) s += t;
+					} while (t > 1);
+					const int gamma = i + s * d + std::min(d, 0);
+
+					lbvh_node_t& node = internal[i];
+					node.first = std::min(i, j);
+					node.last = std::max(i, j);
+					node.left = (int(node.first) == gamma) ? (gamma | kLeafFlag) : gamma;
+					node.right = (int(node.last) == gamma + 1) ? ((gamma + 1) | kLeafFlag) : gamma + 1;
+
+					parents[parentSlot(node.left)] = i;
+					parents[parentSlot(node.right)] = i;
+				}
+
+				inline size_t parentSlot(uint32_t child) const {
+					return (child & kLeafFlag) ? (n - 1) + (child & ~kLeafFlag) : child;
+				}
+
+				inline aabb_t const& childBounds(uint32_t child) const {
+					return (child & kLeafFlag) ? leafBounds[child & ~kLeafFlag] : internal[child].bounds;
+				}
+
+				inline uint32_t childEmitted(uint32_t child) const {
+					return (child & kLeafFlag) ? 1 : internal[child].emitted;
+				}
+
+				inline bool collapsed(lbvh_node_t const& node) const {
+					return node.last - node.first + 1 <= maxLeafSize;
+				}
+
+				/**
+				* Walk from a leaf towards the root. The second thread to arrive at a
+				* node finishes it, so every node is completed after both children.
+				*/
+				void refitFromLeaf(int leaf) {
+					uint32_t node = parents[(n - 1) + leaf];
+					while (true) {
+						if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0)
+							return;
+						lbvh_node_t& in = internal[node];
+						in.bounds = childBounds(in.left);
+						in.bounds.grow(childBounds(in.right));
+						in.emitted = collapsed(in) ? 1 : 1 + childEmitted(in.left) + childEmitted(in.right);
+						if (node == 0) return;
+						node = parents[node];
+					}
+				}
+
+				/**
+				* Write the subtree of an internal node depth first, starting at pos
+				*/
+				void emit(uint32_t child, uint32_t pos, std::vector<bvh_node_t>& out) const {
+					while (true) {
+						bvh_node_t& dst = out[pos];
+						if (child & kLeafFlag) {
+							dst.bounds = leafBounds[child & ~kLeafFlag];
+							dst.offset = child & ~kLeafFlag;
+							dst.count = 1;
+							return;
+						}
+						lbvh_node_t const& in = internal[child];
+						dst.bounds = in.bounds;
+						if (collapsed(in)) {
+							dst.offset = in.first;
+							dst.count = in.last - in.first + 1;
+							return;
+						}
+						dst.count = 0;
+						dst.offset = pos + 1 + childEmitted(in.left);
+						emit(in.right, dst.offset, out);
+						child = in.left;
+						pos = pos + 1;
+					}
+				}
+			};
+		}
+
+		void build_lbvh(std::vector<aabb_t> const& bounds, bvh_t& bvh, build_params_t const& params) {
+			bvh.nodes.clear();
+			bvh.indices.clear();
+			bvh.unbounded.clear();
+
+			const int numThreads = params.numThreads > 0 ? params.numThreads : parallel::hardware_threads();
+
+			std::vector<uint32_t> refs;
+			refs.reserve(bounds.size());
+			aabb_t centroids;
+			for (uint32_t i = 0; i < bounds.size(); ++i) {
+				if (bounds[i].valid()) {
+					refs.push_back(i);
+					centroids.grow(bounds[i].centroid());
+				} else {
+					bvh.unbounded.push_back(i);
+				}
+			}
+
+			const size_t n = refs.size();
+			if (n == 0) return;
+
+			const int bits = params.mortonBits ? params.mortonBits : (n >= (1u << 16) ? 63 : 30);
+			const int bitsPerAxis = bits >= 63 ? 21 : 10;
+			const vector_t extent = centroids.extent();
+			const vector_t invExtent(
+				extent.x > 0 ? 1.f / extent.x : 0.f,
+				extent.y > 0 ? 1.f / extent.y : 0.f,
+				extent.z > 0 ? 1.f / extent.z : 0.f);
+
+			std::vector<uint64_t> codes(n);
+			parallel::chunks(n, numThreads, [&](size_t b, size_t e, int) {
+				for (size_t i = b; i < e; ++i)
+					codes[i] = morton_code((bounds[refs[i]].centroid() - centroids.lo) * invExtent, bitsPerAxis);
+			});
+
+			radix_sort(codes, refs, 3 * bitsPerAxis, numThreads);
+
+			bvh.indices = refs;
+			std::vector<aabb_t> sortedBounds(n);
+			parallel::chunks(n, numThreads, [&](size_t b, size_t e, int) {
+				for (size_t i = b; i < e; ++i)
+					sortedBounds[i] = bounds[refs[i]];
+			});
+
+			if (n == 1) {
+				bvh_node_t leaf;
+				leaf.bounds = sortedBounds[0];
+				leaf.offset = 0;
+				leaf.count = 1;
+				bvh.nodes.push_back(leaf);
+				return;
+			}
+
+			lbvh_builder_t builder(codes, sortedBounds, std::max(1, params.maxLeafSize));
+
+			parallel::chunks(n - 1, numThreads, [&](size_t b, size_t e, int) {
+				for (size_t i = b; i < e; ++i) {
+					builder.buildInternal(i);
+					builder.visits[i].store(0, std::memory_order_relaxed);
+				}
+			});
+
+			parallel::chunks(n, numThreads, [&](size_t b, size_t e, int) {
+				for (size_t i = b; i < e; ++i)
+					builder.refitFromLeaf(i);
+			});
+
+			bvh.nodes.resize(builder.internal[0].emitted);
+
+			// expand the top of the tree serially until there is enough work for every thread
+			struct task_t { uint32_t node; uint32_t pos; };
+			std::vector<task_t> tasks(1, task_t{ 0, 0 });
+			const size_t wantTasks = 8 * numThreads;
+			for (size_t k = 0; k < tasks.size() && tasks.size() < wantTasks; ) {
+				task_t task = tasks[k];
+				if ((task.node & kLeafFlag) || builder.collapsed(builder.internal[task.node])) {
+					++k;
+					continue;
+				}
+				lbvh_node_t const& in = builder.internal[task.node];
+				bvh_node_t& dst = bvh.nodes[task.pos];
+				dst.bounds = in.bounds;
+				dst.count = 0;
+				dst.offset = task.pos + 1 + builder.childEmitted(in.left);
+				tasks[k] = task_t{ in.left, task.pos + 1 };
+				tasks.push_back(task_t{ in.right, dst.offset });
+			}
+
+			std::atomic<size_t> next(0);
+			parallel::run(std::min<int>(numThreads, tasks.size()), [&](int) {
+				for (size_t k = next++; k < tasks.size(); k = next++)
+					builder.emit(tasks[k].node, tasks[k].pos, bvh.nodes);
+			});
+		}
+	}
+}
\ No newline at end of file
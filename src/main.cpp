@@ -1,6 +1,7 @@
 #include "donkey.h"
 #include "newbray.h"
 #include "grass.h"
+#include <cstdlib>
 #include <memory>
 /*
 bray::newbray_params_t params = {
@@ -37,6 +38,9 @@ int main(int argc, char* argv[]) {
 
 	std::string inputFile;
 	std::string outputFile;
+	int numThreads = -1;
+	float timeBudget = -1.f;
+	int maxSamples = -1;
 
 	for (int i = 1; i < argc; ++i) {
 		std::string arg = argv[i];
@@ -44,15 +48,27 @@ int main(int argc, char* argv[]) {
 			inputFile = argv[i+1];
 		} else if (arg == "-o" && (i+1) < argc) {
 			outputFile = argv[i+1] + std::string(".jpg");
+		} else if (arg == "-t" && (i+1) < argc) {
+			numThreads = std::max(atoi(argv[i+1]), 0);
+		} else if (arg == "-b" && (i+1) < argc) {
+			timeBudget = std::max(atof(argv[i+1]), 0.0);
+		} else if (arg == "-s" && (i+1) < argc) {
+			maxSamples = std::max(atoi(argv[i+1]), 0);
 		}
 	}
 
 	if (inputFile.empty()) {
-		printf("Usage: %s -i inputFile [-o outputFile]\n", argv[0]);
+		printf("Usage: %s -i inputFile [-o outputFile] [-t threads] [-b seconds] [-s samples]\n", argv[0]);
 		return -1;
 	}
 
 	grass::scene_file_t data(inputFile);
+	if (numThreads >= 0)
+		data.params.numThreads = numThreads;
+	if (timeBudget >= 0.f)
+		data.params.timeBudget = timeBudget;
+	if (maxSamples >= 0)
+		data.params.maxSamples = maxSamples;
 
 
 	bray::image::image_t image(data.params.xRes, data.params.yRes);
@@ -0,0 +1,198 @@
+#include "mesh_accel.h"
+#include "parallel.h"
+#include <map>
+
+namespace donkey {
+
+	namespace accel {
+
+		object::trimesh_t const* mesh_of(object::scene_object_t const& object) {
+			switch (object.type) {
+				case object::kInstance:
+					return static_cast<primitive::instance_t const&>(object).mesh.get();
+				case object::kMesh:
+					return dynamic_cast<object::trimesh_t const*>(&object);
+				default:;
+			}
+			return nullptr;
+		}
+
+		namespace {
+
+			inline glm::mat4 const* transform_of(object::scene_object_t const& object) {
+				return object.type == object::kInstance ?
+					&static_cast<primitive::instance_t const&>(object).transform : nullptr;
+			}
+
+			inline glm::mat4 const* inverse_of(object::scene_object_t const& object) {
+				return object.type == object::kInstance ?
+					&static_cast<primitive::instance_t const&>(object).inverse : nullptr;
+			}
+
+			inline void face_vertices(object::trimesh_t const& mesh, uint32_t face,
+									  point_t& v0, point_t& v1, point_t& v2) {
+				auto const& f = mesh.geometry.faces[face];
+				v0 = mesh.geometry.vertices[f.index[0]].position;
+				v1 = mesh.geometry.vertices[f.index[1]].position;
+				v2 = mesh.geometry.vertices[f.index[2]].position;
+			}
+		}
+
+		void prepare_triangles(blas_t& blas) {
+			auto const& faces = blas.mesh->geometry.faces;
+			blas.triangles.resize(faces.size());
+			for (size_t f = 0; f < faces.size(); ++f) {
+				point_t v0, v1, v2;
+				face_vertices(*blas.mesh, f, v0, v1, v2);
+				blas.triangles[f] = geom::triangle_edges_t(v0, v1, v2);
+			}
+		}
+
+		bool instances_t::matches(scene_object_list const& objects) const {
+			if (objects.size() != blasOf.size()) return false;
+			for (size_t i = 0; i < objects.size(); ++i) {
+				object::trimesh_t const* mesh = objects[i] ? mesh_of(*objects[i]) : nullptr;
+				blas_t const* blas = blasFor(i);
+				if (mesh != (blas ? blas->mesh : nullptr)) return false;
+			}
+			return true;
+		}
+
+		bool instances_t::bounds(object::scene_object_t const& object, uint32_t objectIdx, aabb_t& box) const {
+			blas_t const* blas = blasFor(objectIdx);
+			if (!blas || blas->bvh.nodes.empty()) return false;
+
+			aabb_t const& local = blas->bvh.nodes[0].bounds;
+			glm::mat4 const* transform = transform_of(object);
+			if (!transform) {
+				box = local;
+				return true;
+			}
+
+			box = aabb_t();
+			for (int c = 0; c < 8; ++c) {
+				glm::vec4 corner(
+					(c & 1) ? local.hi.x : local.lo.x,
+					(c & 2) ? local.hi.y : local.lo.y,
+					(c & 4) ? local.hi.z : local.lo.z,
+					1.0f);
+				box.grow(point_t(*transform * corner));
+			}
+			return true;
+		}
+
+		bool instances_t::intersect(object::scene_object_t const& object, uint32_t objectIdx,
+									geom::ray_t const& ray, float tMax, mesh_hit_t& hit) const {
+			blas_t const* blas = blasFor(objectIdx);
+			if (!blas) return false;
+
+			glm::mat4 const* inverse = inverse_of(object);
+			geom::ray_t local = ray;
+			if (inverse) {
+				local.point = point_t(*inverse * glm::vec4(ray.point, 1.0f));
+				local.direction = vector_t(*inverse * glm::vec4(ray.direction, 0.0f));
+			}
+
+			geom::triangle_edges_t const* triangles = blas->triangles.data();
+			bool found = false;
+			blas->bvh.traverse(local, tMax, [&](uint32_t face, float& tmax) {
+				float t, u, v;
+				if (algo::raycast::on_triangle(triangles[face], local, t, u, v) && t < tmax) {
+					tmax = t;
+					hit.t = t;
+					hit.face = face;
+					hit.u = u;
+					hit.v = v;
+					found = true;
+				}
+			});
+
+			if (found) {
+				vector_t n = glm::cross(triangles[hit.face].e1, triangles[hit.face].e2);
+				if (inverse)
+					n = glm::transpose(glm::mat3(*inverse)) * n;
+				n = glm::normalize(n);
+				hit.normal = glm::dot(n, ray.direction) > 0.0f ? -n : n;
+			}
+			return found;
+		}
+
+		bool instances_t::occluded(object::scene_object_t const& object, uint32_t objectIdx,
+								   geom::ray_t const& ray, float tMax) const {
+			blas_t const* blas = blasFor(objectIdx);
+			if (!blas) return false;
+
+			glm::mat4 const* inverse = inverse_of(object);
+			geom::ray_t local = ray;
+			if (inverse) {
+				local.point = point_t(*inverse * glm::vec4(ray.point, 1.0f));
+				local.direction = vector_t(*inverse * glm::vec4(ray.direction, 0.0f));
+			}
+
+			geom::triangle_edges_t const* triangles = blas->triangles.data();
+			bool found = false;
+			blas->bvh.traverse(local, tMax, [&](uint32_t face, float& tmax) {
+				float t, u, v;
+				if (tmax >= 0.f && algo::raycast::on_triangle(triangles[face], local, t, u, v) && t < tmax) {
+					tmax = -1.f;
+					found = true;
+				}
+			});
+			return found;
+		}
+
+		void build_instances(scene_object_list const& objects, instances_t& instances,
+							 build_type type, build_params_t const& params) {
+			instances.blases.clear();
+			instances.blasOf.assign(objects.size(), -1);
+
+			std::map<object::trimesh_t const*, int32_t> known;
+			for (uint32_t i = 0; i < objects.size(); ++i) {
+				object::trimesh_t const* mesh = objects[i] ? mesh_of(*objects[i]) : nullptr;
+				if (!mesh) continue;
+
+				auto it = known.find(mesh);
+				if (it == known.end()) {
+					it = known.insert(std::make_pair(mesh, (int32_t)instances.blases.size())).first;
+					instances.blases.push_back(blas_t());
+					instances.blases.back().mesh = mesh;
+				}
+				instances.blasOf[i] = it->second;
+			}
+
+			for (auto& blas: instances.blases) {
+				prepare_triangles(blas);
+				auto const& faces = blas.mesh->geometry.faces;
+				if (type == kBuildSBVH) {
+					std::vector<point_t> vertices(3 * faces.size());
+					for (size_t f = 0; f < faces.size(); ++f)
+						face_vertices(*blas.mesh, f, vertices[3 * f], vertices[3 * f + 1], vertices[3 * f + 2]);
+					build_sbvh(vertices, blas.bvh, params);
+					continue;
+				}
+
+				std::vector<aabb_t> bounds(faces.size());
+				for (size_t f = 0; f < faces.size(); ++f) {
+					point_t v0, v1, v2;
+					face_vertices(*blas.mesh, f, v0, v1, v2);
+					bounds[f].grow(v0);
+					bounds[f].grow(v1);
+					bounds[f].grow(v2);
+				}
+				build(type, bounds, blas.bvh, params);
+			}
+		}
+
+		void object_bounds(scene_object_list const& objects, instances_t const& instances,
+						   std::vector<aabb_t>& bounds, int numThreads) {
+			object_bounds(objects, bounds, numThreads);
+			parallel::chunks(objects.size(), numThreads > 0 ? numThreads : parallel::hardware_threads(),
+				[&](size_t b, size_t e, int) {
+					for (size_t i = b; i < e; ++i) {
+						if (instances.blasFor(i) && !instances.bounds(*objects[i], i, bounds[i]))
+							bounds[i] = aabb_t();
+					}
+				});
+		}
+	}
+}
\ No newline at end of file
@@ -1,4 +1,7 @@
 #include "newbray.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 
 float clamp(float val, float min, float max) {
 	if (val <= min) return min;
@@ -21,7 +24,7 @@ namespace bray {
 			float specularBase = glm::dot( 
 					glm::normalize(2.0f * glm::dot(lightVec, normalVec) * normalVec - lightVec),
 					cameraVec );
-			float specularTerm = clamp((float)std::pow((double)specularBase, (double)shininess), 0.f, 1.f);
+			float specularTerm = clamp((float)std::pow((double)std::max(specularBase, 0.f), (double)shininess), 0.f, 1.f);
 			return diffuseTerm * diffuse + specularTerm * specular;
 		}
 
@@ -38,110 +41,1132 @@ namespace bray {
 		}
 	}
 
-	intersector_t::result_type intersector_t::findClosest(donkey::geom::ray_t const& ray) const {
-		intersector_t::result_type result;
-		for (auto object: sceneRef.objects) {
-			donkey::points_v points;
-			if (donkey::algo::raycast::on_object(object, ray, points)) {
-				const donkey::point_t& pos = ray.point;
-				for (auto point: points) {
-					float distsq = (pos.x - point.x) * (pos.x - point.x) 
-									+ (pos.y - point.y) * (pos.y - point.y)
-									+ (pos.z - point.z) * (pos.z - point.z);
-
-					if (distsq < result.distance) {
-						result.distance = distsq;
-						result.object = object;
-						result.point = point;
-						result.noHit = false;
+	/**
+	* Run the templated traversal of whichever structure accel is, a leaf at a
+	* time: visitLeaf(objectIndices, count, tMax). Grid cells are visited an
+	* object at a time. Returns false when there is nothing to traverse.
+	*/
+	template <typename LeafVisitor>
+	bool traverse_leaves(donkey::accel::accelerator_t const* accel, donkey::geom::ray_t const& ray, float& tMax, LeafVisitor&& visitLeaf) {
+		if (!accel) return false;
+		switch (accel->type) {
+			case donkey::accel::kBVH:
+				static_cast<donkey::accel::bvh_t const*>(accel)->traverseLeaves(ray, tMax, visitLeaf);
+				return true;
+			case donkey::accel::kBVH4:
+				static_cast<donkey::accel::bvh4_t const*>(accel)->traverseLeaves(ray, tMax, visitLeaf);
+				return true;
+			case donkey::accel::kBVH8:
+				static_cast<donkey::accel::bvh8_t const*>(accel)->traverseLeaves(ray, tMax, visitLeaf);
+				return true;
+			case donkey::accel::kGrid:
+				static_cast<donkey::accel::grid_t const*>(accel)->traverse(ray, tMax, [&](uint32_t idx, float& tmax) {
+					visitLeaf(&idx, 1, tmax);
+				});
+				return true;
+			case donkey::accel::kQBVH8:
+				static_cast<donkey::accel::qbvh8_t const*>(accel)->traverseLeaves(ray, tMax, visitLeaf);
+				return true;
+			default:;
+		}
+		return false;
+	}
+
+	/**
+	* Packet traversal of whichever tree accel is, see bvh_t::traversePacket.
+	* Returns false when accel is missing or cannot trace packets.
+	*/
+	template <typename LeafVisitor>
+	bool traverse_packet(donkey::accel::accelerator_t const* accel, donkey::accel::ray_packet_t& packet, LeafVisitor&& visitLeaf) {
+		if (!accel) return false;
+		switch (accel->type) {
+			case donkey::accel::kBVH:
+				static_cast<donkey::accel::bvh_t const*>(accel)->traversePacket(packet, visitLeaf);
+				return true;
+			case donkey::accel::kBVH4:
+				static_cast<donkey::accel::bvh4_t const*>(accel)->traversePacket(packet, visitLeaf);
+				return true;
+			case donkey::accel::kBVH8:
+				static_cast<donkey::accel::bvh8_t const*>(accel)->traversePacket(packet, visitLeaf);
+				return true;
+			case donkey::accel::kQBVH8:
+				static_cast<donkey::accel::qbvh8_t const*>(accel)->traversePacket(packet, visitLeaf);
+				return true;
+			default:;
+		}
+		return false;
+	}
+
+	/**
+	* True for the structures traverse_packet handles
+	*/
+	bool accel_packets(donkey::accel::accel_type type) {
+		return type == donkey::accel::kBVH || type == donkey::accel::kBVH4 || type == donkey::accel::kBVH8 ||
+			type == donkey::accel::kQBVH8;
+	}
+
+	// distance reflected rays start off the surface they leave
+	const float kRayOffset = 1e-4f;
+
+	// side of the square image tiles handed to render threads, a multiple of the packet sizes
+	const unsigned long kTileSize = 32;
+	// tiles are only split along multiples of the largest packet size
+	const unsigned long kMinTileSize = 16;
+	// the cost prepass traces one pixel in kCostStep x kCostStep
+	const unsigned long kCostStep = 8;
+	// tiles are split until none costs more than this share of a thread's work
+	const float kSplitShare = 1.f / 16;
+
+	/**
+	* n with its digits in base mirrored around the point, in [0, 1). Spreads
+	* the samples of the passes evenly over the pixel, the first at its corner.
+	*/
+	float radical_inverse(uint32_t n, uint32_t base) {
+		float result = 0.f, digit = 1.f / base;
+		for (; n; n /= base, digit /= base)
+			result += (n % base) * digit;
+		return result;
+	}
+
+	/**
+	* Cut a tile in two along its longer side, at a multiple of kMinTileSize.
+	* The halves share the cost by area. False if the tile is too small.
+	*/
+	bool split_tile(tile_t const& tile, tile_t& first, tile_t& second) {
+		const unsigned long rows = tile.row1 - tile.row0, cols = tile.col1 - tile.col0;
+		const unsigned long along = std::max(rows, cols);
+		if (along <= kMinTileSize)
+			return false;
+		const unsigned long half = std::max(kMinTileSize, along / 2 / kMinTileSize * kMinTileSize);
+		first = second = tile;
+		if (rows >= cols)
+			first.row1 = second.row0 = tile.row0 + half;
+		else
+			first.col1 = second.col0 = tile.col0 + half;
+		first.cost = tile.cost * half / along;
+		second.cost = tile.cost - first.cost;
+		return true;
+	}
+
+	/**
+	* Run fn(begin, end) over the pixels, each thread of the schedule over the
+	* rows it renders most of, so that pixels stay on the NUMA node of their
+	* band of rows
+	*/
+	template <typename Func>
+	void for_pixels(schedule_t const& schedule, unsigned long width, Func fn) {
+		donkey::parallel::run(schedule.placement, [&](int t) {
+			unsigned long begin, end;
+			schedule.threadRows(t, begin, end);
+			fn(size_t(begin) * width, size_t(end) * width);
+		});
+	}
+
+	void schedule_t::threadRows(int t, unsigned long& begin, unsigned long& end) const {
+		std::vector<int> const& nodes = placement.nodes;
+		const int node = nodes[t];
+		int share = 0, shares = 0;
+		for (int other = 0; other < numThreads; ++other) {
+			if (nodes[other] != node) continue;
+			if (other < t) ++share;
+			++shares;
+		}
+		const unsigned long first = bandRows[node], rows = bandRows[node + 1] - first;
+		begin = first + rows * share / shares;
+		end = first + rows * (share + 1) / shares;
+	}
+
+	/**
+	* Write a color to its RGBA place in the framebuffer, unclamped
+	*/
+	inline void store_linear(donkey::rgb_t const& color, float* rgba) {
+		rgba[0] = color.x;
+		rgba[1] = color.y;
+		rgba[2] = color.z;
+		rgba[3] = 1.f;
+	}
+
+	/**
+	* Refit whichever structure accel is and return its new SAH cost
+	*/
+	float refit(donkey::accel::accelerator_t* accel, std::vector<donkey::accel::aabb_t> const& bounds) {
+		switch (accel->type) {
+			case donkey::accel::kBVH: {
+				auto bvh = static_cast<donkey::accel::bvh_t*>(accel);
+				donkey::accel::refit(*bvh, bounds);
+				return donkey::accel::sah_cost(*bvh);
+			}
+			case donkey::accel::kBVH4: {
+				auto bvh = static_cast<donkey::accel::bvh4_t*>(accel);
+				donkey::accel::refit(*bvh, bounds);
+				return donkey::accel::sah_cost(*bvh);
+			}
+			case donkey::accel::kBVH8: {
+				auto bvh = static_cast<donkey::accel::bvh8_t*>(accel);
+				donkey::accel::refit(*bvh, bounds);
+				return donkey::accel::sah_cost(*bvh);
+			}
+			default:;
+		}
+		return std::numeric_limits<float>::max();
+	}
+
+	donkey::accel::memory_stats_t memory_stats(donkey::accel::accelerator_t const* accel) {
+		switch (accel->type) {
+			case donkey::accel::kBVH:
+				return donkey::accel::memory_stats(*static_cast<donkey::accel::bvh_t const*>(accel));
+			case donkey::accel::kBVH4:
+				return donkey::accel::memory_stats(*static_cast<donkey::accel::bvh4_t const*>(accel));
+			case donkey::accel::kBVH8:
+				return donkey::accel::memory_stats(*static_cast<donkey::accel::bvh8_t const*>(accel));
+			case donkey::accel::kGrid:
+				return donkey::accel::memory_stats(*static_cast<donkey::accel::grid_t const*>(accel));
+			case donkey::accel::kQBVH8:
+				return donkey::accel::memory_stats(*static_cast<donkey::accel::qbvh8_t const*>(accel));
+			default:;
+		}
+		return donkey::accel::memory_stats_t();
+	}
+
+	const char* accel_name(donkey::accel::accel_type type) {
+		static const char* names[] = { "bvh2", "bvh4", "bvh8", "grid", "bvh8 quantized" };
+		return type < donkey::accel::kNumAccelTypes ? names[type] : "unknown";
+	}
+
+	/**
+	* Children per node of the scene BVH
+	*/
+	short tree_width(newbray_params_t const& params) {
+		// compressed nodes are always 8 wide: 4 wide ones would only be 2.5x
+		// smaller, and the generic 8 lane box test decodes them without AVX too
+		if (params.compressBVH)
+			return 8;
+		short width = params.bvhWidth;
+		if (width == 0) {
+#if defined(__AVX__)
+			width = 8;
+#elif defined(__SSE__)
+			width = 4;
+#else
+			width = 2;
+#endif
+		}
+		return width;
+	}
+
+	typedef donkey::accel::compiled_scene_t compiled_t;
+
+	/**
+	* Closest hit search of one ray, fed a leaf or the whole scene at a time,
+	* for scenes whose objects are of the given kinds only.
+	* Until finish() the hit record of the result holds the ray parameter of
+	* the closest hit, the running tMax every further test is culled against.
+	*/
+	template <unsigned Kinds>
+	struct closest_hit_t {
+		intersector_t const& 			isect;
+		donkey::geom::ray_t const& 		ray;
+		intersector_t::result_type& 	result;
+
+		closest_hit_t(intersector_t const& intersector, donkey::geom::ray_t const& r,
+					  intersector_t::result_type& res):
+			isect(intersector), ray(r), result(res) {}
+
+		static inline bool inMeshTree(intersector_t const& isect, uint32_t idx) {
+			return (Kinds & compiled_t::kKindMesh) && isect.instances && isect.instances->blasFor(idx);
+		}
+
+		static inline bool isSphere(intersector_t const& isect, uint32_t idx) {
+			return Kinds == compiled_t::kKindSphere || isect.spheres->has(idx);
+		}
+
+		// planes are kept out of the trees and all tested up front by testPlanes,
+		// only the scan over every object meets them again
+		static inline bool isPlane(intersector_t const& isect, uint32_t idx) {
+			return (Kinds & compiled_t::kKindPlane) && isect.scene.objects[idx].type == donkey::object::kPlane;
+		}
+
+		// true when the object is hit closer than the closest hit so far
+		bool testObject(uint32_t idx) {
+			if (inMeshTree(isect, idx)) {
+				// meshes are searched in their own tree, in object space
+				compiled_t const& scene = isect.scene;
+				donkey::accel::mesh_hit_t hit;
+				if (!isect.instances->intersect(*scene.meshes[scene.objects[idx].index], idx, ray, result.hit.t, hit))
+					return false;
+				result.hit.t = hit.t;
+				result.hit.primitive = hit.face;
+				result.hit.u = hit.u;
+				result.hit.v = hit.v;
+				result.normal = hit.normal;
+				result.object = idx;
+				result.noHit = false;
+				return true;
+			}
+
+			if (!isect.scene.template intersect<Kinds>(idx, ray, result.hit.t, result.hit))
+				return false;
+			result.object = idx;
+			result.noHit = false;
+			return true;
+		}
+
+		// the sphere kernel may pick a sphere on_sphere misses at grazing angles,
+		// the exact test then decides for every sphere of the leaf
+		void testSpheres(int32_t nearest, uint32_t const* leaf, uint32_t count) {
+			if (nearest < 0 || testObject(nearest)) return;
+			for (uint32_t i = 0; i < count; ++i) {
+				const uint32_t idx = leaf ? leaf[i] : i;
+				if (isSphere(isect, idx))
+					testObject(idx);
+			}
+		}
+
+		// the nearest plane hit, before any traversal, bounds the search of the trees
+		void testPlanes() {
+			if (!(Kinds & compiled_t::kKindPlane)) return;
+			isect.scene.candidatePlanes(ray, result.hit.t, [this](uint32_t idx) {
+				if (isect.scene.template intersect<Kinds>(idx, ray, result.hit.t, result.hit)) {
+					result.object = idx;
+					result.noHit = false;
+				}
+			});
+		}
+
+		void testLeaf(uint32_t const* leaf, uint32_t count, float& tMax) {
+			donkey::accel::sphere_store_t const* spheres = (Kinds & compiled_t::kKindSphere) ? isect.spheres : nullptr;
+			if (spheres && count > 1) {
+				// only the nearest sphere of the leaf can be the closest hit
+				float t;
+				testSpheres(spheres->nearest(ray, leaf, count, tMax * 1.0000004f, t), leaf, count);
+				if (Kinds != compiled_t::kKindSphere) {
+					for (uint32_t i = 0; i < count; ++i) {
+						if (!spheres->has(leaf[i]))
+							testObject(leaf[i]);
 					}
 				}
+			} else {
+				for (uint32_t i = 0; i < count; ++i)
+					testObject(leaf[i]);
 			}
+			if (!result.noHit)
+				tMax = result.hit.t;
+		}
+
+		void testAll() {
+			donkey::accel::sphere_store_t const* spheres = (Kinds & compiled_t::kKindSphere) ? isect.spheres : nullptr;
+			const uint32_t numObjects = isect.scene.objects.size();
+			if (spheres) {
+				// behind the nearest plane hit, no sphere can be the closest hit
+				float t;
+				testSpheres(spheres->nearestInRange(ray, 0, numObjects, result.hit.t * 1.0000004f, t),
+							nullptr, numObjects);
+				if (Kinds == compiled_t::kKindSphere) return;
+			}
+			for (uint32_t idx = 0; idx < numObjects; ++idx) {
+				if ((!spheres || !spheres->has(idx)) && !isPlane(isect, idx))
+					testObject(idx);
+			}
+		}
+
+		void finish() {
+			if (result.noHit) return;
+			result.point = ray.point + result.hit.t * ray.direction;
+			result.distance = result.hit.t * std::sqrt(glm::dot(ray.direction, ray.direction));
+			// mesh tree hits come with their normal
+			if (!inMeshTree(isect, result.object))
+				result.normal = isect.scene.template normalAt<Kinds>(result.object, result.hit, result.point);
 		}
-		result.distance = std::sqrt(result.distance);
+	};
+
+	template <unsigned Kinds>
+	intersector_t::result_type find_closest(intersector_t const& isect, donkey::geom::ray_t const& ray) {
+		intersector_t::result_type result;
+		closest_hit_t<Kinds> search(isect, ray, result);
+		search.testPlanes();
+
+		float tMax = result.hit.t;
+		bool traversed = traverse_leaves(isect.accel, ray, tMax, [&](uint32_t const* leaf, uint32_t count, float& tmax) {
+			search.testLeaf(leaf, count, tmax);
+		});
+		if (!traversed)
+			search.testAll();
+
+		search.finish();
 		return result;
 	}
 
+	template <unsigned Kinds>
+	void find_closest_packet(intersector_t const& isect, donkey::accel::ray_packet_t& packet,
+							 donkey::geom::ray_t const* rays, intersector_t::result_type* results) {
+		if (Kinds & compiled_t::kKindPlane) {
+			for (uint32_t r = 0; r < packet.count; ++r) {
+				closest_hit_t<Kinds>(isect, rays[r], results[r]).testPlanes();
+				packet.tMax[r] = std::min(packet.tMax[r], results[r].hit.t);
+			}
+		}
+		bool traversed = traverse_packet(isect.accel, packet, [&](uint32_t const* leaf, uint32_t count,
+																  uint32_t const* active, uint32_t numActive) {
+			for (uint32_t k = 0; k < numActive; ++k) {
+				const uint32_t r = active[k];
+				closest_hit_t<Kinds>(isect, rays[r], results[r]).testLeaf(leaf, count, packet.tMax[r]);
+			}
+		});
+
+		for (uint32_t r = 0; r < packet.count; ++r) {
+			if (!traversed) {
+				results[r] = find_closest<Kinds>(isect, rays[r]);
+				continue;
+			}
+			closest_hit_t<Kinds>(isect, rays[r], results[r]).finish();
+		}
+	}
+
+	template <unsigned Kinds>
+	bool find_occluder(intersector_t const& isect, donkey::geom::ray_t const& ray, float tMax) {
+		compiled_t const& scene = isect.scene;
+		auto hits = [&](uint32_t idx) {
+			if (closest_hit_t<Kinds>::inMeshTree(isect, idx))
+				return isect.instances->occluded(*scene.meshes[scene.objects[idx].index], idx, ray, tMax);
+			donkey::geom::hit_t hit;
+			return scene.template intersect<Kinds>(idx, ray, tMax, hit);
+		};
+
+		bool found = false;
+		if (Kinds & compiled_t::kKindPlane) {
+			scene.candidatePlanes(ray, tMax, [&](uint32_t idx) {
+				donkey::geom::hit_t hit;
+				found = found || scene.template intersect<Kinds>(idx, ray, tMax, hit);
+			});
+			if (found) return true;
+		}
+		float tWalk = tMax;
+		bool traversed = traverse_leaves(isect.accel, ray, tWalk, [&](uint32_t const* leaf, uint32_t count, float& tmax) {
+			for (uint32_t i = 0; i < count && !found; ++i)
+				found = hits(leaf[i]);
+			if (found) tmax = -1.f;
+		});
+		if (!traversed) {
+			for (uint32_t idx = 0, e = scene.objects.size(); idx < e && !found; ++idx)
+				found = !closest_hit_t<Kinds>::isPlane(isect, idx) && hits(idx);
+		}
+		return found;
+	}
+
+	/**
+	* Ray from a surface point to a light, the light at t = 1
+	*/
+	inline donkey::geom::ray_t shadow_ray(donkey::point_t const& point, donkey::point_t const& light) {
+		const donkey::point_t from = point + kRayOffset * glm::normalize(light - point);
+		return donkey::geom::ray_t(from, light);
+	}
+
+	// sphere hits read their material next to the geometry in the sphere store
+	template <unsigned Kinds>
+	donkey::color::color_desc_t const& material_of(intersector_t const& isect, uint32_t idx) {
+		if ((Kinds & compiled_t::kKindSphere) && isect.spheres && closest_hit_t<Kinds>::isSphere(isect, idx))
+			return isect.scene.materials[isect.spheres->material[idx]];
+		return isect.scene.materialOf(idx);
+	}
+
+	/**
+	* Phong shading of a hit, the average over the point lights. The shadow rays
+	* go straight to the occlusion query of the same kinds.
+	*/
+	template <unsigned Kinds>
+	donkey::rgb_t shade_hit(intersector_t const& isect, intersector_t::result_type const& result,
+							donkey::geom::ray_t const& ray) {
+		donkey::rgb_t color(0.f, 0.f, 0.f);
+		if (result.noHit || isect.scene.lights.empty())
+			return color;
+
+		donkey::color::color_desc_t const& material = material_of<Kinds>(isect, result.object);
+		donkey::vector_t normal = glm::normalize(result.normal);
+		donkey::vector_t cameraVec = glm::normalize(ray.point - result.point);
+		if (glm::dot(normal, cameraVec) < 0.f) normal = -normal;
+
+		for (auto const& light : isect.scene.lights) {
+			donkey::vector_t lightVec = glm::normalize(light.position - result.point);
+
+			// lights behind the surface or blocked on the way only add ambient
+			if (glm::dot(normal, lightVec) <= 0.f ||
+				find_occluder<Kinds>(isect, shadow_ray(result.point, light.position), 1.f)) {
+				color += material.ambient;
+				continue;
+			}
+
+			donkey::rgb_t phColor = color::phong(
+									normal, 
+									lightVec, 
+									cameraVec, 
+									color::mixLightColor(light.color, light.intensity, material.diffuse),
+		 							material.specular, 
+		 							material.shininess);
+
+			color += material.ambient + phColor;
+		}
+
+		return (1.f / isect.scene.lights.size()) * color;
+	}
+
+	template <unsigned Kinds>
+	intersector_t::kernels_t const* kernels_of(const char* name) {
+		static const intersector_t::kernels_t kernels = {
+			name, &find_closest<Kinds>, &find_closest_packet<Kinds>, &find_occluder<Kinds>,
+			&material_of<Kinds>, &shade_hit<Kinds>
+		};
+		return &kernels;
+	}
+
+	intersector_t::kernels_t const* intersector_t::kernelsFor(unsigned kinds) {
+		switch (kinds) {
+			case compiled_t::kKindSphere:
+				return kernels_of<compiled_t::kKindSphere>("spheres");
+			case compiled_t::kKindSphere | compiled_t::kKindPlane:
+				return kernels_of<compiled_t::kKindSphere | compiled_t::kKindPlane>("spheres and planes");
+			case compiled_t::kKindTriangle:
+				return kernels_of<compiled_t::kKindTriangle>("triangles");
+			case compiled_t::kKindMesh:
+				return kernels_of<compiled_t::kKindMesh>("meshes");
+			default:;
+		}
+		return kernels_of<compiled_t::kAllKinds>("any");
+	}
+
 
 	// main ray-tracing routine
 	donkey::rgb_t newbray_t::getColorForRay(donkey::geom::ray_t const& ray, donkey::scene_t const& scene) const {
-		intersector_t raycaster(scene);
-		intersector_t::result_type result = raycaster.findClosest(ray);
-		if (result.noHit || !result.object)
-			return donkey::rgb_t(0.0f, 0.0f, 0.0f);
+		const bool prepared = (&scene == accelScene && compiled);
+		donkey::accel::compiled_scene_t frozen;
+		if (!prepared)
+			frozen.build(scene);
+		intersector_t raycaster(prepared ? *compiled : frozen, prepared ? accel.get() : nullptr,
+								prepared ? instances.get() : nullptr, prepared ? spheres.get() : nullptr);
+		donkey::rgb_t color(0.f, 0.f, 0.f);
+		traceBounces(raycaster, stream_ray_t(ray, 0), color);
+		return color;
+	}
 
-		donkey::primitive_ptr object = 	std::dynamic_pointer_cast<donkey::primitive::primitive_t>(result.object);
-		if (object) {
-			donkey::vector_t normal = object->getNormalAt(result.point);
-			donkey::vector_t cameraVec = glm::normalize(result.point); // result.point - [0, 0, 0]
+	/**
+	* Follow a ray and its reflections one after another, adding their shading to color
+	*/
+	void newbray_t::traceBounces(intersector_t const& raycaster, stream_ray_t bounce, donkey::rgb_t& color) const {
+		while (addHit(raycaster.findClosest(bounce.ray), bounce, raycaster, color, bounce)) {}
+	}
 
-			std::vector<donkey::rgb_t> lightColors;
+	/**
+	* Add the shading of the hit of in to color, less the reflected share. Returns
+	* true with the reflected ray in out when the surface reflects and in may bounce
+	* again; in and out may be the same.
+	*/
+	bool newbray_t::addHit(intersector_t::result_type const& result, stream_ray_t const& in, intersector_t const& raycaster,
+						   donkey::rgb_t& color, stream_ray_t& out) const {
+		if (result.noHit)
+			return false;
 
-			for (auto lightObj : scene.lights) {
-				auto light = donkey::promote<donkey::object::point_light_t<float> >(lightObj);
-				if (!light) continue;
+		const float reflectivity = raycaster.materialOf(result.object).reflectivity;
+		color += in.weight * ((1.f - reflectivity) * getColorForHit(result, in.ray, raycaster));
+		if (reflectivity <= 0.f || in.depth >= params.maxDepth)
+			return false;
 
-				donkey::vector_t lightPos = light->position;
-				donkey::vector_t lightVec = glm::normalize(result.point - lightPos);
-				donkey::rgb_t lightColor = light->color.diffuse;
+		stream_ray_t next = in;
+		next.ray = getReflectedRay(in.ray, result.point, result.normal);
+		next.weight = in.weight * reflectivity;
+		++next.depth;
+		out = next;
+		return true;
+	}
 
+	donkey::geom::ray_t newbray_t::getReflectedRay(donkey::geom::ray_t const& ray,
+												   donkey::point_t const& point,
+												   donkey::vector_t const& normal) const {
+		const donkey::vector_t d = glm::normalize(ray.direction);
+		donkey::vector_t n = glm::normalize(normal);
+		if (glm::dot(d, n) > 0.f) n = -n;
+		// start a little off the surface so that the ray does not hit it again at t = 0
+		const donkey::point_t from = point + kRayOffset * n;
+		return donkey::geom::ray_t(from, from + (d - 2.f * glm::dot(d, n) * n));
+	}
+
+	donkey::rgb_t newbray_t::getColorForHit(intersector_t::result_type const& result, donkey::geom::ray_t const& ray,
+											intersector_t const& raycaster) const {
+		return raycaster.shade(result, ray);
+	}
 
-				donkey::rgb_t phColor = color::phong(
-										normal, 
-										lightVec, 
-										cameraVec, 
-										color::mixLightColor(lightColor, light->intensity, object->material.color.diffuse),
-			 							object->material.color.specular, 
-			 							object->material.color.shininess);
 
-				donkey::rgb_t clr = object->material.color.ambient + phColor;
+	void newbray_t::buildAccelerator(donkey::scene_t const& scene) {
+		// bottom level trees for the meshes, then the top level over all objects
+		instances = std::make_shared<donkey::accel::instances_t>();
+		donkey::accel::build_params_t meshParams;
+		if (params.splitBudget != 0.f)
+			meshParams.splitBudget = params.splitBudget;
+		donkey::accel::build_instances(scene.objects, *instances, params.meshBuilder, meshParams);
 
-				lightColors.push_back(clr);
+		std::vector<donkey::accel::aabb_t> bounds;
+		donkey::accel::object_bounds(scene.objects, *instances, bounds);
+		accelScene = &scene;
+		accelFullBytes = 0;
+
+		if (params.accelerator == donkey::accel::kIndexGrid) {
+			// grids are never refit, their O(n) build is the update
+			auto grid = std::make_shared<donkey::accel::grid_t>();
+			donkey::accel::build_grid(bounds, *grid);
+			donkey::accel::drop_planes(scene.objects, grid->unbounded);
+			accel = grid;
+			return;
+		}
+
+		auto bvh = std::make_shared<donkey::accel::bvh_t>();
+		donkey::accel::build(params.bvhBuilder, bounds, *bvh);
+		donkey::accel::drop_planes(scene.objects, bvh->unbounded);
+
+		const short width = tree_width(params);
+
+		if (width == 8) {
+			auto wide = std::make_shared<donkey::accel::bvh8_t>();
+			donkey::accel::collapse(*bvh, *wide);
+			accelCost = donkey::accel::sah_cost(*wide);
+			accel = wide;
+			if (params.compressBVH) {
+				auto quantized = std::make_shared<donkey::accel::qbvh8_t>();
+				donkey::accel::compress(*wide, *quantized);
+				accelFullBytes = donkey::accel::memory_stats(*wide).nodeBytes;
+				accel = quantized;
 			}
+		} else if (width == 4) {
+			auto wide = std::make_shared<donkey::accel::bvh4_t>();
+			donkey::accel::collapse(*bvh, *wide);
+			accelCost = donkey::accel::sah_cost(*wide);
+			accel = wide;
+		} else {
+			accelCost = donkey::accel::sah_cost(*bvh);
+			accel = bvh;
+		}
+	}
 
-			donkey::rgb_t color(0.f, 0.f, 0.f);
-			
-			if (!lightColors.empty()) {
-				float factor = 1.f / lightColors.size();
-				std::for_each(lightColors.begin(), lightColors.end(), [&factor, &color] (donkey::rgb_t const& c) {
-					color += factor * c;
-				});
-			} 
 
-			return color;
-		} 
-		return donkey::rgb_t(0.0f, 0.0f, 0.0f);
+	/**
+	* Update the structure built for this scene after objects moved (sphere centers,
+	* instance transforms). Returns false if it has to be rebuilt instead: the scene
+	* is a different one, objects were added or removed, or the refit tree is too
+	* much worse than a fresh build.
+	*/
+	bool newbray_t::refitAccelerator(donkey::scene_t const& scene) {
+		if (!accel || accelScene != &scene || params.refitThreshold < 0.f)
+			return false;
+		if (!instances || !instances->matches(scene.objects))
+			return false;
+
+		std::vector<donkey::accel::aabb_t> bounds;
+		donkey::accel::object_bounds(scene.objects, *instances, bounds);
+
+		const float threshold = params.refitThreshold > 0.f ? params.refitThreshold : 0.5f;
+		const float cost = refit(accel.get(), bounds);
+		return cost <= accelCost * (1.f + threshold);
 	}
 
 
-	bool newbray_t::trace(donkey::scene_t const& scene, image::image_t& toImage) {
-		cv::Mat& img = toImage.get();
-		unsigned char* data = img.data;
+	/**
+	* Hash of the scene geometry and of every setting the build depends on
+	*/
+	uint64_t newbray_t::acceleratorHash(donkey::scene_t const& scene) const {
+		uint64_t seed = donkey::accel::kHashSeed;
+		const int settings[] = { params.accelerator, params.bvhBuilder, tree_width(params),
+								 params.compressBVH, params.meshBuilder };
+		seed = donkey::accel::hash_bytes(settings, sizeof(settings), seed);
+		seed = donkey::accel::hash_bytes(&params.splitBudget, sizeof(params.splitBudget), seed);
+		return donkey::accel::scene_hash(scene.objects, seed);
+	}
 
-		size_t c = 0;
 
-		for (unsigned long i = 0; i < toImage.height; ++i) {
-			for (unsigned long j = 0; j < toImage.width; ++j) {
-				unsigned long pos = (i * toImage.width + j) * 3;
-				donkey::point_t pixelPosition = camera.positionForPixel(j, i);
-				donkey::geom::ray_t ray(camera.e, glm::normalize(pixelPosition));
+	/**
+	* Bring the acceleration structure up to date for the scene: refit it, map
+	* it from the cache or build it. Returns what was done.
+	*/
+	const char* newbray_t::updateAccelerator(donkey::scene_t const& scene) {
+		if (refitAccelerator(scene))
+			return "refit";
 
-				donkey::rgb_t clr = getColorForRay(ray, scene);
+		if (params.accelCache.empty()) {
+			buildAccelerator(scene);
+			return "built";
+		}
+
+		const uint64_t hash = acceleratorHash(scene);
+		const std::string file = donkey::accel::cache_file(params.accelCache, hash);
+		donkey::accel::cached_accel_t cached;
+		if (donkey::accel::load_cache(file, hash, scene.objects, cached)) {
+			accel = cached.accel;
+			instances = cached.instances;
+			accelCost = cached.cost;
+			accelFullBytes = cached.fullBytes;
+			accelScene = &scene;
+			return "loaded";
+		}
+
+		buildAccelerator(scene);
+		cached.accel = accel;
+		cached.instances = instances;
+		cached.cost = accelCost;
+		cached.fullBytes = accelFullBytes;
+		if (!donkey::accel::save_cache(file, hash, cached))
+			fprintf(stderr, "could not write acceleration structure cache %s\n", file.c_str());
+		return "built";
+	}
 
-				float clrx = clamp(clr.x, 0.f, 1.f);
-				float clry = clamp(clr.y, 0.f, 1.f);
-				float clrz = clamp(clr.z, 0.f, 1.f);
 
-				if (clry > clrx || clrz > clrx) {
-					printf("%f %f %f\n", clrx, clry, clrz);
+	void newbray_t::printStats(double buildMs, const char* update) const {
+		if (!accel) return;
+		donkey::accel::memory_stats_t top = memory_stats(accel.get());
+		printf("accelerator: %s, %s in %.2f ms\n", accel_name(accel->type), update, buildMs);
+		printf("  %zu nodes, %zu bytes of nodes, %zu bytes of indices\n", top.nodes, top.nodeBytes, top.indexBytes);
+		printf("  sphere kernel: %s\n", donkey::accel::sphere_kernel_name());
+		printf("  output kernel: %s\n", image::convert_kernel_name());
+		if (compiled)
+			printf("  scene kernel: %s\n", intersector_t::kernelsFor(compiled->kinds)->name);
+		if (accelFullBytes) {
+			printf("  full precision nodes: %zu bytes, %.2fx smaller\n", accelFullBytes, double(accelFullBytes) / top.nodeBytes);
+		}
+		if (params.numa && params.numaBenchmark) {
+			// a microbenchmark of its own, not the render's traffic: the first CPU of
+			// node 0 reads 64 MB first written on node 0 and on the last node
+			auto const& nodes = donkey::parallel::numa_topology().nodes;
+			if (!nodes.front().empty()) {
+				const size_t bytes = size_t(64) << 20;
+				const int cpu = nodes.front().front();
+				printf("  numa microbenchmark: %zu nodes, local reads %.2f GB/s", nodes.size(),
+					   donkey::parallel::read_bandwidth(cpu, cpu, bytes) * 1e-9);
+				if (nodes.size() > 1 && !nodes.back().empty())
+					printf(", remote reads %.2f GB/s", donkey::parallel::read_bandwidth(cpu, nodes.back().front(), bytes) * 1e-9);
+				printf("\n");
+			}
+		}
+
+		if (instances && !instances->blases.empty()) {
+			donkey::accel::memory_stats_t meshes;
+			size_t triangleBytes = 0;
+			for (auto const& blas: instances->blases) {
+				triangleBytes += blas.triangles.size() * sizeof(donkey::geom::triangle_edges_t);
+				donkey::accel::memory_stats_t m = donkey::accel::memory_stats(blas.bvh);
+				meshes.nodes += m.nodes;
+				meshes.nodeBytes += m.nodeBytes;
+				meshes.indexBytes += m.indexBytes;
+			}
+			printf("  %zu mesh trees: %zu nodes, %zu bytes of nodes, %zu bytes of indices, %zu bytes of triangles\n",
+				   instances->blases.size(), meshes.nodes, meshes.nodeBytes, meshes.indexBytes, triangleBytes);
+		}
+	}
+
+
+	render_handle_t newbray_t::traceAsync(donkey::scene_t const& scene, image::image_t& toImage,
+										  std::function<void(tile_t const&, int, float)> progress) {
+		render_handle_t handle;
+		handle.control = std::make_shared<render_control_t>();
+		handle.control->progress = progress;
+		std::shared_ptr<render_control_t> control = handle.control;
+		handle.done = std::async(std::launch::async, [this, &scene, &toImage, control]() {
+			return trace(scene, toImage, control.get());
+		}).share();
+		return handle;
+	}
+
+	bool newbray_t::trace(donkey::scene_t const& scene, image::image_t& toImage, render_control_t* control) {
+		auto start = std::chrono::steady_clock::now();
+		const char* update = updateAccelerator(scene);
+		if (!compiled)
+			compiled = std::make_shared<donkey::accel::compiled_scene_t>();
+		compiled->build(scene);
+		if (!spheres)
+			spheres = std::make_shared<donkey::accel::sphere_store_t>();
+		spheres->build(*compiled);
+		if (params.stats)
+			printStats(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(), update);
+
+		intersector_t raycaster(*compiled, accel.get(), instances.get(), spheres.get());
+		float* linear = toImage.framebuffer();
+		const size_t numPixels = toImage.width * toImage.height;
+		// in stream and progressive mode pixels gather their color in colors and are written at the end
+		const bool streaming = params.rayStream > 0 && params.maxDepth > 0;
+		const bool progressive = params.timeBudget > 0.f || params.maxSamples > 1;
+		schedule_t schedule;
+		planTiles(raycaster, toImage.width, toImage.height, schedule);
+		if (params.numa && params.replicateScene)
+			copySceneToNodes(schedule);
+
+		// the threads that render the pixels write them first; the framebuffer
+		// sums the passes of progressive mode
+		color_buffer_t colors((streaming || progressive) ? numPixels : 0);
+		for_pixels(schedule, toImage.width, [&](size_t b, size_t e) {
+			for (size_t pixel = b; pixel < e; ++pixel) {
+				store_linear(donkey::rgb_t(0.f, 0.f, 0.f), linear + pixel * 4);
+				if (colors.data)
+					colors.data[pixel] = donkey::rgb_t(0.f, 0.f, 0.f);
+			}
+		});
+
+		frame_t frame;
+		frame.linear = linear;
+		frame.colors = colors.data;
+		frame.streaming = streaming;
+		const image::output_curve_t curve(params.outputTransfer, params.outputGamma);
+
+		// cancelled before the first tile, the image is black
+		if (control && control->cancelled) {
+			for_pixels(schedule, toImage.width, [&](size_t b, size_t e) {
+				toImage.convertRows(b / toImage.width, e / toImage.width, 1.f, curve);
+			});
+			return false;
+		}
+
+		if (!progressive) {
+			const bool done = renderPass(raycaster, schedule, frame, toImage.width,
+										 std::chrono::steady_clock::time_point::max(), control);
+			// a cancelled render converts the tiles it finished
+			for_pixels(schedule, toImage.width, [&](size_t b, size_t e) {
+				for (size_t pixel = b; streaming && pixel < e; ++pixel)
+					store_linear(colors.data[pixel], linear + pixel * 4);
+				toImage.convertRows(b / toImage.width, e / toImage.width, 1.f, curve);
+			});
+			printNumaStats(schedule);
+			return done;
+		}
+
+		// one sample per pixel and pass, at a new spot of the pixel each time,
+		// averaged until the budget or the sample count is used up. The first
+		// pass is the plain image and always completes, later passes are
+		// dropped when the budget runs out before they are done.
+		const auto deadline = params.timeBudget > 0.f ?
+			start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(params.timeBudget)) :
+			std::chrono::steady_clock::time_point::max();
+		const int maxSamples = params.maxSamples > 0 ? params.maxSamples : std::numeric_limits<int>::max();
+		int samples = 0;
+		while (samples < maxSamples) {
+			frame.offsetX = radical_inverse(samples, 2);
+			frame.offsetY = radical_inverse(samples, 3);
+			frame.pass = samples;
+			if (!renderPass(raycaster, schedule, frame, toImage.width,
+							samples ? deadline : std::chrono::steady_clock::time_point::max(), control))
+				break;
+			++samples;
+			for_pixels(schedule, toImage.width, [&](size_t b, size_t e) {
+				for (size_t pixel = b; pixel < e; ++pixel) {
+					float* rgba = linear + pixel * 4;
+					rgba[0] += colors.data[pixel].x;
+					rgba[1] += colors.data[pixel].y;
+					rgba[2] += colors.data[pixel].z;
 				}
+			});
+			if (std::chrono::steady_clock::now() >= deadline)
+				break;
+		}
 
-				data[pos] = static_cast<unsigned char>(clrz * 255);
-				data[pos+1] = static_cast<unsigned char>(clry * 255);
-				data[pos+2] = static_cast<unsigned char>(clrx * 255);
+		// a cancelled render keeps the passes it finished, or the tiles it
+		// finished of the first pass
+		if (!samples) {
+			for_pixels(schedule, toImage.width, [&](size_t b, size_t e) {
+				for (size_t pixel = b; pixel < e; ++pixel)
+					store_linear(colors.data[pixel], linear + pixel * 4);
+				toImage.convertRows(b / toImage.width, e / toImage.width, 1.f, curve);
+			});
+			printNumaStats(schedule);
+			return false;
+		}
+		// the framebuffer keeps the average, not the sum
+		const float scale = 1.f / samples;
+		for_pixels(schedule, toImage.width, [&](size_t b, size_t e) {
+			for (size_t pixel = b; pixel < e; ++pixel) {
+				float* rgba = linear + pixel * 4;
+				rgba[0] *= scale;
+				rgba[1] *= scale;
+				rgba[2] *= scale;
 			}
+			toImage.convertRows(b / toImage.width, e / toImage.width, 1.f, curve);
+		});
+		if (params.stats)
+			printf("progressive: %d samples per pixel in %.2f ms\n", samples,
+				   std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		printNumaStats(schedule);
+		return !(control && control->cancelled);
+	}
+
+	/**
+	* Cut the image into tiles and share them out among the render threads.
+	* With more than one thread the tiles are ordered by their measured cost,
+	* the most expensive first, and dealt out in turn so that every thread
+	* starts on its share of them. Tiles above splitCost are halved before they
+	* are rendered, so that no thread is left with a long one at the end.
+	* With numa the threads are pinned, and the tiles of each band of rows go
+	* to the threads of one node.
+	*/
+	void newbray_t::planTiles(intersector_t const& raycaster, unsigned long width, unsigned long height,
+							  schedule_t& schedule) const {
+		// tiles are a multiple of the packet size so that packets are the same as in one pass
+		std::vector<tile_t> tiles;
+		for (unsigned long i = 0; i < height; i += kTileSize) {
+			for (unsigned long j = 0; j < width; j += kTileSize)
+				tiles.push_back({ i, j, std::min(i + kTileSize, height), std::min(j + kTileSize, width), 0.f, 0 });
+		}
+		const int numThreads = std::max(1, std::min<int>(params.numThreads > 0 ? params.numThreads :
+																donkey::parallel::hardware_threads(), tiles.size()));
+
+		schedule.numThreads = numThreads;
+		schedule.numPixels = width * height;
+		schedule.splitCost = std::numeric_limits<float>::max();
+		if (params.numa) {
+			schedule.placement = donkey::parallel::place_threads(numThreads);
+		} else {
+			schedule.placement = donkey::parallel::placement_t();
+			schedule.placement.nodes.assign(numThreads, 0);
 		}
 
+		// bands of whole tile rows, as many rows per node as it has threads
+		const int numNodes = schedule.placement.numNodes;
+		std::vector< std::vector<int> > nodeThreads(numNodes);
+		for (int t = 0; t < numThreads; ++t)
+			nodeThreads[schedule.placement.nodes[t]].push_back(t);
+		const unsigned long tileRows = (height + kTileSize - 1) / kTileSize;
+		schedule.bandRows.assign(1, 0);
+		for (int node = 0, threads = 0; node < numNodes; ++node) {
+			threads += nodeThreads[node].size();
+			schedule.bandRows.push_back(std::min(height, (threads * tileRows + numThreads - 1) / numThreads * kTileSize));
+		}
+		for (auto& tile: tiles) {
+			while (tile.row0 >= schedule.bandRows[tile.node + 1])
+				++tile.node;
+		}
+
+		if (numThreads > 1) {
+			estimateTileCosts(raycaster, tiles, schedule.placement);
+			std::stable_sort(tiles.begin(), tiles.end(), [](tile_t const& a, tile_t const& b) { return a.cost > b.cost; });
+			float total = 0.f;
+			for (auto const& tile: tiles)
+				total += tile.cost;
+			schedule.splitCost = total / numThreads * kSplitShare;
+		}
+		// nodes without threads have empty bands and get no tiles
+		std::vector<size_t> dealt(numNodes, 0);
+		schedule.queues.assign(numThreads, std::deque<tile_t>());
+		for (auto const& tile: tiles) {
+			std::vector<int> const& threads = nodeThreads[tile.node];
+			schedule.queues[threads[dealt[tile.node]++ % threads.size()]].push_back(tile);
+		}
+	}
+
+	/**
+	* Copy the flat scene and the sphere store once per NUMA node, each copy by
+	* a thread of its node so that its pages are local to it, and give every
+	* thread a raycaster over the copies of its node. The trees are shared.
+	*/
+	void newbray_t::copySceneToNodes(schedule_t& schedule) const {
+		const int numNodes = schedule.placement.numNodes;
+		if (numNodes < 2)
+			return;
+		schedule.sceneCopies.assign(numNodes, nullptr);
+		schedule.sphereCopies.assign(numNodes, nullptr);
+		donkey::parallel::run(schedule.placement, [&](int t) {
+			const int node = schedule.placement.nodes[t];
+			for (int other = 0; other < t; ++other) {
+				if (schedule.placement.nodes[other] == node)
+					return;
+			}
+			schedule.sceneCopies[node] = std::make_shared<donkey::accel::compiled_scene_t>(*compiled);
+			schedule.sphereCopies[node] = std::make_shared<donkey::accel::sphere_store_t>(*spheres);
+		});
+
+		schedule.raycasters.reserve(schedule.numThreads);
+		for (int t = 0; t < schedule.numThreads; ++t) {
+			const int node = schedule.placement.nodes[t];
+			schedule.raycasters.push_back(intersector_t(*schedule.sceneCopies[node], accel.get(),
+														instances.get(), schedule.sphereCopies[node].get()));
+		}
+	}
+
+	void newbray_t::printNumaStats(schedule_t const& schedule) const {
+		if (!params.stats || !params.numa)
+			return;
+		const size_t tiles = schedule.localTiles + schedule.remoteTiles;
+		printf("numa: %d nodes, %d threads%s, %.1f%% of tiles rendered on the node of their rows%s\n",
+			   schedule.placement.numNodes, schedule.numThreads, schedule.placement.cpus.empty() ? "" : " pinned",
+			   tiles ? 100. * schedule.localTiles / tiles : 100., schedule.raycasters.empty() ? "" : ", scene copied per node");
+	}
+
+	/**
+	* Render every tile of the schedule, one thread per queue with a copy of
+	* frame each. Tiles not started by the deadline or after the render was
+	* cancelled are skipped and the pass returns false; the tiles it did render
+	* are complete, reflections included. Pixels do not depend
+	* on each other, so the image is the same for any thread count and any
+	* order of the tiles.
+	*/
+	bool newbray_t::renderPass(intersector_t const& raycaster, schedule_t& schedule, frame_t const& frame,
+							   unsigned long width, std::chrono::steady_clock::time_point deadline,
+							   render_control_t* control) const {
+		std::vector<frame_t> frames(schedule.numThreads, frame);
+		std::atomic<bool> expired(false);
+		std::atomic<size_t> pixelsDone(0);
+		const bool timed = deadline != std::chrono::steady_clock::time_point::max();
+		auto raycasterOf = [&](int thread) -> intersector_t const& {
+			return schedule.raycasters.empty() ? raycaster : schedule.raycasters[thread];
+		};
+		auto runTile = [&](tile_t const& tile, int thread, std::function<void(tile_t const&)> const& push) {
+			if (expired || (control && control->cancelled) || (timed && std::chrono::steady_clock::now() >= deadline)) {
+				expired = true;
+				return;
+			}
+			tile_t first, second;
+			if (tile.cost > schedule.splitCost && split_tile(tile, first, second)) {
+				push(second);
+				push(first);
+				return;
+			}
+			renderTile(raycasterOf(thread), frames[thread], tile, width);
+			if (tile.node == schedule.placement.nodes[thread])
+				++schedule.localTiles;
+			else
+				++schedule.remoteTiles;
+			if (control && control->progress) {
+				const size_t done = pixelsDone += (tile.row1 - tile.row0) * (tile.col1 - tile.col0);
+				control->progress(tile, frame.pass, float(done) / schedule.numPixels);
+			}
+		};
+		donkey::parallel::steal(schedule.queues, schedule.placement, runTile);
+		// the queued reflections are of tiles that were rendered, so they are
+		// traced after a cancel too, unless the whole pass is dropped
+		if (frame.streaming && !(timed && expired)) {
+			donkey::parallel::run(schedule.placement, [&](int thread) {
+				traceStream(raycasterOf(thread), frames[thread]);
+			});
+		}
+		return !expired;
+	}
+
+	/**
+	* Time a sparse sample of the pixels of every tile, one in kCostStep x
+	* kCostStep, and scale it to the tile
+	*/
+	void newbray_t::estimateTileCosts(intersector_t const& raycaster, std::vector<tile_t>& tiles,
+									  donkey::parallel::placement_t const& placement) const {
+		std::atomic<size_t> nextTile(0);
+		donkey::parallel::run(placement, [&](int) {
+			for (size_t t = nextTile++; t < tiles.size(); t = nextTile++) {
+				tile_t& tile = tiles[t];
+				size_t samples = 0;
+				auto start = std::chrono::steady_clock::now();
+				for (unsigned long i = tile.row0; i < tile.row1; i += kCostStep) {
+					for (unsigned long j = tile.col0; j < tile.col1; j += kCostStep, ++samples) {
+						donkey::point_t pixelPosition = camera.positionForPixel(j, i);
+						donkey::rgb_t color(0.f, 0.f, 0.f);
+						traceBounces(raycaster, stream_ray_t(donkey::geom::ray_t(camera.e, glm::normalize(pixelPosition)), 0), color);
+					}
+				}
+				const float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+				tile.cost = seconds * (tile.row1 - tile.row0) * (tile.col1 - tile.col0) / samples;
+			}
+		});
+	}
+
+	void newbray_t::renderTile(intersector_t const& raycaster, frame_t& frame, tile_t const& tile, unsigned long width) const {
+		if (params.packetSize && tracePackets(raycaster, frame, tile, width))
+			return;
+		for (unsigned long i = tile.row0; i < tile.row1; ++i) {
+			for (unsigned long j = tile.col0; j < tile.col1; ++j) {
+				donkey::point_t pixelPosition = camera.positionForPixel(j + frame.offsetX, i + frame.offsetY);
+				donkey::geom::ray_t ray(camera.e, glm::normalize(pixelPosition));
+				shadePixel(raycaster, frame, raycaster.findClosest(ray), ray, i * width + j);
+			}
+		}
+	}
+
+	/**
+	* Shade the primary hit of a pixel. Its reflections are traced right away,
+	* or queued in the stream which is traced once it holds rayStream rays.
+	*/
+	void newbray_t::shadePixel(intersector_t const& raycaster, frame_t& frame, intersector_t::result_type const& result,
+							   donkey::geom::ray_t const& ray, uint32_t pixel) const {
+		donkey::rgb_t color(0.f, 0.f, 0.f);
+		stream_ray_t bounce(ray, pixel);
+		const bool reflects = addHit(result, bounce, raycaster, color, bounce);
+		if (!frame.streaming) {
+			if (reflects)
+				traceBounces(raycaster, bounce, color);
+			if (frame.colors)
+				frame.colors[pixel] = color;
+			else
+				store_linear(color, frame.linear + size_t(pixel) * 4);
+			return;
+		}
+
+		frame.colors[pixel] = color;
+		if (reflects)
+			frame.stream.push_back(bounce);
+		if (frame.stream.size() >= (size_t)params.rayStream)
+			traceStream(raycaster, frame);
+	}
+
+	/**
+	* Trace the queued rays a bounce at a time, each bounce in sorted order, until
+	* none reflects any more. Pixels get their bounces in the order traceBounces
+	* adds them, so the image does not depend on the mode.
+	*/
+	void newbray_t::traceStream(intersector_t const& raycaster, frame_t& frame) const {
+		std::vector<stream_ray_t> next;
+		std::vector<donkey::geom::ray_t> rays;
+		std::vector<uint32_t> order;
+		while (!frame.stream.empty()) {
+			rays.clear();
+			for (auto const& queued: frame.stream)
+				rays.push_back(queued.ray);
+			donkey::accel::sort_rays(rays, order);
+
+			next.clear();
+			for (uint32_t i: order) {
+				stream_ray_t const& queued = frame.stream[i];
+				stream_ray_t bounce = queued;
+				if (addHit(raycaster.findClosest(queued.ray), queued, raycaster, frame.colors[queued.pixel], bounce))
+					next.push_back(bounce);
+			}
+			frame.stream.swap(next);
+		}
+	}
+
+	bool newbray_t::tracePackets(intersector_t const& raycaster, frame_t& frame, tile_t const& tile, unsigned long width) const {
+		if (!accel || !accel_packets(accel->type))
+			return false;
+
+		const unsigned long side = (params.packetSize >= 16) ? 16 : 8;
+
+		donkey::accel::ray_packet_t packet;
+		std::vector<donkey::geom::ray_t> rays;
+		rays.reserve(donkey::accel::ray_packet_t::kMaxRays);
+		std::vector<intersector_t::result_type> results(donkey::accel::ray_packet_t::kMaxRays);
+
+		for (unsigned long ti = tile.row0; ti < tile.row1; ti += side) {
+			for (unsigned long tj = tile.col0; tj < tile.col1; tj += side) {
+				const unsigned long iEnd = std::min(ti + side, tile.row1);
+				const unsigned long jEnd = std::min(tj + side, tile.col1);
+
+				// the same rays as the pixel loop, bundled
+				packet.reset(camera.e);
+				rays.clear();
+				for (unsigned long i = ti; i < iEnd; ++i) {
+					for (unsigned long j = tj; j < jEnd; ++j) {
+						donkey::point_t pixelPosition = camera.positionForPixel(j + frame.offsetX, i + frame.offsetY);
+						rays.push_back(donkey::geom::ray_t(camera.e, glm::normalize(pixelPosition)));
+						packet.add(rays.back().direction);
+					}
+				}
+				packet.finish();
+
+				std::fill(results.begin(), results.end(), intersector_t::result_type());
+				raycaster.findClosest(packet, rays.data(), results.data());
+
+				uint32_t r = 0;
+				for (unsigned long i = ti; i < iEnd; ++i) {
+					for (unsigned long j = tj; j < jEnd; ++j, ++r)
+						shadePixel(raycaster, frame, results[r], rays[r], i * width + j);
+				}
+			}
+		}
 		return true;
 	}
 
@@ -0,0 +1,122 @@
+#include "parallel.h"
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace donkey {
+
+	namespace parallel {
+
+		namespace {
+
+			/**
+			* CPU numbers of a /sys cpulist such as "0-3,8-11"
+			*/
+			std::vector<int> parse_cpu_list(std::string const& list) {
+				std::vector<int> cpus;
+				std::stringstream ranges(list);
+				std::string range;
+				while (std::getline(ranges, range, ',')) {
+					if (range.empty() || range[0] < '0' || range[0] > '9') continue;
+					const size_t dash = range.find('-');
+					const int first = std::stoi(range.substr(0, dash));
+					const int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+					for (int cpu = first; cpu <= last; ++cpu)
+						cpus.push_back(cpu);
+				}
+				return cpus;
+			}
+
+			numa_topology_t read_topology() {
+				numa_topology_t topology;
+#if defined(__linux__)
+				for (int node = 0; ; ++node) {
+					std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+					if (!file) break;
+					std::string list;
+					std::getline(file, list);
+					topology.nodes.push_back(parse_cpu_list(list));
+				}
+#endif
+				if (topology.nodes.empty())
+					topology.nodes.push_back(std::vector<int>());
+				return topology;
+			}
+		}
+
+		numa_topology_t const& numa_topology() {
+			static const numa_topology_t topology = read_topology();
+			return topology;
+		}
+
+		bool pin_thread(int cpu) {
+#if defined(__linux__)
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+			(void)cpu;
+			return false;
+#endif
+		}
+
+		placement_t place_threads(int numThreads) {
+			placement_t placement;
+			numa_topology_t const& topology = numa_topology();
+			std::vector<int> cpus, nodes;
+			for (size_t node = 0; node < topology.nodes.size(); ++node) {
+				for (int cpu: topology.nodes[node]) {
+					cpus.push_back(cpu);
+					nodes.push_back(node);
+				}
+			}
+			if (cpus.empty()) {
+				placement.nodes.assign(numThreads, 0);
+				return placement;
+			}
+
+			// thread t takes the CPU as far into the list as t is into the threads
+			placement.numNodes = topology.nodes.size();
+			for (int t = 0; t < numThreads; ++t) {
+				const size_t at = size_t(t) * cpus.size() / numThreads;
+				placement.cpus.push_back(cpus[at]);
+				placement.nodes.push_back(nodes[at]);
+			}
+			return placement;
+		}
+
+		double read_bandwidth(int cpu, int memoryCpu, size_t bytes) {
+			const size_t count = bytes / sizeof(uint64_t);
+			std::unique_ptr<uint64_t[]> buffer;
+			placement_t owner;
+			owner.cpus.push_back(memoryCpu);
+			owner.nodes.push_back(0);
+			run(owner, [&](int) {
+				buffer.reset(new uint64_t[count]);
+				for (size_t i = 0; i < count; ++i)
+					buffer[i] = i;
+			});
+
+			double seconds = 0.;
+			uint64_t sum = 0;
+			placement_t reader;
+			reader.cpus.push_back(cpu);
+			reader.nodes.push_back(0);
+			run(reader, [&](int) {
+				auto start = std::chrono::steady_clock::now();
+				for (size_t i = 0; i < count; ++i)
+					sum += buffer[i];
+				seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			});
+			// the sum keeps the reads from being optimized away
+			return sum != 1 && seconds > 0. ? count * sizeof(uint64_t) / seconds : 0.;
+		}
+	}
+}
@@ -0,0 +1,148 @@
+#include "quantized_bvh.h"
+#include <cmath>
+
+namespace donkey {
+
+	namespace accel {
+
+		namespace {
+
+			const uint32_t kMaxLeafCount = 255;
+
+			template <int Width>
+			struct compressor_t {
+				wide_bvh_t<Width> const& 				wide;
+				quantized_bvh_t<Width>& 				out;
+
+				compressor_t(wide_bvh_t<Width> const& source, quantized_bvh_t<Width>& quantized):
+					wide(source), out(quantized) {}
+
+				static aabb_t laneBounds(wide_node_t<Width> const& node, int lane) {
+					return aabb_t(
+						point_t(node.lo[0][lane], node.lo[1][lane], node.lo[2][lane]),
+						point_t(node.hi[0][lane], node.hi[1][lane], node.hi[2][lane]));
+				}
+
+				static inline float decode(float origin, float scale, int q) {
+					return origin + float(q) * scale;
+				}
+
+				/**
+				* Pick the grid of one axis: the smallest power of two step whose 255
+				* steps from the origin still reach hi once rounded
+				*/
+				static int8_t axisExponent(float lo, float hi) {
+					const float extent = hi - lo;
+					int e = -126;
+					if (extent > 0.f) {
+						int exp2;
+						std::frexp(extent / 255.f, &exp2);
+						e = std::max(-126, exp2 - 1);
+					}
+					while (e < 127 && decode(lo, std::ldexp(1.f, e), 255) < hi)
+						++e;
+					return int8_t(e);
+				}
+
+				/**
+				* Spread a leaf too large for an 8 bit count over the lanes of a node
+				*/
+				static wide_node_t<Width> splitLeaf(aabb_t const& box, uint32_t first, uint32_t count) {
+					wide_node_t<Width> node;
+					const uint32_t perLane = (count + Width - 1) / Width;
+					for (int lane = 0; lane < Width && count; ++lane) {
+						const uint32_t n = std::min(perLane, count);
+						node.setBounds(lane, box);
+						node.child[lane] = first;
+						node.count[lane] = n;
+						first += n;
+						count -= n;
+					}
+					return node;
+				}
+
+				void emit(wide_node_t<Width> const& src, uint32_t slot) {
+					aabb_t box;
+					for (int lane = 0; lane < Width; ++lane) {
+						if (src.count[lane] || src.child[lane])
+							box.grow(laneBounds(src, lane));
+					}
+
+					quantized_node_t<Width> node;
+					float scale[3];
+					for (int a = 0; a < 3; ++a) {
+						node.origin[a] = box.lo[a];
+						node.exponent[a] = axisExponent(box.lo[a], box.hi[a]);
+						scale[a] = node.scale(a);
+					}
+					node.innerMask = 0;
+
+					// unused lanes decode to inverted boxes and are masked out anyway
+					wide_node_t<Width> children[Width];
+					int numChildren = 0;
+					std::vector<uint32_t> leafIndices;
+					for (int lane = 0; lane < Width; ++lane) {
+						node.count[lane] = 0;
+						for (int a = 0; a < 3; ++a) {
+							node.qlo[a][lane] = 255;
+							node.qhi[a][lane] = 0;
+						}
+
+						const bool used = src.count[lane] || src.child[lane];
+						if (!used) continue;
+
+						aabb_t const lb = laneBounds(src, lane);
+						for (int a = 0; a < 3; ++a) {
+							// round outwards, then step until the decoded value is conservative
+							int qlo = (int)std::floor((lb.lo[a] - node.origin[a]) / scale[a]);
+							int qhi = (int)std::ceil((lb.hi[a] - node.origin[a]) / scale[a]);
+							qlo = glm::clamp(qlo, 0, 255);
+							qhi = glm::clamp(qhi, qlo, 255);
+							while (qlo > 0 && decode(node.origin[a], scale[a], qlo) > lb.lo[a]) --qlo;
+							while (qhi < 255 && decode(node.origin[a], scale[a], qhi) < lb.hi[a]) ++qhi;
+							node.qlo[a][lane] = qlo;
+							node.qhi[a][lane] = qhi;
+						}
+
+						if (src.count[lane] > kMaxLeafCount) {
+							node.innerMask |= 1 << lane;
+							children[numChildren++] = splitLeaf(lb, src.child[lane], src.count[lane]);
+						} else if (src.count[lane]) {
+							node.count[lane] = src.count[lane];
+							for (uint32_t k = src.child[lane], e = k + src.count[lane]; k < e; ++k)
+								leafIndices.push_back(wide.indices[k]);
+						} else {
+							node.innerMask |= 1 << lane;
+							children[numChildren++] = wide.nodes[src.child[lane]];
+						}
+					}
+
+					node.leafBase = out.indices.size();
+					out.indices.insert(out.indices.end(), leafIndices.begin(), leafIndices.end());
+					node.childBase = out.nodes.size();
+					out.nodes.resize(out.nodes.size() + numChildren);
+					out.nodes[slot] = node;
+
+					for (int i = 0; i < numChildren; ++i)
+						emit(children[i], node.childBase + i);
+				}
+			};
+		}
+
+		template <int Width>
+		void compress(wide_bvh_t<Width> const& wide, quantized_bvh_t<Width>& quantized) {
+			quantized.nodes.clear();
+			quantized.indices.clear();
+			quantized.unbounded = wide.unbounded;
+			if (wide.nodes.empty()) return;
+
+			quantized.nodes.reserve(wide.nodes.size());
+			quantized.indices.reserve(wide.indices.size());
+			quantized.nodes.resize(1);
+			compressor_t<Width> compressor(wide, quantized);
+			compressor.emit(wide.nodes[0], 0);
+		}
+
+		template void compress<8>(wide_bvh_t<8> const&, quantized_bvh_t<8>&);
+	}
+}
\ No newline at end of file
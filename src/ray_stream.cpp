@@ -0,0 +1,34 @@
+#include "ray_stream.h"
+#include <algorithm>
+
+namespace donkey {
+
+	namespace accel {
+
+		void sort_rays(std::vector<geom::ray_t> const& rays, std::vector<uint32_t>& order) {
+			const size_t n = rays.size();
+			aabb_t origins;
+			for (auto const& ray: rays)
+				origins.grow(ray.point);
+			const vector_t extent = origins.extent();
+			const vector_t invExtent(
+				extent.x > 0.f ? 1.f / extent.x : 0.f,
+				extent.y > 0.f ? 1.f / extent.y : 0.f,
+				extent.z > 0.f ? 1.f / extent.z : 0.f);
+
+			// octant in the top 3 bits, the 30 bit origin code, then the ray number in 31 bits
+			std::vector<uint64_t> keys(n);
+			for (size_t i = 0; i < n; ++i) {
+				geom::ray_t const& ray = rays[i];
+				const uint64_t octant = (ray.direction.x < 0.f ? 4 : 0) | (ray.direction.y < 0.f ? 2 : 0) | (ray.direction.z < 0.f ? 1 : 0);
+				const uint64_t cell = morton_code((ray.point - origins.lo) * invExtent, 10);
+				keys[i] = (octant << 61) | (cell << 31) | i;
+			}
+			std::sort(keys.begin(), keys.end());
+
+			order.resize(n);
+			for (size_t i = 0; i < n; ++i)
+				order[i] = uint32_t(keys[i] & 0x7fffffffu);
+		}
+	}
+}
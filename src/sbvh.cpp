@@ -0,0 +1,343 @@
+#include "accel.h"
+#include <algorithm>
+
+namespace donkey {
+
+	namespace accel {
+
+		namespace {
+
+			const int kMaxBuildDepth = 60;
+
+			struct sref_t {
+				aabb_t 		bounds;
+				uint32_t 	prim;
+			};
+
+			struct split_t {
+				float 		cost;
+				int 		axis;
+				int 		bin;
+				bool 		spatial;
+				aabb_t 		left;
+				aabb_t 		right;
+				split_t(): cost(std::numeric_limits<float>::max()), axis(-1), bin(0), spatial(false) {}
+			};
+
+			inline aabb_t intersect(aabb_t const& a, aabb_t const& b) {
+				return aabb_t(glm::max(a.lo, b.lo), glm::min(a.hi, b.hi));
+			}
+
+			struct sbvh_builder_t {
+				build_params_t const& 			params;
+				std::vector<point_t> const& 	vertices;		// three per triangle
+				std::vector<bvh_node_t>& 		nodes;
+				std::vector<uint32_t>& 			indices;
+				size_t 							extraRefs;
+				size_t 							maxExtraRefs;
+				float 							minOverlap;		// overlap area, below which spatial splits are not tried
+
+				sbvh_builder_t(build_params_t const& buildParams, std::vector<point_t> const& triangleVertices,
+							   bvh_t& bvh, size_t budget, float overlap):
+					params(buildParams), vertices(triangleVertices), nodes(bvh.nodes), indices(bvh.indices),
+					extraRefs(0), maxExtraRefs(budget), minOverlap(overlap) {}
+
+				/**
+				* Split the part of a triangle inside box at an axis aligned plane
+				*/
+				void splitReference(sref_t const& ref, int axis, float pos, aabb_t& left, aabb_t& right) const {
+					left = aabb_t();
+					right = aabb_t();
+					point_t const* v = &vertices[3 * ref.prim];
+					for (int i = 0; i < 3; ++i) {
+						point_t const& a = v[i];
+						point_t const& b = v[(i + 1) % 3];
+						if (a[axis] <= pos) left.grow(a);
+						if (a[axis] >= pos) right.grow(a);
+						if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos)) {
+							point_t p = glm::mix(a, b, (pos - a[axis]) / (b[axis] - a[axis]));
+							p[axis] = pos;
+							left.grow(p);
+							right.grow(p);
+						}
+					}
+					left = intersect(left, ref.bounds);
+					right = intersect(right, ref.bounds);
+				}
+
+				split_t findObjectSplit(std::vector<sref_t> const& refs, aabb_t const& centroids) const {
+					split_t best;
+					const int nb = params.numBins;
+					std::vector<aabb_t> bins(nb);
+					std::vector<int> counts(nb);
+					std::vector<aabb_t> rightBounds(nb);
+					std::vector<int> rightCounts(nb);
+
+					for (int a = 0; a < 3; ++a) {
+						const float lo = centroids.lo[a], hi = centroids.hi[a];
+						if (hi <= lo) continue;
+						const float scale = nb / (hi - lo);
+
+						std::fill(bins.begin(), bins.end(), aabb_t());
+						std::fill(counts.begin(), counts.end(), 0);
+						for (auto const& ref: refs) {
+							int b = std::min(nb - 1, (int)((ref.bounds.centroid()[a] - lo) * scale));
+							bins[b].grow(ref.bounds);
+							counts[b]++;
+						}
+
+						aabb_t rb;
+						int rc = 0;
+						for (int b = nb - 1; b > 0; --b) {
+							rb.grow(bins[b]);
+							rc += counts[b];
+							rightBounds[b] = rb;
+							rightCounts[b] = rc;
+						}
+
+						aabb_t lb;
+						int lc = 0;
+						for (int b = 0; b < nb - 1; ++b) {
+							lb.grow(bins[b]);
+							lc += counts[b];
+							if (lc == 0 || rightCounts[b + 1] == 0) continue;
+							float cost = lb.area() * lc + rightBounds[b + 1].area() * rightCounts[b + 1];
+							if (cost < best.cost) {
+								best.cost = cost;
+								best.axis = a;
+								best.bin = b;
+								best.left = lb;
+								best.right = rightBounds[b + 1];
+							}
+						}
+					}
+					return best;
+				}
+
+				/**
+				* Chop every reference into the spatial bins it overlaps and sweep the
+				* bin planes. Entry and exit counts give the reference counts per side.
+				*/
+				split_t findSpatialSplit(std::vector<sref_t> const& refs, aabb_t const& bounds) const {
+					split_t best;
+					const int nb = params.numBins;
+					std::vector<aabb_t> bins(nb);
+					std::vector<int> entries(nb), exits(nb);
+					std::vector<aabb_t> rightBounds(nb);
+					std::vector<int> rightCounts(nb);
+
+					for (int a = 0; a < 3; ++a) {
+						const float lo = bounds.lo[a], width = (bounds.hi[a] - lo) / nb;
+						if (width <= 0.f) continue;
+
+						std::fill(bins.begin(), bins.end(), aabb_t());
+						std::fill(entries.begin(), entries.end(), 0);
+						std::fill(exits.begin(), exits.end(), 0);
+
+						for (auto const& ref: refs) {
+							int b0 = glm::clamp((int)((ref.bounds.lo[a] - lo) / width), 0, nb - 1);
+							int b1 = glm::clamp((int)((ref.bounds.hi[a] - lo) / width), b0, nb - 1);
+							entries[b0]++;
+							exits[b1]++;
+
+							sref_t rest = ref;
+							for (int b = b0; b < b1; ++b) {
+								aabb_t left, right;
+								splitReference(rest, a, lo + (b + 1) * width, left, right);
+								bins[b].grow(left);
+								rest.bounds = right;
+							}
+							bins[b1].grow(rest.bounds);
+						}
+
+						aabb_t rb;
+						int rc = 0;
+						for (int b = nb - 1; b > 0; --b) {
+							rb.grow(bins[b]);
+							rc += exits[b];
+							rightBounds[b] = rb;
+							rightCounts[b] = rc;
+						}
+
+						aabb_t lb;
+						int lc = 0;
+						for (int b = 0; b < nb - 1; ++b) {
+							lb.grow(bins[b]);
+							lc += entries[b];
+							if (lc == 0 || rightCounts[b + 1] == 0) continue;
+							float cost = lb.area() * lc + rightBounds[b + 1].area() * rightCounts[b + 1];
+							if (cost < best.cost) {
+								best.cost = cost;
+								best.axis = a;
+								best.bin = b;
+								best.spatial = true;
+								best.left = lb;
+								best.right = rightBounds[b + 1];
+							}
+						}
+					}
+					return best;
+				}
+
+				void partitionObject(std::vector<sref_t>& refs, aabb_t const& centroids, split_t const& split,
+									 std::vector<sref_t>& left, std::vector<sref_t>& right) const {
+					const int nb = params.numBins;
+					const float lo = centroids.lo[split.axis];
+					const float scale = nb / (centroids.hi[split.axis] - lo);
+					for (auto const& ref: refs) {
+						int b = std::min(nb - 1, (int)((ref.bounds.centroid()[split.axis] - lo) * scale));
+						(b <= split.bin ? left : right).push_back(ref);
+					}
+				}
+
+				/**
+				* Distribute the references over the split plane. A straddling reference
+				* goes to one side only when that is cheaper than splitting it
+				* (reference unsplitting).
+				*/
+				void partitionSpatial(std::vector<sref_t>& refs, aabb_t const& bounds, split_t const& split,
+									  std::vector<sref_t>& left, std::vector<sref_t>& right) {
+					const int a = split.axis;
+					const float width = (bounds.hi[a] - bounds.lo[a]) / params.numBins;
+					const float pos = bounds.lo[a] + (split.bin + 1) * width;
+
+					aabb_t lb, rb;
+					std::vector<sref_t> straddling;
+					for (auto const& ref: refs) {
+						int b0 = glm::clamp((int)((ref.bounds.lo[a] - bounds.lo[a]) / width), 0, params.numBins - 1);
+						int b1 = glm::clamp((int)((ref.bounds.hi[a] - bounds.lo[a]) / width), b0, params.numBins - 1);
+						if (b1 <= split.bin) {
+							left.push_back(ref);
+							lb.grow(ref.bounds);
+						} else if (b0 > split.bin) {
+							right.push_back(ref);
+							rb.grow(ref.bounds);
+						} else {
+							straddling.push_back(ref);
+						}
+					}
+
+					for (auto const& ref: straddling) {
+						aabb_t l, r;
+						splitReference(ref, a, pos, l, r);
+
+						const float nl = left.size(), nr = right.size();
+						aabb_t lsplit = lb, rsplit = rb, lall = lb, rall = rb;
+						lsplit.grow(l);
+						rsplit.grow(r);
+						lall.grow(ref.bounds);
+						rall.grow(ref.bounds);
+
+						const float costSplit = lsplit.area() * (nl + 1) + rsplit.area() * (nr + 1);
+						const float costLeft = lall.area() * (nl + 1) + rb.area() * nr;
+						const float costRight = lb.area() * nl + rall.area() * (nr + 1);
+
+						if (costLeft <= costSplit && costLeft <= costRight) {
+							left.push_back(ref);
+							lb = lall;
+						} else if (costRight <= costSplit || !l.valid() || !r.valid() || extraRefs >= maxExtraRefs) {
+							right.push_back(ref);
+							rb = rall;
+						} else {
+							sref_t lref = ref, rref = ref;
+							lref.bounds = l;
+							rref.bounds = r;
+							left.push_back(lref);
+							right.push_back(rref);
+							lb = lsplit;
+							rb = rsplit;
+							extraRefs++;
+						}
+					}
+				}
+
+				uint32_t makeLeaf(uint32_t nodeIdx, std::vector<sref_t> const& refs) {
+					nodes[nodeIdx].offset = indices.size();
+					nodes[nodeIdx].count = refs.size();
+					for (auto const& ref: refs)
+						indices.push_back(ref.prim);
+					return nodeIdx;
+				}
+
+				uint32_t build(std::vector<sref_t>& refs, int depth) {
+					const uint32_t nodeIdx = nodes.size();
+					nodes.push_back(bvh_node_t());
+
+					aabb_t bounds, centroids;
+					for (auto const& ref: refs) {
+						bounds.grow(ref.bounds);
+						centroids.grow(ref.bounds.centroid());
+					}
+					nodes[nodeIdx].bounds = bounds;
+
+					const uint32_t count = refs.size();
+					if (count <= 1 || depth >= kMaxBuildDepth)
+						return makeLeaf(nodeIdx, refs);
+
+					split_t best = findObjectSplit(refs, centroids);
+
+					// spatial splits only pay off where the object split children overlap
+					if (extraRefs < maxExtraRefs) {
+						float overlap = best.axis >= 0 ? intersect(best.left, best.right).area() : bounds.area();
+						if (overlap > minOverlap) {
+							split_t spatial = findSpatialSplit(refs, bounds);
+							if (spatial.cost < best.cost)
+								best = spatial;
+						}
+					}
+
+					const float leafCost = params.intersectionCost * count;
+					const float splitCost = best.axis < 0 ? std::numeric_limits<float>::max() :
+						params.traversalCost + params.intersectionCost * best.cost / bounds.area();
+					if (best.axis < 0 || (splitCost >= leafCost && count <= (uint32_t)params.maxLeafSize))
+						return makeLeaf(nodeIdx, refs);
+
+					std::vector<sref_t> left, right;
+					if (best.spatial)
+						partitionSpatial(refs, bounds, best, left, right);
+					if (!best.spatial || left.empty() || right.empty()) {
+						left.clear();
+						right.clear();
+						split_t object = findObjectSplit(refs, centroids);
+						if (object.axis < 0) {
+							// coincident centroids, split the list in half
+							left.assign(refs.begin(), refs.begin() + count / 2);
+							right.assign(refs.begin() + count / 2, refs.end());
+						} else {
+							partitionObject(refs, centroids, object, left, right);
+						}
+					}
+					std::vector<sref_t>().swap(refs);
+
+					build(left, depth + 1);
+					nodes[nodeIdx].offset = build(right, depth + 1);
+					nodes[nodeIdx].count = 0;
+					return nodeIdx;
+				}
+			};
+		}
+
+		void build_sbvh(std::vector<point_t> const& vertices, bvh_t& bvh, build_params_t const& params) {
+			bvh.nodes.clear();
+			bvh.indices.clear();
+			bvh.unbounded.clear();
+
+			const size_t numTriangles = vertices.size() / 3;
+			std::vector<sref_t> refs(numTriangles);
+			aabb_t root;
+			for (size_t i = 0; i < numTriangles; ++i) {
+				refs[i].prim = i;
+				for (int k = 0; k < 3; ++k)
+					refs[i].bounds.grow(vertices[3 * i + k]);
+				root.grow(refs[i].bounds);
+			}
+			if (refs.empty()) return;
+
+			const float budget = params.splitBudget > 0.f ? params.splitBudget : 0.f;
+			sbvh_builder_t builder(params, vertices, bvh, (size_t)(budget * numTriangles), 1e-5f * root.area());
+			bvh.nodes.reserve(2 * numTriangles);
+			bvh.indices.reserve(numTriangles + builder.maxExtraRefs);
+			builder.build(refs, 0);
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,352 @@
+#include "sphere_store.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NEWBRAY_X86 1
+#endif
+
+namespace donkey {
+
+	namespace accel {
+
+		namespace {
+
+			// widest kernel, lanes loaded past the last object read padding
+			const uint32_t kMaxLanes = 16;
+
+			// relative slack that keeps the kernels conservative against on_sphere rounding
+			const float kSlack = 1.f / 65536;
+
+			/**
+			* Ray terms shared by all spheres, in the order on_sphere computes them
+			*/
+			struct sphere_ray_t {
+				float 	ox, oy, oz;
+				float 	dx, dy, dz;
+				float 	fourDD;				// 4 * |d|^2
+				float 	inv2DD;				// 1 / (2 * |d|^2)
+
+				explicit sphere_ray_t(geom::ray_t const& ray):
+					ox(ray.point.x), oy(ray.point.y), oz(ray.point.z),
+					dx(ray.direction.x), dy(ray.direction.y), dz(ray.direction.z) {
+					const float dd = glm::dot(ray.direction, ray.direction);
+					fourDD = 4 * dd;
+					inv2DD = 1 / (2 * dd);
+				}
+			};
+
+			typedef int32_t (*gather_kernel_t)(sphere_store_t const&, sphere_ray_t const&,
+											   uint32_t const*, uint32_t, float, float&);
+			typedef int32_t (*range_kernel_t)(sphere_store_t const&, sphere_ray_t const&,
+											  uint32_t, uint32_t, float, float&);
+
+			/**
+			* Entry distance of the ray into sphere i, negative when it misses or
+			* starts inside or behind it. Grazing rays and origins on the surface
+			* count as hits, the caller confirms them with on_sphere.
+			*/
+			inline float enter_scalar(sphere_store_t const& s, sphere_ray_t const& r, uint32_t i) {
+				const float px = r.ox - s.cx[i], py = r.oy - s.cy[i], pz = r.oz - s.cz[i];
+				const float ec = 2.0f * (r.dx * px + r.dy * py + r.dz * pz);
+				const float pod = px * px + py * py + pz * pz;
+				const float dt = ec * ec - r.fourDD * (pod - s.radius2[i]);
+				const float slack = kSlack * (ec * ec + r.fourDD * (pod + s.radius2[i]));
+				if (dt < -slack) return -1.f;
+				const float root = std::sqrt(std::max(dt, 0.f));
+				const float t = r.inv2DD * (-ec - root);
+				if (t < -kSlack * r.inv2DD * (-ec + root)) return -1.f;
+				return std::max(t, 0.f);
+			}
+
+			int32_t gather_scalar(sphere_store_t const& s, sphere_ray_t const& r,
+								  uint32_t const* idx, uint32_t count, float tMax, float& t) {
+				int32_t best = -1;
+				float bestT = tMax;
+				for (uint32_t k = 0; k < count; ++k) {
+					const float tk = enter_scalar(s, r, idx[k]);
+					if (tk >= 0 && tk <= bestT) {
+						bestT = tk;
+						best = idx[k];
+					}
+				}
+				if (best >= 0) t = bestT;
+				return best;
+			}
+
+			int32_t range_scalar(sphere_store_t const& s, sphere_ray_t const& r,
+								 uint32_t begin, uint32_t end, float tMax, float& t) {
+				int32_t best = -1;
+				float bestT = tMax;
+				for (uint32_t i = begin; i < end; ++i) {
+					const float ti = enter_scalar(s, r, i);
+					if (ti >= 0 && ti <= bestT) {
+						bestT = ti;
+						best = i;
+					}
+				}
+				if (best >= 0) t = bestT;
+				return best;
+			}
+
+			template <int Lanes>
+			inline int32_t reduce_lanes(float const* ts, int32_t const* ids, float& t) {
+				int32_t best = -1;
+				float bestT = std::numeric_limits<float>::infinity();
+				for (int k = 0; k < Lanes; ++k) {
+					if (ids[k] >= 0 && ts[k] < bestT) {
+						bestT = ts[k];
+						best = ids[k];
+					}
+				}
+				if (best >= 0) t = bestT;
+				return best;
+			}
+
+#if defined(NEWBRAY_X86)
+			__attribute__((target("avx2")))
+			inline __m256 enter_avx2(sphere_ray_t const& r, __m256 cx, __m256 cy, __m256 cz, __m256 r2, __m256& valid) {
+				const __m256 px = _mm256_sub_ps(_mm256_set1_ps(r.ox), cx);
+				const __m256 py = _mm256_sub_ps(_mm256_set1_ps(r.oy), cy);
+				const __m256 pz = _mm256_sub_ps(_mm256_set1_ps(r.oz), cz);
+				const __m256 dot = _mm256_add_ps(_mm256_add_ps(
+					_mm256_mul_ps(_mm256_set1_ps(r.dx), px),
+					_mm256_mul_ps(_mm256_set1_ps(r.dy), py)),
+					_mm256_mul_ps(_mm256_set1_ps(r.dz), pz));
+				const __m256 ec = _mm256_mul_ps(_mm256_set1_ps(2.0f), dot);
+				const __m256 pod = _mm256_add_ps(_mm256_add_ps(
+					_mm256_mul_ps(px, px), _mm256_mul_ps(py, py)), _mm256_mul_ps(pz, pz));
+				const __m256 ec2 = _mm256_mul_ps(ec, ec);
+				const __m256 fourDD = _mm256_set1_ps(r.fourDD);
+				const __m256 slack = _mm256_set1_ps(kSlack);
+				const __m256 dt = _mm256_sub_ps(ec2, _mm256_mul_ps(fourDD, _mm256_sub_ps(pod, r2)));
+				const __m256 dtMin = _mm256_mul_ps(slack, _mm256_sub_ps(_mm256_setzero_ps(),
+					_mm256_add_ps(ec2, _mm256_mul_ps(fourDD, _mm256_add_ps(pod, r2)))));
+				const __m256 zero = _mm256_setzero_ps();
+				const __m256 root = _mm256_sqrt_ps(_mm256_max_ps(dt, zero));
+				const __m256 inv2DD = _mm256_set1_ps(r.inv2DD);
+				const __m256 t = _mm256_mul_ps(inv2DD, _mm256_sub_ps(_mm256_sub_ps(zero, ec), root));
+				const __m256 tFar = _mm256_mul_ps(inv2DD, _mm256_add_ps(_mm256_sub_ps(zero, ec), root));
+				const __m256 tMin = _mm256_mul_ps(_mm256_sub_ps(zero, slack), tFar);
+				valid = _mm256_and_ps(_mm256_cmp_ps(dt, dtMin, _CMP_GE_OQ), _mm256_cmp_ps(t, tMin, _CMP_GE_OQ));
+				return _mm256_max_ps(t, zero);
+			}
+
+			__attribute__((target("avx2")))
+			int32_t gather_avx2(sphere_store_t const& s, sphere_ray_t const& r,
+								uint32_t const* idx, uint32_t count, float tMax, float& t) {
+				__m256 best = _mm256_set1_ps(tMax);
+				__m256i bestIdx = _mm256_set1_epi32(-1);
+				alignas(32) int32_t ids[8];
+				for (uint32_t k = 0; k < count; k += 8) {
+					for (uint32_t l = 0; l < 8; ++l)
+						ids[l] = (k + l < count) ? (int32_t)idx[k + l] : (int32_t)s.numObjects;
+					const __m256i vi = _mm256_load_si256((__m256i const*)ids);
+					__m256 valid;
+					const __m256 tk = enter_avx2(r,
+						_mm256_i32gather_ps(s.cx.data(), vi, 4), _mm256_i32gather_ps(s.cy.data(), vi, 4),
+						_mm256_i32gather_ps(s.cz.data(), vi, 4), _mm256_i32gather_ps(s.radius2.data(), vi, 4), valid);
+					const __m256 closer = _mm256_and_ps(valid, _mm256_cmp_ps(tk, best, _CMP_LE_OQ));
+					best = _mm256_blendv_ps(best, tk, closer);
+					bestIdx = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIdx), _mm256_castsi256_ps(vi), closer));
+				}
+				alignas(32) float ts[8];
+				_mm256_store_ps(ts, best);
+				_mm256_store_si256((__m256i*)ids, bestIdx);
+				return reduce_lanes<8>(ts, ids, t);
+			}
+
+			__attribute__((target("avx2")))
+			int32_t range_avx2(sphere_store_t const& s, sphere_ray_t const& r,
+							   uint32_t begin, uint32_t end, float tMax, float& t) {
+				__m256 best = _mm256_set1_ps(tMax);
+				__m256i bestIdx = _mm256_set1_epi32(-1);
+				const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+				const __m256i last = _mm256_set1_epi32((int32_t)end - 1);
+				for (uint32_t i = begin; i < end; i += 8) {
+					const __m256i vi = _mm256_add_epi32(_mm256_set1_epi32(i), lane);
+					__m256 valid;
+					const __m256 ti = enter_avx2(r,
+						_mm256_loadu_ps(&s.cx[i]), _mm256_loadu_ps(&s.cy[i]),
+						_mm256_loadu_ps(&s.cz[i]), _mm256_loadu_ps(&s.radius2[i]), valid);
+					const __m256 pastEnd = _mm256_castsi256_ps(_mm256_cmpgt_epi32(vi, last));
+					const __m256 closer = _mm256_andnot_ps(pastEnd, _mm256_and_ps(valid, _mm256_cmp_ps(ti, best, _CMP_LE_OQ)));
+					best = _mm256_blendv_ps(best, ti, closer);
+					bestIdx = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIdx), _mm256_castsi256_ps(vi), closer));
+				}
+				alignas(32) float ts[8];
+				alignas(32) int32_t ids[8];
+				_mm256_store_ps(ts, best);
+				_mm256_store_si256((__m256i*)ids, bestIdx);
+				return reduce_lanes<8>(ts, ids, t);
+			}
+
+			__attribute__((target("avx512f")))
+			inline __m512 enter_avx512(sphere_ray_t const& r, __m512 cx, __m512 cy, __m512 cz, __m512 r2, __mmask16& valid) {
+				const __m512 px = _mm512_sub_ps(_mm512_set1_ps(r.ox), cx);
+				const __m512 py = _mm512_sub_ps(_mm512_set1_ps(r.oy), cy);
+				const __m512 pz = _mm512_sub_ps(_mm512_set1_ps(r.oz), cz);
+				const __m512 dot = _mm512_add_ps(_mm512_add_ps(
+					_mm512_mul_ps(_mm512_set1_ps(r.dx), px),
+					_mm512_mul_ps(_mm512_set1_ps(r.dy), py)),
+					_mm512_mul_ps(_mm512_set1_ps(r.dz), pz));
+				const __m512 ec = _mm512_mul_ps(_mm512_set1_ps(2.0f), dot);
+				const __m512 pod = _mm512_add_ps(_mm512_add_ps(
+					_mm512_mul_ps(px, px), _mm512_mul_ps(py, py)), _mm512_mul_ps(pz, pz));
+				const __m512 ec2 = _mm512_mul_ps(ec, ec);
+				const __m512 fourDD = _mm512_set1_ps(r.fourDD);
+				const __m512 slack = _mm512_set1_ps(kSlack);
+				const __m512 dt = _mm512_sub_ps(ec2, _mm512_mul_ps(fourDD, _mm512_sub_ps(pod, r2)));
+				const __m512 dtMin = _mm512_mul_ps(slack, _mm512_sub_ps(_mm512_setzero_ps(),
+					_mm512_add_ps(ec2, _mm512_mul_ps(fourDD, _mm512_add_ps(pod, r2)))));
+				const __m512 zero = _mm512_setzero_ps();
+				const __m512 root = _mm512_sqrt_ps(_mm512_max_ps(dt, zero));
+				const __m512 inv2DD = _mm512_set1_ps(r.inv2DD);
+				const __m512 t = _mm512_mul_ps(inv2DD, _mm512_sub_ps(_mm512_sub_ps(zero, ec), root));
+				const __m512 tFar = _mm512_mul_ps(inv2DD, _mm512_add_ps(_mm512_sub_ps(zero, ec), root));
+				const __m512 tMin = _mm512_mul_ps(_mm512_sub_ps(zero, slack), tFar);
+				valid = _mm512_cmp_ps_mask(dt, dtMin, _CMP_GE_OQ) & _mm512_cmp_ps_mask(t, tMin, _CMP_GE_OQ);
+				return _mm512_max_ps(t, zero);
+			}
+
+			__attribute__((target("avx512f")))
+			int32_t gather_avx512(sphere_store_t const& s, sphere_ray_t const& r,
+								  uint32_t const* idx, uint32_t count, float tMax, float& t) {
+				__m512 best = _mm512_set1_ps(tMax);
+				__m512i bestIdx = _mm512_set1_epi32(-1);
+				alignas(64) int32_t ids[16];
+				for (uint32_t k = 0; k < count; k += 16) {
+					for (uint32_t l = 0; l < 16; ++l)
+						ids[l] = (k + l < count) ? (int32_t)idx[k + l] : (int32_t)s.numObjects;
+					const __m512i vi = _mm512_load_si512(ids);
+					__mmask16 valid;
+					const __m512 tk = enter_avx512(r,
+						_mm512_i32gather_ps(vi, s.cx.data(), 4), _mm512_i32gather_ps(vi, s.cy.data(), 4),
+						_mm512_i32gather_ps(vi, s.cz.data(), 4), _mm512_i32gather_ps(vi, s.radius2.data(), 4), valid);
+					const __mmask16 closer = valid & _mm512_cmp_ps_mask(tk, best, _CMP_LE_OQ);
+					best = _mm512_mask_blend_ps(closer, best, tk);
+					bestIdx = _mm512_mask_blend_epi32(closer, bestIdx, vi);
+				}
+				alignas(64) float ts[16];
+				_mm512_store_ps(ts, best);
+				_mm512_store_si512(ids, bestIdx);
+				return reduce_lanes<16>(ts, ids, t);
+			}
+
+			__attribute__((target("avx512f")))
+			int32_t range_avx512(sphere_store_t const& s, sphere_ray_t const& r,
+								 uint32_t begin, uint32_t end, float tMax, float& t) {
+				__m512 best = _mm512_set1_ps(tMax);
+				__m512i bestIdx = _mm512_set1_epi32(-1);
+				const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+				for (uint32_t i = begin; i < end; i += 16) {
+					const __m512i vi = _mm512_add_epi32(_mm512_set1_epi32(i), lane);
+					const __mmask16 inRange = (end - i >= 16) ? 0xffff : (__mmask16)((1u << (end - i)) - 1);
+					__mmask16 valid;
+					const __m512 ti = enter_avx512(r,
+						_mm512_loadu_ps(&s.cx[i]), _mm512_loadu_ps(&s.cy[i]),
+						_mm512_loadu_ps(&s.cz[i]), _mm512_loadu_ps(&s.radius2[i]), valid);
+					const __mmask16 closer = inRange & valid & _mm512_cmp_ps_mask(ti, best, _CMP_LE_OQ);
+					best = _mm512_mask_blend_ps(closer, best, ti);
+					bestIdx = _mm512_mask_blend_epi32(closer, bestIdx, vi);
+				}
+				alignas(64) float ts[16];
+				alignas(64) int32_t ids[16];
+				_mm512_store_ps(ts, best);
+				_mm512_store_si512(ids, bestIdx);
+				return reduce_lanes<16>(ts, ids, t);
+			}
+#endif
+
+			struct kernels_t {
+				gather_kernel_t 	gather;
+				range_kernel_t 		range;
+				const char* 		name;
+
+				kernels_t(): gather(gather_scalar), range(range_scalar), name("scalar") {
+					pick("avx512") || pick("avx2");
+				}
+
+				bool pick(std::string const& kernel) {
+					if (kernel == "scalar") {
+						gather = gather_scalar;
+						range = range_scalar;
+						name = "scalar";
+						return true;
+					}
+#if defined(NEWBRAY_X86)
+					__builtin_cpu_init();
+					if (kernel == "avx512" && __builtin_cpu_supports("avx512f")) {
+						gather = gather_avx512;
+						range = range_avx512;
+						name = "avx512";
+						return true;
+					}
+					if (kernel == "avx2" && __builtin_cpu_supports("avx2")) {
+						gather = gather_avx2;
+						range = range_avx2;
+						name = "avx2";
+						return true;
+					}
+#endif
+					return false;
+				}
+			};
+
+			kernels_t& kernels() {
+				static kernels_t picked;
+				return picked;
+			}
+		}
+
+		const char* sphere_kernel_name() {
+			return kernels().name;
+		}
+
+		bool use_sphere_kernel(std::string const& name) {
+			return kernels().pick(name);
+		}
+
+		void sphere_store_t::build(compiled_scene_t const& scene) {
+			numObjects = scene.objects.size();
+			// never hit spheres past the objects stand in for unused gather lanes and
+			// cover the full width loads of ranges ending at the last object
+			const size_t padded = numObjects + kMaxLanes;
+			cx.assign(padded, 0.f);
+			cy.assign(padded, 0.f);
+			cz.assign(padded, 0.f);
+			radius2.assign(padded, -std::numeric_limits<float>::max());
+			isSphere.assign(numObjects, 0);
+			material.assign(numObjects, 0);
+
+			for (uint32_t i = 0; i < numObjects; ++i) {
+				compiled_scene_t::object_t const& handle = scene.objects[i];
+				if (handle.type != object::kSphere) continue;
+				compiled_scene_t::sphere_t const& sphere = scene.spheres[handle.index];
+				cx[i] = sphere.center.x;
+				cy[i] = sphere.center.y;
+				cz[i] = sphere.center.z;
+				radius2[i] = sphere.radius * sphere.radius;
+				isSphere[i] = 1;
+				material[i] = handle.material;
+			}
+		}
+
+		int32_t sphere_store_t::nearest(geom::ray_t const& ray, uint32_t const* objectIdx, uint32_t count,
+										float tMax, float& t) const {
+			const sphere_ray_t r(ray);
+			if (!std::isfinite(r.inv2DD)) return -1;
+			return kernels().gather(*this, r, objectIdx, count, tMax, t);
+		}
+
+		int32_t sphere_store_t::nearestInRange(geom::ray_t const& ray, uint32_t begin, uint32_t end,
+											   float tMax, float& t) const {
+			const sphere_ray_t r(ray);
+			if (!std::isfinite(r.inv2DD) || begin >= end) return -1;
+			return kernels().range(*this, r, begin, end, tMax, t);
+		}
+	}
+}
\ No newline at end of file
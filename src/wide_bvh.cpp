@@ -0,0 +1,142 @@
+#include "wide_bvh.h"
+
+namespace donkey {
+
+	namespace accel {
+
+		namespace {
+
+			template <int Width>
+			struct collapser_t {
+				bvh_t const& 						bvh;
+				std::vector< wide_node_t<Width> >& 	out;
+
+				collapser_t(bvh_t const& binary, std::vector< wide_node_t<Width> >& nodes):
+					bvh(binary), out(nodes) {}
+
+				uint32_t collapse(uint32_t root) {
+					uint32_t children[Width];
+					int numChildren = 0;
+
+					bvh_node_t const& node = bvh.nodes[root];
+					if (node.isLeaf()) {
+						children[numChildren++] = root;
+					} else {
+						children[numChildren++] = root + 1;
+						children[numChildren++] = node.offset;
+					}
+
+					// open the largest interior child until the node is full
+					while (numChildren < Width) {
+						int best = -1;
+						float bestArea = -1.f;
+						for (int i = 0; i < numChildren; ++i) {
+							bvh_node_t const& c = bvh.nodes[children[i]];
+							if (!c.isLeaf() && c.bounds.area() > bestArea) {
+								bestArea = c.bounds.area();
+								best = i;
+							}
+						}
+						if (best < 0) break;
+
+						uint32_t opened = children[best];
+						children[best] = opened + 1;
+						children[numChildren++] = bvh.nodes[opened].offset;
+					}
+
+					const uint32_t idx = out.size();
+					out.push_back(wide_node_t<Width>());
+
+					for (int i = 0; i < numChildren; ++i) {
+						bvh_node_t const& c = bvh.nodes[children[i]];
+						uint32_t child, count;
+						if (c.isLeaf()) {
+							child = c.offset;
+							count = c.count;
+						} else {
+							child = collapse(children[i]);
+							count = 0;
+						}
+						wide_node_t<Width>& dst = out[idx];
+						dst.setBounds(i, c.bounds);
+						dst.child[i] = child;
+						dst.count[i] = count;
+					}
+					return idx;
+				}
+			};
+		}
+
+		template <int Width>
+		void collapse(bvh_t const& bvh, wide_bvh_t<Width>& wide) {
+			wide.nodes.clear();
+			wide.indices = bvh.indices;
+			wide.unbounded = bvh.unbounded;
+			if (bvh.nodes.empty()) return;
+
+			wide.nodes.reserve(bvh.nodes.size() / (Width - 1) + 1);
+			collapser_t<Width> collapser(bvh, wide.nodes);
+			collapser.collapse(0);
+		}
+
+		namespace {
+
+			template <int Width>
+			inline aabb_t lane_bounds(wide_node_t<Width> const& node, int lane) {
+				return aabb_t(
+					point_t(node.lo[0][lane], node.lo[1][lane], node.lo[2][lane]),
+					point_t(node.hi[0][lane], node.hi[1][lane], node.hi[2][lane]));
+			}
+
+			template <int Width>
+			inline aabb_t node_bounds(wide_node_t<Width> const& node) {
+				aabb_t box;
+				for (int lane = 0; lane < Width; ++lane)
+					box.grow(lane_bounds(node, lane));
+				return box;
+			}
+		}
+
+		template <int Width>
+		void refit(wide_bvh_t<Width>& wide, std::vector<aabb_t> const& bounds) {
+			// child nodes are allocated after their parent, so a reverse sweep is bottom-up
+			for (size_t i = wide.nodes.size(); i-- > 0; ) {
+				wide_node_t<Width>& node = wide.nodes[i];
+				for (int lane = 0; lane < Width; ++lane) {
+					if (node.count[lane]) {
+						aabb_t box;
+						for (uint32_t k = node.child[lane], e = node.child[lane] + node.count[lane]; k < e; ++k)
+							box.grow(bounds[wide.indices[k]]);
+						node.setBounds(lane, box);
+					} else if (node.child[lane] != 0) {
+						// lanes without a leaf point at a child node, except unused ones at 0 (the root)
+						node.setBounds(lane, node_bounds(wide.nodes[node.child[lane]]));
+					}
+				}
+			}
+		}
+
+		template <int Width>
+		float sah_cost(wide_bvh_t<Width> const& wide, build_params_t const& params) {
+			if (wide.nodes.empty()) return 0.f;
+			const float rootArea = node_bounds(wide.nodes[0]).area();
+			if (rootArea <= 0.f) return 0.f;
+
+			float cost = params.traversalCost * rootArea;
+			for (auto const& node: wide.nodes) {
+				for (int lane = 0; lane < Width; ++lane) {
+					float weight = node.count[lane] ? params.intersectionCost * node.count[lane] : params.traversalCost;
+					cost += weight * lane_bounds(node, lane).area();
+				}
+			}
+			return cost / rootArea;
+		}
+
+		template void collapse<4>(bvh_t const&, wide_bvh_t<4>&);
+		template void collapse<8>(bvh_t const&, wide_bvh_t<8>&);
+		template void refit<4>(wide_bvh_t<4>&, std::vector<aabb_t> const&);
+		template void refit<8>(wide_bvh_t<8>&, std::vector<aabb_t> const&);
+		template float sah_cost<4>(wide_bvh_t<4> const&, build_params_t const&);
+		template float sah_cost<8>(wide_bvh_t<8> const&, build_params_t const&);
+	}
+}
\ No newline at end of file